@@ -1831,6 +1831,12 @@ QemuOptsList bdrv_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "discard operation (ignore/off, unmap/on)",
         },
+        {
+            .name = BDRV_OPT_DISCARD_COALESCE_NS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "time window for merging adjacent discard and write "
+                    "zeroes requests in nanoseconds (default: 0, disabled)",
+        },
         {
             .name = BDRV_OPT_FORCE_SHARE,
             .type = QEMU_OPT_BOOL,
@@ -1982,6 +1988,15 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
         goto fail_opts;
     }
 
+    bs->coalesce_ns =
+        qemu_opt_get_number(opts, BDRV_OPT_DISCARD_COALESCE_NS, 0);
+    if (bs->coalesce_ns > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "'" BDRV_OPT_DISCARD_COALESCE_NS
+                   "' must not exceed one second");
+        ret = -EINVAL;
+        goto fail_opts;
+    }
+
     if (filename != NULL) {
         pstrcpy(bs->filename, sizeof(bs->filename), filename);
     } else {
@@ -4923,6 +4938,15 @@ bdrv_reopen_prepare(BDRVReopenState *reopen_state, BlockReopenQueue *queue,
         goto error;
     }
 
+    reopen_state->coalesce_ns =
+        qemu_opt_get_number_del(opts, BDRV_OPT_DISCARD_COALESCE_NS, 0);
+    if (reopen_state->coalesce_ns > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "'" BDRV_OPT_DISCARD_COALESCE_NS
+                   "' must not exceed one second");
+        ret = -EINVAL;
+        goto error;
+    }
+
     /* All other options (including node-name and driver) must be unchanged.
      * Put them back into the QDict, so that they are checked at the end
      * of this function. */
@@ -5126,6 +5150,7 @@ static void GRAPH_UNLOCKED bdrv_reopen_commit(BDRVReopenState *reopen_state)
     bs->options            = reopen_state->options;
     bs->open_flags         = reopen_state->flags;
     bs->detect_zeroes      = reopen_state->detect_zeroes;
+    bs->coalesce_ns        = reopen_state->coalesce_ns;
 
     /* Remove child references from bs->options and bs->explicit_options.
      * Child options were already removed in bdrv_reopen_queue_child() */
@@ -36,6 +36,17 @@
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+/*
+ * Limits for adaptive background copying (see block_copy_adapt()).  Chunk
+ * size and number of workers start from the INIT values, grow additively
+ * while the throughput measured over a slice keeps up, and are halved when
+ * it drops or the per-byte latency of the tasks balloons.
+ */
+#define BLOCK_COPY_ADAPT_MAX_CHUNK (16 * MiB)
+#define BLOCK_COPY_ADAPT_CHUNK_STEP (256 * KiB)
+#define BLOCK_COPY_ADAPT_INIT_WORKERS 8
+#define BLOCK_COPY_ADAPT_SLICE_TIME 100000000LL /* ns */
+
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
@@ -53,6 +64,7 @@ typedef struct BlockCopyCallState {
     int64_t bytes;
     int max_workers;
     int64_t max_chunk;
+    bool adaptive;
     bool ignore_ratelimit;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
@@ -78,6 +90,21 @@ typedef struct BlockCopyCallState {
      * anymore and may be safely read without mutex.
      */
     int ret;
+
+    /*
+     * Current limits and measurements of adaptive copying, only used if
+     * @adaptive is true.  Protected by lock in BlockCopyState.
+     */
+    int64_t adapt_chunk;
+    int adapt_workers;
+    bool adapt_grow_workers; /* which limit to increase next */
+    int64_t slice_start_ns;
+    int64_t slice_bytes;
+    int64_t slice_task_ns; /* sum of task latencies */
+    bool slice_failed;
+    bool slice_throttled; /* measurements are meaningless, skip the slice */
+    int64_t last_throughput; /* bytes per second in the previous slice */
+    int64_t min_ns_per_mb; /* lowest task latency seen, per MiB copied */
 } BlockCopyCallState;
 
 typedef struct BlockCopyTask {
@@ -98,6 +125,9 @@ typedef struct BlockCopyTask {
      */
     BlockCopyMethod method;
 
+    /* Set when the task starts running, for adaptive copying */
+    int64_t start_ns;
+
     /*
      * Generally, req is protected by lock in BlockCopyState, Still req.offset
      * is only set on task creation, so may be read concurrently after creation.
@@ -181,6 +211,108 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
     }
 }
 
+/* Called with lock held */
+static int64_t block_copy_adapt_max_chunk(BlockCopyState *s,
+                                          BlockCopyCallState *call_state)
+{
+    int64_t max_chunk;
+
+    if (s->method == COPY_READ_WRITE_CLUSTER) {
+        return s->cluster_size;
+    }
+
+    max_chunk = MIN(MAX(s->cluster_size, BLOCK_COPY_ADAPT_MAX_CHUNK),
+                    s->max_transfer);
+    return MIN_NON_ZERO(max_chunk, call_state->max_chunk);
+}
+
+/*
+ * Called with lock held.
+ *
+ * Account a finished task of an adaptive call and, once per slice, adjust
+ * its chunk size and number of workers: increase one of them additively
+ * while the throughput does not drop and the tasks do not slow down much
+ * compared to the fastest ones seen so far; otherwise halve both.
+ */
+static void block_copy_adapt(BlockCopyTask *task, int ret)
+{
+    BlockCopyState *s = task->s;
+    BlockCopyCallState *call_state = task->call_state;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t max_chunk = block_copy_adapt_max_chunk(s, call_state);
+    int64_t elapsed, throughput, ns_per_mb;
+    bool increase;
+
+    if (ret < 0) {
+        call_state->slice_failed = true;
+    } else if (task->method != COPY_WRITE_ZEROES) {
+        int64_t task_ns = now - task->start_ns;
+
+        call_state->slice_bytes += task->req.bytes;
+        call_state->slice_task_ns += task_ns;
+        ns_per_mb = task_ns * MiB / task->req.bytes;
+        if (!call_state->min_ns_per_mb ||
+            ns_per_mb < call_state->min_ns_per_mb) {
+            call_state->min_ns_per_mb = MAX(ns_per_mb, 1);
+        }
+    }
+
+    elapsed = now - call_state->slice_start_ns;
+    if (elapsed < BLOCK_COPY_ADAPT_SLICE_TIME) {
+        return;
+    }
+
+    if (call_state->slice_throttled ||
+        (!call_state->slice_failed && !call_state->slice_bytes)) {
+        /* The rate limit, not the target, decided about the throughput */
+        goto next_slice;
+    }
+
+    if (call_state->slice_failed) {
+        /* Like packet loss in TCP, treat failed requests as congestion */
+        increase = false;
+        throughput = 0;
+    } else {
+        throughput = muldiv64(call_state->slice_bytes, NANOSECONDS_PER_SECOND,
+                              elapsed);
+        ns_per_mb = call_state->slice_task_ns * MiB / call_state->slice_bytes;
+        increase = throughput >= call_state->last_throughput -
+                                 call_state->last_throughput / 16 &&
+                   ns_per_mb <= 4 * call_state->min_ns_per_mb;
+        call_state->last_throughput = throughput;
+    }
+
+    if (increase) {
+        if (call_state->adapt_grow_workers &&
+            call_state->adapt_workers < call_state->max_workers) {
+            call_state->adapt_workers++;
+        } else if (call_state->adapt_chunk < max_chunk) {
+            call_state->adapt_chunk += MAX(QEMU_ALIGN_DOWN(
+                BLOCK_COPY_ADAPT_CHUNK_STEP, s->cluster_size),
+                s->cluster_size);
+        } else if (call_state->adapt_workers < call_state->max_workers) {
+            call_state->adapt_workers++;
+        }
+        call_state->adapt_grow_workers = !call_state->adapt_grow_workers;
+    } else {
+        call_state->adapt_workers = MAX(call_state->adapt_workers / 2, 1);
+        call_state->adapt_chunk = QEMU_ALIGN_DOWN(call_state->adapt_chunk / 2,
+                                                  s->cluster_size);
+    }
+    call_state->adapt_chunk = MIN(MAX(call_state->adapt_chunk,
+                                      s->cluster_size), max_chunk);
+
+    trace_block_copy_adapt(s, throughput, call_state->adapt_chunk,
+                           call_state->adapt_workers);
+
+next_slice:
+    call_state->slice_start_ns = now;
+    call_state->slice_bytes = 0;
+    call_state->slice_task_ns = 0;
+    call_state->slice_failed = false;
+    call_state->slice_throttled = false;
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
  * the beginning of it.
@@ -193,7 +325,13 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
     int64_t max_chunk;
 
     QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    if (call_state->adaptive) {
+        max_chunk = MIN(call_state->adapt_chunk,
+                        block_copy_adapt_max_chunk(s, call_state));
+    } else {
+        max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s),
+                                 call_state->max_chunk);
+    }
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -586,6 +724,8 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyMethod method = t->method;
     int ret = -1;
 
+    t->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = block_copy_do_copy(s, t->req.offset, t->req.bytes, &method,
                                  &error_is_read);
@@ -596,6 +736,10 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             s->method = method;
         }
 
+        if (t->call_state->adaptive) {
+            block_copy_adapt(t, ret);
+        }
+
         if (ret < 0) {
             if (!t->call_state->ret) {
                 t->call_state->ret = ret;
@@ -804,6 +948,11 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         if (!call_state->ignore_ratelimit) {
             uint64_t ns = ratelimit_calculate_delay(&s->rate_limit, 0);
             if (ns > 0) {
+                if (call_state->adaptive) {
+                    WITH_QEMU_LOCK_GUARD(&s->lock) {
+                        call_state->slice_throttled = true;
+                    }
+                }
                 block_copy_task_end(task, -EAGAIN);
                 g_free(task);
                 qemu_co_sleep_ns_wakeable(&call_state->sleep,
@@ -821,7 +970,18 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         offset = task_end(task);
         bytes = end - offset;
 
-        if (!aio && bytes) {
+        if (call_state->adaptive) {
+            int workers;
+
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                workers = call_state->adapt_workers;
+            }
+            if (!aio && bytes) {
+                aio = aio_task_pool_new(workers);
+            } else if (aio) {
+                aio_task_pool_set_max_busy_tasks(aio, workers);
+            }
+        } else if (!aio && bytes) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
 
@@ -972,6 +1132,7 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t start, int64_t bytes,
 BlockCopyCallState *block_copy_async(BlockCopyState *s,
                                      int64_t offset, int64_t bytes,
                                      int max_workers, int64_t max_chunk,
+                                     bool adaptive,
                                      BlockCopyAsyncCallbackFunc cb,
                                      void *cb_opaque)
 {
@@ -983,12 +1144,24 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .adaptive = adaptive,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
         .co = qemu_coroutine_create(block_copy_async_co_entry, call_state),
     };
 
+    if (adaptive) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            call_state->adapt_chunk =
+                MIN(block_copy_chunk_size(s),
+                    block_copy_adapt_max_chunk(s, call_state));
+        }
+        call_state->adapt_workers = MIN(max_workers,
+                                        BLOCK_COPY_ADAPT_INIT_WORKERS);
+        call_state->slice_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+
     qemu_coroutine_enter(call_state->co);
 
     return call_state;
@@ -0,0 +1,1549 @@
+/*
+ * Persistent cache block driver
+ *
+ * Keeps recently used clusters of a slow node ("file", e.g. NBD, NFS, rbd or
+ * curl) in a fast local node ("cache-file").  The cache-file starts with a
+ * header, followed by an index with one entry per cache slot and the slots
+ * themselves:
+ *
+ *   +--------+-------------------+-----------------------------------+
+ *   | header | index (4k pages)  | slot 0 | slot 1 | ... | slot n-1  |
+ *   +--------+-------------------+-----------------------------------+
+ *
+ * Index updates are only written out on flush.  A slot that has been evicted
+ * is not reused before the index no longer refers to it, and cached data is
+ * flushed before the index that points to it is written, so the on-disk index
+ * never maps a cluster to a slot holding some other data.
+ *
+ * In writethrough mode, a crash between updating the slow node and the cache
+ * may leave stale data in the cache, so the whole cache is dropped after an
+ * unclean shutdown.  In writeback mode, all cached clusters are treated as
+ * dirty after an unclean shutdown instead.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qobject/qdict.h"
+#include "trace.h"
+
+#define CACHE_MAGIC                 0x51454d5543414348ULL /* "QEMUCACH" */
+#define CACHE_VERSION               1
+#define CACHE_HEADER_SIZE           4096
+
+/* Header flags */
+#define CACHE_HEADER_IN_USE         (1U << 0) /* not shut down cleanly */
+#define CACHE_HEADER_DIRTY          (1U << 1) /* may hold dirty clusters */
+
+/* Index entry flags */
+#define CACHE_ENTRY_VALID           (1U << 0)
+#define CACHE_ENTRY_DIRTY           (1U << 1)
+
+#define CACHE_INDEX_PAGE_SIZE       4096
+#define CACHE_INDEX_PAGE_ENTRIES    (CACHE_INDEX_PAGE_SIZE / \
+                                     sizeof(CacheIndexEntry))
+
+#define CACHE_DEFAULT_CLUSTER_SIZE  (64 * KiB)
+#define CACHE_MIN_CLUSTER_SIZE      (4 * KiB)
+#define CACHE_MAX_CLUSTER_SIZE      (2 * MiB)
+
+/* Maximum number of clusters filled from the cached node in one request */
+#define CACHE_MAX_FILL_CLUSTERS     16
+
+/*
+ * Maximum number of clean clusters evicted at once when the cache is full, so
+ * that the index is not written for every single eviction
+ */
+#define CACHE_EVICT_BATCH           16
+
+/* Maximum number of clusters looked at by one block status query */
+#define CACHE_MAX_STATUS_CLUSTERS   1024
+
+typedef struct QEMU_PACKED CacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t child_size;
+    char child_name[1024];
+} CacheHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(CacheHeader) > CACHE_HEADER_SIZE);
+
+typedef struct QEMU_PACKED CacheIndexEntry {
+    uint64_t cluster;
+    uint64_t generation;
+    uint32_t flags;
+    uint32_t reserved[3];
+} CacheIndexEntry;
+
+QEMU_BUILD_BUG_ON(CACHE_INDEX_PAGE_SIZE % sizeof(CacheIndexEntry));
+
+typedef enum CacheSlotState {
+    CACHE_SLOT_FREE,
+    CACHE_SLOT_FILLING,     /* data is being written to the slot */
+    CACHE_SLOT_VALID,
+    CACHE_SLOT_WRITEBACK,   /* dirty data is being written back */
+} CacheSlotState;
+
+typedef struct CacheSlot {
+    int64_t cluster;
+    uint64_t generation;
+    CacheSlotState state;
+    bool dirty;
+    bool hashed;            /* found by cluster lookups */
+    unsigned pins;          /* in-flight users, prevent reuse */
+    CoQueue waiters;        /* waiting for FILLING/WRITEBACK to finish */
+
+    /* On the LRU list if hashed, otherwise on the free or pending list */
+    QTAILQ_ENTRY(CacheSlot) entry;
+} CacheSlot;
+
+typedef struct BDRVCacheState {
+    BdrvChild *cache;
+    BlockdevCacheMode mode;
+    uint32_t cluster_size;
+    int cluster_bits;
+    int64_t child_size;
+
+    /* Layout of the cache-file */
+    uint64_t nb_slots;
+    uint64_t nb_index_pages;
+    uint64_t index_offset;
+    uint64_t data_offset;
+
+    /* Protects everything below */
+    CoMutex lock;
+
+    /* NULL while the node is inactive */
+    CacheSlot *slots;
+    GHashTable *map;
+    QTAILQ_HEAD(, CacheSlot) lru;
+    QTAILQ_HEAD(, CacheSlot) free;
+    /* Evicted, but still referenced by the on-disk index */
+    QTAILQ_HEAD(, CacheSlot) pending;
+    uint64_t generation;
+    uint64_t nb_dirty;
+
+    /* In-memory copy of the index, and the pages that differ from disk */
+    CacheIndexEntry *index;
+    unsigned long *index_dirty;
+
+    /* Data was written back, but the cached node was not flushed yet */
+    bool writeback_unflushed;
+} BDRVCacheState;
+
+#define CACHE_OPT_MODE "mode"
+#define CACHE_OPT_CLUSTER_SIZE "cluster-size"
+static QemuOptsList runtime_opts = {
+    .name = "cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = CACHE_OPT_MODE,
+            .type = QEMU_OPT_STRING,
+            .help = "write handling (writethrough, writeback)",
+        },
+        {
+            .name = CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "caching granularity, default 64k",
+        },
+        { /* end of list */ }
+    },
+};
+
+static const char *const cache_strong_runtime_opts[] = {
+    CACHE_OPT_MODE,
+    CACHE_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static inline uint64_t cache_slot_idx(BDRVCacheState *s, CacheSlot *slot)
+{
+    return slot - s->slots;
+}
+
+static inline int64_t cache_slot_offset(BDRVCacheState *s, CacheSlot *slot)
+{
+    return s->data_offset + (cache_slot_idx(s, slot) << s->cluster_bits);
+}
+
+static CacheSlot *cache_lookup(BDRVCacheState *s, int64_t cluster)
+{
+    return g_hash_table_lookup(s->map, &cluster);
+}
+
+/* Bring the in-memory index entry of @slot up to date */
+static void cache_index_update(BDRVCacheState *s, CacheSlot *slot)
+{
+    uint64_t idx = cache_slot_idx(s, slot);
+    CacheIndexEntry *e = &s->index[idx];
+    uint32_t flags = 0;
+
+    if (slot->hashed && slot->state != CACHE_SLOT_FILLING) {
+        flags = CACHE_ENTRY_VALID | (slot->dirty ? CACHE_ENTRY_DIRTY : 0);
+    }
+
+    e->cluster = cpu_to_be64(flags ? slot->cluster : 0);
+    e->generation = cpu_to_be64(flags ? slot->generation : 0);
+    e->flags = cpu_to_be32(flags);
+    set_bit(idx / CACHE_INDEX_PAGE_ENTRIES, s->index_dirty);
+}
+
+static void cache_slot_set_dirty(BDRVCacheState *s, CacheSlot *slot,
+                                 bool dirty)
+{
+    if (slot->dirty != dirty) {
+        slot->dirty = dirty;
+        if (dirty) {
+            s->nb_dirty++;
+        } else {
+            s->nb_dirty--;
+        }
+        cache_index_update(s, slot);
+    }
+}
+
+static void cache_slot_touch(BDRVCacheState *s, CacheSlot *slot)
+{
+    QTAILQ_REMOVE(&s->lru, slot, entry);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, entry);
+}
+
+/* Make an unhashed, unused slot available again once the index is written */
+static void cache_slot_release(BDRVCacheState *s, CacheSlot *slot)
+{
+    assert(!slot->hashed && !slot->pins);
+
+    slot->state = CACHE_SLOT_FREE;
+    QTAILQ_INSERT_TAIL(&s->pending, slot, entry);
+}
+
+static void cache_slot_unpin(BDRVCacheState *s, CacheSlot *slot)
+{
+    assert(slot->pins > 0);
+    if (--slot->pins == 0 && !slot->hashed) {
+        cache_slot_release(s, slot);
+    }
+}
+
+/* Remove @slot from the cache; it is released once the last user is done */
+static void coroutine_fn cache_slot_drop(BDRVCacheState *s, CacheSlot *slot)
+{
+    assert(slot->hashed);
+
+    g_hash_table_remove(s->map, &slot->cluster);
+    QTAILQ_REMOVE(&s->lru, slot, entry);
+    slot->hashed = false;
+    cache_slot_set_dirty(s, slot, false);
+    cache_index_update(s, slot);
+    qemu_co_queue_restart_all(&slot->waiters);
+
+    if (!slot->pins) {
+        cache_slot_release(s, slot);
+    }
+}
+
+static void cache_slot_fill_start(BDRVCacheState *s, CacheSlot *slot,
+                                  int64_t cluster)
+{
+    assert(slot->state == CACHE_SLOT_FREE && !slot->pins);
+
+    slot->cluster = cluster;
+    slot->generation = s->generation++;
+    slot->state = CACHE_SLOT_FILLING;
+    slot->hashed = true;
+    slot->pins = 1;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, entry);
+}
+
+static void coroutine_fn cache_slot_fill_done(BDRVCacheState *s,
+                                              CacheSlot *slot, bool ok)
+{
+    assert(slot->state == CACHE_SLOT_FILLING);
+
+    slot->state = CACHE_SLOT_VALID;
+    if (ok) {
+        cache_index_update(s, slot);
+        qemu_co_queue_restart_all(&slot->waiters);
+    } else {
+        cache_slot_drop(s, slot);
+    }
+    cache_slot_unpin(s, slot);
+}
+
+/*
+ * Look up and pin the slot caching @cluster.  Waits until the slot can be
+ * read (or written, if @write is true).  Returns NULL if @cluster is not
+ * cached.
+ */
+static CacheSlot * coroutine_fn
+cache_co_get_slot(BDRVCacheState *s, int64_t cluster, bool write)
+{
+    for (;;) {
+        CacheSlot *slot = cache_lookup(s, cluster);
+
+        if (!slot) {
+            return NULL;
+        }
+        if (slot->state == CACHE_SLOT_VALID ||
+            (!write && slot->state == CACHE_SLOT_WRITEBACK))
+        {
+            slot->pins++;
+            cache_slot_touch(s, slot);
+            return slot;
+        }
+        qemu_co_queue_wait(&slot->waiters, &s->lock);
+    }
+}
+
+/*
+ * Write the changed parts of the index to the cache-file.  Afterwards,
+ * evicted slots can be reused.  Called with s->lock held (or while the node
+ * is quiescent).
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_persist_index(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t page;
+    int ret;
+
+    page = find_first_bit(s->index_dirty, s->nb_index_pages);
+    if (page == s->nb_index_pages) {
+        /* Slots released after their removal from the index was written */
+        QTAILQ_CONCAT(&s->free, &s->pending, entry);
+        return 0;
+    }
+
+    /* Written back data must be stable before the cache forgets about it */
+    if (s->writeback_unflushed) {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            goto out;
+        }
+        s->writeback_unflushed = false;
+    }
+
+    /* Cached data must be stable before the index refers to it */
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (; page < s->nb_index_pages;
+         page = find_next_bit(s->index_dirty, s->nb_index_pages, page + 1))
+    {
+        ret = bdrv_pwrite(s->cache,
+                          s->index_offset + page * CACHE_INDEX_PAGE_SIZE,
+                          CACHE_INDEX_PAGE_SIZE,
+                          s->index + page * CACHE_INDEX_PAGE_ENTRIES, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    bitmap_zero(s->index_dirty, s->nb_index_pages);
+    QTAILQ_CONCAT(&s->free, &s->pending, entry);
+
+out:
+    trace_cache_persist_index(bs, ret);
+    return ret;
+}
+
+/* Copy the cluster cached in @slot back to the cached node */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_writeback_io(BlockDriverState *bs, CacheSlot *slot, void *buf)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t offset = slot->cluster << s->cluster_bits;
+    int64_t bytes = MIN(s->cluster_size, s->child_size - offset);
+    int ret;
+
+    ret = bdrv_pread(s->cache, cache_slot_offset(s, slot), bytes, buf, 0);
+    if (ret >= 0) {
+        ret = bdrv_pwrite(bs->file, offset, bytes, buf, 0);
+    }
+    trace_cache_writeback(bs, offset, ret);
+
+    if (ret >= 0) {
+        s->writeback_unflushed = true;
+    }
+    return ret;
+}
+
+/* Write back all dirty clusters; only called while the node is quiescent */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_writeback_all(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheSlot *slot;
+    void *buf;
+    int ret = 0;
+
+    if (!s->nb_dirty) {
+        return 0;
+    }
+    if (!(bs->file->perm & BLK_PERM_WRITE)) {
+        return -EPERM;
+    }
+
+    buf = qemu_try_blockalign(bs, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    QTAILQ_FOREACH(slot, &s->lru, entry) {
+        if (slot->dirty) {
+            ret = cache_writeback_io(bs, slot, buf);
+            if (ret < 0) {
+                break;
+            }
+            cache_slot_set_dirty(s, slot, false);
+        }
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Write back the least recently used dirty cluster, so that it can be
+ * evicted.  Called with s->lock held, which is dropped during the I/O.
+ */
+static bool coroutine_fn GRAPH_RDLOCK
+cache_co_writeback_lru(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheSlot *slot;
+    void *buf;
+    int ret;
+
+    if (!(bs->file->perm & BLK_PERM_WRITE)) {
+        return false;
+    }
+
+    QTAILQ_FOREACH(slot, &s->lru, entry) {
+        if (slot->state == CACHE_SLOT_VALID && slot->dirty && !slot->pins) {
+            break;
+        }
+    }
+    if (!slot) {
+        return false;
+    }
+
+    slot->state = CACHE_SLOT_WRITEBACK;
+    slot->pins++;
+    qemu_co_mutex_unlock(&s->lock);
+
+    buf = qemu_try_blockalign(bs, s->cluster_size);
+    ret = buf ? cache_writeback_io(bs, slot, buf) : -ENOMEM;
+    qemu_vfree(buf);
+
+    qemu_co_mutex_lock(&s->lock);
+    slot->state = CACHE_SLOT_VALID;
+    if (ret >= 0) {
+        cache_slot_set_dirty(s, slot, false);
+    }
+    qemu_co_queue_restart_all(&slot->waiters);
+    cache_slot_unpin(s, slot);
+
+    return ret >= 0;
+}
+
+/* Evict the least recently used clean clusters */
+static int coroutine_fn cache_evict(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheSlot *slot, *next;
+    int batch = MAX(1, MIN(CACHE_EVICT_BATCH, s->nb_slots / 16));
+    int n = 0;
+
+    QTAILQ_FOREACH_SAFE(slot, &s->lru, entry, next) {
+        if (slot->state == CACHE_SLOT_VALID && !slot->dirty && !slot->pins) {
+            cache_slot_drop(s, slot);
+            if (++n == batch) {
+                break;
+            }
+        }
+    }
+
+    trace_cache_evict(bs, n);
+    return n;
+}
+
+/*
+ * Get a free slot, evicting clusters if necessary.  Called with s->lock held,
+ * which may be dropped temporarily.  Returns NULL if nothing can be evicted.
+ */
+static CacheSlot * coroutine_fn GRAPH_RDLOCK
+cache_co_alloc_slot(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheSlot *slot;
+
+    while (QTAILQ_EMPTY(&s->free)) {
+        if (QTAILQ_EMPTY(&s->pending) && !cache_evict(bs)) {
+            if (!cache_co_writeback_lru(bs)) {
+                return NULL;
+            }
+            continue;
+        }
+        if (cache_persist_index(bs) < 0) {
+            return NULL;
+        }
+    }
+
+    slot = QTAILQ_FIRST(&s->free);
+    QTAILQ_REMOVE(&s->free, slot, entry);
+    return slot;
+}
+
+/*
+ * Pin all cached clusters overlapping [@offset, @offset + @bytes), waiting
+ * for running writeback.  Called with s->lock held.
+ */
+static GPtrArray * coroutine_fn
+cache_co_pin_range(BDRVCacheState *s, int64_t offset, int64_t bytes)
+{
+    int64_t first = offset >> s->cluster_bits;
+    int64_t last = (offset + bytes - 1) >> s->cluster_bits;
+    GPtrArray *slots = g_ptr_array_new();
+    g_autoptr(GArray) clusters = g_array_new(false, false, sizeof(int64_t));
+    CacheSlot *slot;
+    int64_t c;
+    guint i;
+
+    if (last - first < s->nb_slots) {
+        for (c = first; c <= last; c++) {
+            g_array_append_val(clusters, c);
+        }
+    } else {
+        QTAILQ_FOREACH(slot, &s->lru, entry) {
+            if (slot->cluster >= first && slot->cluster <= last) {
+                g_array_append_val(clusters, slot->cluster);
+            }
+        }
+    }
+
+    for (i = 0; i < clusters->len; i++) {
+        slot = cache_co_get_slot(s, g_array_index(clusters, int64_t, i), true);
+        if (slot) {
+            g_ptr_array_add(slots, slot);
+        }
+    }
+
+    return slots;
+}
+
+/*
+ * Read clusters that are not cached from the cached node, starting at the
+ * cluster containing @offset, and add them to the cache.  Called with s->lock
+ * held, returns with it released.  *@pnum is set to the number of bytes of
+ * the request that were handled.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+              QEMUIOVector *qiov, size_t qiov_offset, int64_t *pnum)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheSlot *slots[CACHE_MAX_FILL_CLUSTERS];
+    bool ok[CACHE_MAX_FILL_CLUSTERS];
+    int64_t first = offset >> s->cluster_bits;
+    int64_t last = (offset + bytes - 1) >> s->cluster_bits;
+    int64_t start = first << s->cluster_bits;
+    int64_t len;
+    uint8_t *buf = NULL;
+    int nb = 0, i, ret;
+
+    while (nb < CACHE_MAX_FILL_CLUSTERS && first + nb <= last &&
+           !cache_lookup(s, first + nb))
+    {
+        CacheSlot *slot = cache_co_alloc_slot(bs);
+
+        if (!slot) {
+            break;
+        }
+        if (cache_lookup(s, first + nb)) {
+            /* Filled by another request while the lock was dropped */
+            QTAILQ_INSERT_HEAD(&s->free, slot, entry);
+            break;
+        }
+        cache_slot_fill_start(s, slot, first + nb);
+        slots[nb++] = slot;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (!nb) {
+        /* Nothing can be evicted right now, bypass the cache */
+        *pnum = MIN(bytes, start + s->cluster_size - offset);
+        return bdrv_co_preadv_part(bs->file, offset, *pnum, qiov, qiov_offset,
+                                   0);
+    }
+
+    *pnum = MIN(bytes, start + ((int64_t)nb << s->cluster_bits) - offset);
+    len = MIN((int64_t)nb << s->cluster_bits, s->child_size - start);
+    len = MAX(len, 0);
+
+    buf = qemu_try_blockalign(bs, (size_t)nb << s->cluster_bits);
+    if (!buf) {
+        ret = -ENOMEM;
+    } else {
+        memset(buf + len, 0, ((size_t)nb << s->cluster_bits) - len);
+        ret = len ? bdrv_co_pread(bs->file, start, len, buf, 0) : 0;
+    }
+    trace_cache_fill(bs, start, len, ret);
+
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), *pnum);
+    }
+
+    for (i = 0; i < nb; i++) {
+        ok[i] = ret >= 0 &&
+            bdrv_co_pwrite(s->cache, cache_slot_offset(s, slots[i]),
+                           s->cluster_size, buf + (i << s->cluster_bits),
+                           0) >= 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb; i++) {
+        cache_slot_fill_done(s, slots[i], ok[i]);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Serialise overlapping requests at cluster granularity: a cluster is then
+ * never filled from the cached node while a write to it is in flight, and
+ * writes to the same cluster reach the cached node and the cache in the same
+ * order.
+ */
+static void coroutine_fn cache_co_serialise(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    BdrvTrackedRequest *req = bdrv_co_get_self_request(bs);
+
+    assert(req);
+    bdrv_make_request_serialising(req, s->cluster_size);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, size_t qiov_offset,
+                     BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    if (!s->slots) {
+        /* Inactive */
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   0);
+    }
+
+    while (bytes) {
+        int64_t in_cluster = offset & (s->cluster_size - 1);
+        int64_t n = MIN(bytes, s->cluster_size - in_cluster);
+        CacheSlot *slot;
+        int ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        slot = cache_co_get_slot(s, offset >> s->cluster_bits, false);
+        if (slot) {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_preadv_part(s->cache,
+                                      cache_slot_offset(s, slot) + in_cluster,
+                                      n, qiov, qiov_offset, 0);
+            qemu_co_mutex_lock(&s->lock);
+            cache_slot_unpin(s, slot);
+            qemu_co_mutex_unlock(&s->lock);
+        } else {
+            ret = cache_co_fill(bs, offset, bytes, qiov, qiov_offset, &n);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write to the cached node, then apply the same write to any cached clusters
+ * in the range.  @qiov is NULL for write zeroes requests.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_write_through(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       QEMUIOVector *qiov, size_t qiov_offset,
+                       BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    g_autoptr(GPtrArray) slots = NULL;
+    g_autofree bool *failed = NULL;
+    int ret;
+    guint i;
+
+    qemu_co_mutex_lock(&s->lock);
+    slots = cache_co_pin_range(s, offset, bytes);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (qiov) {
+        ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    } else {
+        ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    }
+
+    failed = g_new0(bool, slots->len);
+    for (i = 0; i < slots->len; i++) {
+        CacheSlot *slot = g_ptr_array_index(slots, i);
+        int64_t cluster_start = slot->cluster << s->cluster_bits;
+        int64_t start = MAX(offset, cluster_start);
+        int64_t end = MIN(offset + bytes, cluster_start + s->cluster_size);
+        int64_t slot_offset = cache_slot_offset(s, slot) + start -
+                              cluster_start;
+        int r;
+
+        if (ret < 0) {
+            /* The cached node may or may not have been modified */
+            failed[i] = true;
+            continue;
+        }
+
+        if (qiov) {
+            r = bdrv_co_pwritev_part(s->cache, slot_offset, end - start, qiov,
+                                     qiov_offset + start - offset, 0);
+        } else {
+            r = bdrv_co_pwrite_zeroes(s->cache, slot_offset, end - start, 0);
+        }
+        if (r < 0) {
+            failed[i] = true;
+            if (slot->dirty) {
+                ret = r;
+            }
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < slots->len; i++) {
+        CacheSlot *slot = g_ptr_array_index(slots, i);
+
+        if (failed[i] && slot->hashed && !slot->dirty) {
+            cache_slot_drop(s, slot);
+        }
+        cache_slot_unpin(s, slot);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Write to the cache only, within a single cluster.  Returns -ENOENT if the
+ * cluster is not cached and cannot be allocated, in which case the caller
+ * writes through to the cached node.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_write_back(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                    QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t cluster = offset >> s->cluster_bits;
+    int64_t cluster_start = cluster << s->cluster_bits;
+    CacheSlot *slot;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    slot = cache_co_get_slot(s, cluster, true);
+    if (!slot) {
+        /* Partial clusters would first have to be read from the cached node */
+        if (offset != cluster_start ||
+            (bytes != s->cluster_size && offset + bytes < s->child_size))
+        {
+            qemu_co_mutex_unlock(&s->lock);
+            return -ENOENT;
+        }
+
+        slot = cache_co_alloc_slot(bs);
+        if (!slot) {
+            qemu_co_mutex_unlock(&s->lock);
+            return -ENOENT;
+        }
+
+        /* Requests on this cluster are serialised, nobody can have added it */
+        assert(!cache_lookup(s, cluster));
+        cache_slot_fill_start(s, slot, cluster);
+    }
+    cache_slot_set_dirty(s, slot, true);
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = bdrv_co_pwritev_part(s->cache,
+                               cache_slot_offset(s, slot) + offset -
+                               cluster_start,
+                               bytes, qiov, qiov_offset, 0);
+
+    qemu_co_mutex_lock(&s->lock);
+    if (slot->state == CACHE_SLOT_FILLING) {
+        cache_slot_fill_done(s, slot, ret >= 0);
+    } else {
+        cache_slot_unpin(s, slot);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      QEMUIOVector *qiov, size_t qiov_offset,
+                      BdrvRequestFlags flags)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    cache_co_serialise(bs);
+
+    if (s->mode == BLOCKDEV_CACHE_MODE_WRITETHROUGH) {
+        return cache_co_write_through(bs, offset, bytes, qiov, qiov_offset,
+                                      flags);
+    }
+
+    while (bytes) {
+        int64_t in_cluster = offset & (s->cluster_size - 1);
+        int64_t n = MIN(bytes, s->cluster_size - in_cluster);
+        int ret;
+
+        ret = cache_co_write_back(bs, offset, n, qiov, qiov_offset);
+        if (ret == -ENOENT) {
+            ret = cache_co_write_through(bs, offset, n, qiov, qiov_offset,
+                                         flags);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       BdrvRequestFlags flags)
+{
+    cache_co_serialise(bs);
+
+    /* Dirty clusters are zeroed in the cache and written back later */
+    return cache_co_write_through(bs, offset, bytes, NULL, 0, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVCacheState *s = bs->opaque;
+    g_autoptr(GPtrArray) slots = NULL;
+    guint i;
+
+    cache_co_serialise(bs);
+
+    /*
+     * Discarded data is undefined, so dirty clusters may keep their data, but
+     * clean ones must not disagree with the cached node later on.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    slots = cache_co_pin_range(s, offset, bytes);
+    for (i = 0; i < slots->len; i++) {
+        CacheSlot *slot = g_ptr_array_index(slots, i);
+
+        if (!slot->dirty) {
+            cache_slot_drop(s, slot);
+        }
+        cache_slot_unpin(s, slot);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK cache_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    if (!s->slots) {
+        return 0;
+    }
+
+    /* Both children are flushed to disk afterwards by the generic code */
+    qemu_co_mutex_lock(&s->lock);
+    ret = cache_persist_index(bs);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+cache_co_block_status(BlockDriverState *bs, unsigned int mode, int64_t offset,
+                      int64_t bytes, int64_t *pnum, int64_t *map,
+                      BlockDriverState **file)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t cluster = offset >> s->cluster_bits;
+    int64_t end = offset + bytes;
+    CacheSlot *slot;
+    int64_t c;
+    int ret;
+
+    *pnum = bytes;
+    *map = offset;
+    *file = bs->file->bs;
+
+    if (!s->slots || !s->nb_dirty) {
+        return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+    }
+
+    /* Dirty clusters are only found in the cache-file */
+    qemu_co_mutex_lock(&s->lock);
+    slot = cache_lookup(s, cluster);
+    if (slot && slot->dirty) {
+        *pnum = MIN(bytes, ((cluster + 1) << s->cluster_bits) - offset);
+        *map = cache_slot_offset(s, slot) + (offset & (s->cluster_size - 1));
+        *file = s->cache->bs;
+        ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+    } else {
+        for (c = cluster + 1;
+             (c << s->cluster_bits) < end &&
+             c - cluster < CACHE_MAX_STATUS_CLUSTERS;
+             c++)
+        {
+            slot = cache_lookup(s, c);
+            if (slot && slot->dirty) {
+                break;
+            }
+        }
+        *pnum = MIN(bytes, (c << s->cluster_bits) - offset);
+        ret = BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void cache_free_slots(BDRVCacheState *s)
+{
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+    qemu_vfree(s->index);
+    s->index = NULL;
+    g_free(s->index_dirty);
+    s->index_dirty = NULL;
+    s->nb_dirty = 0;
+    s->writeback_unflushed = false;
+}
+
+/* Set up the in-memory state for an empty cache with the current layout */
+static bool cache_init_slots(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t i;
+
+    cache_free_slots(s);
+
+    s->index = qemu_try_blockalign0(s->cache->bs,
+                                    s->nb_index_pages * CACHE_INDEX_PAGE_SIZE);
+    s->slots = g_try_new0(CacheSlot, s->nb_slots);
+    if (!s->index || !s->slots) {
+        cache_free_slots(s);
+        return false;
+    }
+    s->index_dirty = bitmap_new(s->nb_index_pages);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->free);
+    QTAILQ_INIT(&s->pending);
+    for (i = 0; i < s->nb_slots; i++) {
+        qemu_co_queue_init(&s->slots[i].waiters);
+        QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], entry);
+    }
+    s->generation = 1;
+
+    return true;
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_write_header(BlockDriverState *bs, uint32_t flags)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheHeader h = {
+        .magic          = cpu_to_be64(CACHE_MAGIC),
+        .version        = cpu_to_be32(CACHE_VERSION),
+        .flags          = cpu_to_be32(flags),
+        .cluster_size   = cpu_to_be32(s->cluster_size),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .index_offset   = cpu_to_be64(s->index_offset),
+        .data_offset    = cpu_to_be64(s->data_offset),
+        .child_size     = cpu_to_be64(s->child_size),
+    };
+    int ret;
+
+    strpadcpy(h.child_name, sizeof(h.child_name), bs->file->bs->filename,
+              '\0');
+
+    ret = bdrv_pwrite(s->cache, 0, sizeof(h), &h, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(s->cache->bs);
+}
+
+/* Header flags while the node is in use */
+static uint32_t cache_header_flags(BDRVCacheState *s)
+{
+    bool dirty = s->mode == BLOCKDEV_CACHE_MODE_WRITEBACK || s->nb_dirty;
+
+    return CACHE_HEADER_IN_USE | (dirty ? CACHE_HEADER_DIRTY : 0);
+}
+
+/* Lay out an empty cache over the whole cache-file */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_reset(BlockDriverState *bs, int64_t cache_len, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    uint64_t n = 0;
+    int ret;
+
+    if (cache_len > CACHE_HEADER_SIZE) {
+        n = (cache_len - CACHE_HEADER_SIZE) /
+            (s->cluster_size + sizeof(CacheIndexEntry));
+    }
+    for (; n > 0; n--) {
+        s->nb_index_pages = DIV_ROUND_UP(n, CACHE_INDEX_PAGE_ENTRIES);
+        s->index_offset = CACHE_HEADER_SIZE;
+        s->data_offset = ROUND_UP(s->index_offset +
+                                  s->nb_index_pages * CACHE_INDEX_PAGE_SIZE,
+                                  s->cluster_size);
+        if (s->data_offset + (n << s->cluster_bits) <= cache_len) {
+            break;
+        }
+    }
+    if (!n) {
+        error_setg(errp, "cache-file is too small for cluster size %" PRIu32,
+                   s->cluster_size);
+        return -EINVAL;
+    }
+    s->nb_slots = n;
+
+    if (!cache_init_slots(bs)) {
+        error_setg(errp, "Could not allocate the cache index");
+        return -ENOMEM;
+    }
+
+    /* The new header must not be paired with a stale index */
+    ret = bdrv_pwrite_zeroes(s->cache, s->index_offset,
+                             s->nb_index_pages * CACHE_INDEX_PAGE_SIZE, 0);
+    if (ret >= 0) {
+        ret = bdrv_flush(s->cache->bs);
+    }
+    if (ret >= 0) {
+        ret = cache_write_header(bs, cache_header_flags(s));
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not initialize the cache-file");
+        cache_free_slots(s);
+        return ret;
+    }
+
+    return 0;
+}
+
+static gint cache_slot_cmp_generation(gconstpointer a, gconstpointer b)
+{
+    const CacheSlot *sa = *(CacheSlot * const *)a;
+    const CacheSlot *sb = *(CacheSlot * const *)b;
+
+    return sa->generation < sb->generation ? -1 :
+           sa->generation > sb->generation;
+}
+
+/* Build the in-memory state from the index on disk */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_load_index(BlockDriverState *bs, bool all_dirty, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    int64_t nb_clusters = DIV_ROUND_UP(s->child_size, s->cluster_size);
+    g_autoptr(GPtrArray) valid = g_ptr_array_new();
+    uint64_t i;
+    int ret;
+
+    if (!cache_init_slots(bs)) {
+        error_setg(errp, "Could not allocate the cache index");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, s->index_offset,
+                     s->nb_index_pages * CACHE_INDEX_PAGE_SIZE, s->index, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache index");
+        cache_free_slots(s);
+        return ret;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        CacheIndexEntry *e = &s->index[i];
+        CacheSlot *slot = &s->slots[i];
+        CacheSlot *old;
+        uint32_t flags = be32_to_cpu(e->flags);
+
+        if (!(flags & CACHE_ENTRY_VALID)) {
+            continue;
+        }
+
+        QTAILQ_REMOVE(&s->free, slot, entry);
+        slot->cluster = be64_to_cpu(e->cluster);
+        slot->generation = be64_to_cpu(e->generation);
+        s->generation = MAX(s->generation, slot->generation + 1);
+
+        /*
+         * An interrupted index update can leave an evicted copy of a cluster
+         * behind, the newer one wins.
+         */
+        old = cache_lookup(s, slot->cluster);
+        if (old && old->generation > slot->generation) {
+            cache_index_update(s, slot);
+            cache_slot_release(s, slot);
+            continue;
+        }
+        if (old) {
+            g_hash_table_remove(s->map, &old->cluster);
+            g_ptr_array_remove_fast(valid, old);
+            old->hashed = false;
+            if (old->dirty) {
+                old->dirty = false;
+                s->nb_dirty--;
+            }
+            cache_index_update(s, old);
+            cache_slot_release(s, old);
+        }
+        if (slot->cluster < 0 || slot->cluster >= nb_clusters) {
+            cache_index_update(s, slot);
+            cache_slot_release(s, slot);
+            continue;
+        }
+
+        slot->state = CACHE_SLOT_VALID;
+        slot->hashed = true;
+        slot->dirty = all_dirty || (flags & CACHE_ENTRY_DIRTY);
+        if (slot->dirty) {
+            s->nb_dirty++;
+            if (all_dirty) {
+                cache_index_update(s, slot);
+            }
+        }
+        g_hash_table_insert(s->map, &slot->cluster, slot);
+        g_ptr_array_add(valid, slot);
+    }
+
+    /* Approximate the LRU order by the order in which clusters were cached */
+    g_ptr_array_sort(valid, cache_slot_cmp_generation);
+    for (i = 0; i < valid->len; i++) {
+        QTAILQ_INSERT_TAIL(&s->lru, (CacheSlot *)g_ptr_array_index(valid, i),
+                           entry);
+    }
+
+    return 0;
+}
+
+/*
+ * Open the cache stored in the cache-file, or start over with an empty cache
+ * if it does not match the current configuration or @reset is true.  Dirty
+ * data is never dropped: if it cannot be kept, opening the cache fails.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_load(BlockDriverState *bs, bool reset, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    CacheHeader h;
+    const char *reason = NULL;
+    int64_t cache_len;
+    uint32_t flags;
+    int ret;
+
+    s->child_size = bdrv_getlength(bs->file->bs);
+    if (s->child_size < 0) {
+        error_setg_errno(errp, -s->child_size,
+                         "Could not get the size of the cached node");
+        return s->child_size;
+    }
+
+    cache_len = bdrv_getlength(s->cache->bs);
+    if (cache_len < 0) {
+        error_setg_errno(errp, -cache_len,
+                         "Could not get the size of the cache-file");
+        return cache_len;
+    }
+
+    if (cache_len < sizeof(h)) {
+        return cache_reset(bs, cache_len, errp);
+    }
+
+    ret = bdrv_pread(s->cache, 0, sizeof(h), &h, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+    flags = be32_to_cpu(h.flags);
+
+    if (be64_to_cpu(h.magic) != CACHE_MAGIC ||
+        be32_to_cpu(h.version) != CACHE_VERSION) {
+        reason = "no cache";
+    } else if (reset) {
+        /* Inactivation writes everything back, this is from somewhere else */
+        if (flags & CACHE_HEADER_DIRTY) {
+            error_setg(errp, "cache-file holds data that was not written "
+                       "back, cannot activate the node");
+            return -EINVAL;
+        }
+        reason = "activated";
+    } else if (be32_to_cpu(h.cluster_size) != s->cluster_size ||
+               be64_to_cpu(h.child_size) != s->child_size ||
+               strncmp(h.child_name, bs->file->bs->filename,
+                       sizeof(h.child_name)))
+    {
+        if (flags & CACHE_HEADER_DIRTY) {
+            error_setg(errp, "cache-file may hold data that was not written "
+                       "back, but was created with cluster size %" PRIu32
+                       " for another or differently sized node",
+                       be32_to_cpu(h.cluster_size));
+            return -EINVAL;
+        }
+        reason = "configuration changed";
+    } else if ((flags & CACHE_HEADER_IN_USE) &&
+               !(flags & CACHE_HEADER_DIRTY)) {
+        reason = "unclean shutdown";
+    } else {
+        s->nb_slots = be64_to_cpu(h.nb_slots);
+        s->nb_index_pages = DIV_ROUND_UP(s->nb_slots,
+                                         CACHE_INDEX_PAGE_ENTRIES);
+        s->index_offset = be64_to_cpu(h.index_offset);
+        s->data_offset = be64_to_cpu(h.data_offset);
+
+        if (!s->nb_slots || s->index_offset != CACHE_HEADER_SIZE ||
+            s->data_offset < s->index_offset +
+                             s->nb_index_pages * CACHE_INDEX_PAGE_SIZE ||
+            !QEMU_IS_ALIGNED(s->data_offset, s->cluster_size) ||
+            s->data_offset > cache_len ||
+            s->nb_slots > (cache_len - s->data_offset) >> s->cluster_bits)
+        {
+            if (flags & CACHE_HEADER_DIRTY) {
+                error_setg(errp, "cache-file has an invalid layout");
+                return -EINVAL;
+            }
+            reason = "invalid layout";
+        }
+    }
+
+    if (reason) {
+        trace_cache_reset(bs, reason);
+        return cache_reset(bs, cache_len, errp);
+    }
+
+    ret = cache_load_index(bs, flags & CACHE_HEADER_IN_USE, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Dirty data left behind by writeback mode is not kept around */
+    if (s->mode == BLOCKDEV_CACHE_MODE_WRITETHROUGH && s->nb_dirty &&
+        (bs->file->perm & BLK_PERM_WRITE))
+    {
+        ret = cache_writeback_all(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write back cached data");
+            goto fail;
+        }
+    }
+
+    ret = cache_persist_index(bs);
+    if (ret >= 0) {
+        ret = cache_write_header(bs, cache_header_flags(s));
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the cache-file");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    cache_free_slots(s);
+    return ret;
+}
+
+/* Write out the index and mark the cache as cleanly shut down */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+cache_shutdown(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    ret = cache_persist_index(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return cache_write_header(bs, s->nb_dirty ? CACHE_HEADER_DIRTY : 0);
+}
+
+static bool cache_absorb_opts(BDRVCacheState *s, QDict *options,
+                              Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    uint64_t cluster_size;
+    bool ok = false;
+    int mode;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto out;
+    }
+
+    mode = qapi_enum_parse(&BlockdevCacheMode_lookup,
+                           qemu_opt_get(opts, CACHE_OPT_MODE),
+                           BLOCKDEV_CACHE_MODE_WRITETHROUGH, errp);
+    if (mode < 0) {
+        goto out;
+    }
+    s->mode = mode;
+
+    cluster_size = qemu_opt_get_size(opts, CACHE_OPT_CLUSTER_SIZE,
+                                     CACHE_DEFAULT_CLUSTER_SIZE);
+    if (!is_power_of_2(cluster_size) ||
+        cluster_size < CACHE_MIN_CLUSTER_SIZE ||
+        cluster_size > CACHE_MAX_CLUSTER_SIZE)
+    {
+        error_setg(errp, "cluster-size must be a power of two between 4k "
+                   "and 2M");
+        goto out;
+    }
+    s->cluster_size = cluster_size;
+    s->cluster_bits = ctz32(cluster_size);
+    ok = true;
+
+out:
+    qemu_opts_del(opts);
+    return ok;
+}
+
+static int GRAPH_UNLOCKED
+cache_open(BlockDriverState *bs, QDict *options, int flags, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The cache is written to even if the guest only reads */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY, "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_METADATA, false,
+                               errp);
+    if (!s->cache) {
+        return -EINVAL;
+    }
+
+    if (!cache_absorb_opts(s, options, errp)) {
+        return -EINVAL;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (!QEMU_IS_ALIGNED(s->cluster_size,
+                         bs->file->bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(s->cluster_size,
+                         s->cache->bs->bl.request_alignment))
+    {
+        error_setg(errp, "cluster-size must be a multiple of the request "
+                   "alignment of both children");
+        return -EINVAL;
+    }
+
+    bs->supported_zero_flags = (BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+        bs->file->bs->supported_zero_flags;
+
+    /* Without write access, the cache can only be set up on activation */
+    if (flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+
+    return cache_load(bs, false, errp);
+}
+
+static void GRAPH_UNLOCKED cache_close(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (s->slots) {
+        ret = cache_shutdown(bs);
+        if (ret < 0) {
+            error_report("Failed to write the cache index of node '%s': %s",
+                         bdrv_get_device_or_node_name(bs), strerror(-ret));
+        }
+    }
+    cache_free_slots(s);
+}
+
+static int GRAPH_RDLOCK cache_inactivate(BlockDriverState *bs)
+{
+    BDRVCacheState *s = bs->opaque;
+    int ret;
+
+    if (!s->slots) {
+        return 0;
+    }
+
+    /* The destination must see all data on the cached node */
+    ret = cache_writeback_all(bs);
+    if (ret >= 0) {
+        ret = cache_shutdown(bs);
+    }
+    if (ret < 0) {
+        error_report("Failed to write back the cache of node '%s': %s",
+                     bdrv_get_device_or_node_name(bs), strerror(-ret));
+        return ret;
+    }
+
+    cache_free_slots(s);
+    return 0;
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVCacheState *s = bs->opaque;
+
+    if (s->slots) {
+        return;
+    }
+
+    /*
+     * Another process may have written to the cached node while this node
+     * was inactive, so nothing in the cache can be trusted.
+     */
+    cache_load(bs, true, errp);
+}
+
+static int GRAPH_UNLOCKED
+cache_reopen_prepare(BDRVReopenState *reopen_state, BlockReopenQueue *queue,
+                     Error **errp)
+{
+    return 0;
+}
+
+static void GRAPH_RDLOCK
+cache_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                 BlockReopenQueue *reopen_queue, uint64_t perm, uint64_t shared,
+                 uint64_t *nperm, uint64_t *nshared)
+{
+    if (role & BDRV_CHILD_PRIMARY) {
+        bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                           nperm, nshared);
+        return;
+    }
+
+    /* The cache-file is written even if the guest only reads */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    *nshared = BLK_PERM_ALL & ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE;
+    } else {
+        *nshared = BLK_PERM_ALL;
+    }
+}
+
+/*
+ * Not a filter: in writeback mode, the data of this node can differ from the
+ * data of its file child.
+ */
+static BlockDriver bdrv_cache = {
+    .format_name                        = "cache",
+    .instance_size                      = sizeof(BDRVCacheState),
+
+    .bdrv_open                          = cache_open,
+    .bdrv_close                         = cache_close,
+    .bdrv_reopen_prepare                = cache_reopen_prepare,
+    .bdrv_child_perm                    = cache_child_perm,
+
+    .bdrv_co_getlength                  = cache_co_getlength,
+    .bdrv_co_block_status               = cache_co_block_status,
+
+    .bdrv_co_preadv_part                = cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = cache_co_pdiscard,
+    .bdrv_co_flush_to_os                = cache_co_flush_to_os,
+
+    .bdrv_inactivate                    = cache_inactivate,
+    .bdrv_co_invalidate_cache           = cache_co_invalidate_cache,
+
+    .strong_runtime_opts                = cache_strong_runtime_opts,
+};
+
+static void bdrv_cache_init(void)
+{
+    bdrv_register(&bdrv_cache);
+}
+
+block_init(bdrv_cache_init);
@@ -80,7 +80,9 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockExport *exp = NULL;
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
-    AioContext *ctx;
+    AioContext *ctx, *new_ctx = NULL;
+    AioContext **iothread_ctxs = NULL;
+    size_t num_iothread_ctxs = 0;
     uint64_t perm;
     int ret;
 
@@ -101,6 +103,17 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         return NULL;
     }
 
+    if (export->iothreads) {
+        if (export->iothread) {
+            error_setg(errp, "iothread and iothreads are mutually exclusive");
+            return NULL;
+        }
+        if (!drv->supports_multithread) {
+            error_setg(errp, "Export type does not support multiple iothreads");
+            return NULL;
+        }
+    }
+
     bs = bdrv_lookup_bs(NULL, export->node_name, errp);
     if (!bs) {
         return NULL;
@@ -118,8 +131,6 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
 
     if (export->iothread) {
         IOThread *iothread;
-        AioContext *new_ctx;
-        Error **set_context_errp;
 
         iothread = iothread_by_id(export->iothread);
         if (!iothread) {
@@ -128,6 +139,28 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         }
 
         new_ctx = iothread_get_aio_context(iothread);
+    } else if (export->iothreads) {
+        strList *e;
+
+        iothread_ctxs = g_new(AioContext *,
+                              QAPI_LIST_LENGTH(export->iothreads));
+        for (e = export->iothreads; e; e = e->next) {
+            IOThread *iothread = iothread_by_id(e->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", e->value);
+                goto fail;
+            }
+            iothread_ctxs[num_iothread_ctxs++] =
+                iothread_get_aio_context(iothread);
+        }
+
+        /* The block node lives in the first iothread */
+        new_ctx = iothread_ctxs[0];
+    }
+
+    if (new_ctx) {
+        Error **set_context_errp;
 
         /* Ignore errors with fixed-iothread=false */
         set_context_errp = fixed_iothread ? errp : NULL;
@@ -193,6 +226,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .id         = g_strdup(export->id),
         .ctx        = ctx,
         .blk        = blk,
+        .iothread_ctxs      = iothread_ctxs,
+        .num_iothread_ctxs  = num_iothread_ctxs,
     };
 
     ret = drv->create(exp, export, errp);
@@ -214,6 +249,7 @@ fail:
         g_free(exp->id);
         g_free(exp);
     }
+    g_free(iothread_ctxs);
     return NULL;
 }
 
@@ -234,6 +270,7 @@ static void blk_exp_delete_bh(void *opaque)
     blk_set_dev_ops(exp->blk, NULL, NULL);
     blk_unref(exp->blk);
     qapi_event_send_block_export_deleted(exp->id);
+    g_free(exp->iothread_ctxs);
     g_free(exp->id);
     g_free(exp);
 }
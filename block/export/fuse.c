@@ -27,6 +27,7 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
 #include "qemu/main-loop.h"
 #include "system/block-backend.h"
 
@@ -44,14 +45,51 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* Number of request buffers each queue keeps around for reuse */
+#define FUSE_MAX_FREE_REQUESTS 16
 
-typedef struct FuseExport {
+
+typedef struct FuseExport FuseExport;
+typedef struct FuseRequest FuseRequest;
+
+/*
+ * A FUSE queue processes requests in one AioContext.  All queues of an export
+ * poll the same session FD (which is non-blocking), and the kernel hands each
+ * request to exactly one of the readers.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    AioContext *ctx;
+    bool fd_handler_set_up;
+
+    /* Request buffers available for reuse, only accessed from @ctx */
+    QSLIST_HEAD(, FuseRequest) free_requests;
+    unsigned int num_free_requests;
+} FuseQueue;
+
+/*
+ * A single FUSE request.  It owns the buffer the request was read into, so
+ * that several requests can be processed concurrently in coroutines.
+ */
+struct FuseRequest {
+    FuseQueue *q;
+    struct fuse_buf buf;
+    QSLIST_ENTRY(FuseRequest) next;
+};
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
-    bool mounted, fd_handler_set_up;
+    bool mounted;
+
+    /*
+     * One queue per iothread given with the 'iothreads' option, or a single
+     * queue that follows the BlockBackend's AioContext
+     */
+    FuseQueue *queues;
+    size_t num_queues;
 
     char *mountpoint;
     bool writable;
@@ -62,7 +100,7 @@ typedef struct FuseExport {
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -79,14 +117,33 @@ static void read_from_fuse_export(void *opaque);
 static bool is_regular_file(const char *path, Error **errp);
 
 
+/**
+ * Install (@enable true) or remove the session FD handler of all queues.
+ */
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    int fd = fuse_session_fd(exp->fuse_session);
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        if (q->fd_handler_set_up == enable) {
+            continue;
+        }
+
+        aio_set_fd_handler(q->ctx, fd,
+                           enable ? read_from_fuse_export : NULL,
+                           NULL, NULL, NULL, enable ? q : NULL);
+        q->fd_handler_set_up = enable;
+    }
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -96,10 +153,12 @@ static void fuse_export_drained_end(void *opaque)
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /* Only a single queue follows the BlockBackend around */
+    if (!exp->common.iothread_ctxs) {
+        exp->queues[0].ctx = exp->common.ctx;
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -121,6 +180,7 @@ static int fuse_export_create(BlockExport *blk_exp,
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
     BlockExportOptionsFuse *args = &blk_exp_args->u.fuse;
+    size_t i;
     int ret;
 
     assert(blk_exp_args->type == BLOCK_EXPORT_TYPE_FUSE);
@@ -147,6 +207,21 @@ static int fuse_export_create(BlockExport *blk_exp,
      */
     blk_set_disable_request_queuing(exp->common.blk, true);
 
+    if (blk_exp->iothread_ctxs) {
+        exp->num_queues = blk_exp->num_iothread_ctxs;
+    } else {
+        exp->num_queues = 1;
+    }
+    exp->queues = g_new0(FuseQueue, exp->num_queues);
+    for (i = 0; i < exp->num_queues; i++) {
+        exp->queues[i] = (FuseQueue) {
+            .exp = exp,
+            .ctx = blk_exp->iothread_ctxs ? blk_exp->iothread_ctxs[i]
+                                          : blk_exp->ctx,
+        };
+        QSLIST_INIT(&exp->queues[i].free_requests);
+    }
+
     init_exports_table();
 
     /*
@@ -269,10 +344,19 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /*
+     * All queues read from the same FD, so a queue that was woken up may
+     * find the request already taken by another one
+     */
+    if (!g_unix_set_fd_nonblocking(fuse_session_fd(exp->fuse_session), true,
+                                   NULL)) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Failed to make FUSE session "
+                         "non-blocking");
+        goto fail;
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 
     return 0;
 
@@ -281,34 +365,95 @@ fail:
     return ret;
 }
 
+static FuseRequest *fuse_get_request(FuseQueue *q)
+{
+    FuseRequest *req = QSLIST_FIRST(&q->free_requests);
+
+    if (req) {
+        QSLIST_REMOVE_HEAD(&q->free_requests, next);
+        q->num_free_requests--;
+        return req;
+    }
+
+    /* libfuse allocates the buffer itself on first use */
+    req = g_new0(FuseRequest, 1);
+    req->q = q;
+    return req;
+}
+
+static void fuse_free_request(FuseRequest *req)
+{
+    free(req->buf.mem);
+    g_free(req);
+}
+
+static void fuse_put_request(FuseRequest *req)
+{
+    FuseQueue *q = req->q;
+
+    if (q->num_free_requests >= FUSE_MAX_FREE_REQUESTS) {
+        fuse_free_request(req);
+        return;
+    }
+
+    QSLIST_INSERT_HEAD(&q->free_requests, req, next);
+    q->num_free_requests++;
+}
+
+static void fuse_request_done(FuseRequest *req)
+{
+    FuseExport *exp = req->q->exp;
+
+    fuse_put_request(req);
+
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    }
+
+    blk_exp_unref(&exp->common);
+}
+
+/**
+ * Process a single request.  The libfuse callbacks run in this coroutine, so
+ * they can yield on block layer I/O while other requests are processed.
+ */
+static void coroutine_fn co_process_fuse_request(void *opaque)
+{
+    FuseRequest *req = opaque;
+
+    fuse_session_process_buf(req->q->exp->fuse_session, &req->buf);
+    fuse_request_done(req);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
  */
 static void read_from_fuse_export(void *opaque)
 {
-    FuseExport *exp = opaque;
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    FuseRequest *req;
+    Coroutine *co;
     int ret;
 
     blk_exp_ref(&exp->common);
 
     qatomic_inc(&exp->in_flight);
 
+    req = fuse_get_request(q);
+
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &req->buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
-    }
-
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
-        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    if (ret <= 0) {
+        /* -EAGAIN means that another queue got the request */
+        fuse_request_done(req);
+        return;
     }
 
-    blk_exp_unref(&exp->common);
+    co = qemu_coroutine_create(co_process_fuse_request, req);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
@@ -317,13 +462,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
-
-        if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
-        }
+        fuse_export_set_fd_handlers(exp, false);
     }
 
     if (exp->mountpoint) {
@@ -338,6 +477,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -347,7 +487,15 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseRequest *req, *next_req;
+
+        QSLIST_FOREACH_SAFE(req, &exp->queues[i].free_requests, next,
+                            next_req) {
+            fuse_free_request(req);
+        }
+    }
+    g_free(exp->queues);
     g_free(exp->mountpoint);
 }
 
@@ -403,21 +551,24 @@ static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static void coroutine_fn fuse_getattr(fuse_req_t req, fuse_ino_t inode,
+                                      struct fuse_file_info *fi)
 {
     struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
     FuseExport *exp = fuse_req_userdata(req);
 
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
         return;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    WITH_GRAPH_RDLOCK_GUARD() {
+        allocated_blocks =
+            bdrv_co_get_allocated_file_size(blk_bs(exp->common.blk));
+    }
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
@@ -441,48 +592,27 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+static int coroutine_fn fuse_do_truncate(const FuseExport *exp, int64_t size,
+                                         bool req_zero_write,
+                                         PreallocMode prealloc)
 {
-    uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    bool add_resize_perm;
-    int ret, ret_check;
 
-    /* Growable and writable exports have a permanent RESIZE permission */
-    add_resize_perm = !exp->growable && !exp->writable;
+    /*
+     * Growable and writable exports have a permanent RESIZE permission.
+     * Permissions cannot be changed from the request coroutines, so refuse
+     * to resize all other exports.
+     */
+    if (!exp->growable && !exp->writable) {
+        return -EPERM;
+    }
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
-    if (add_resize_perm) {
-
-        if (!qemu_in_main_thread()) {
-            /* Changing permissions like below only works in the main thread */
-            return -EPERM;
-        }
-
-        blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
-
-        ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
-                           blk_shared_perm, NULL);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    ret = blk_truncate(exp->common.blk, size, true, prealloc,
-                       truncate_flags, NULL);
-
-    if (add_resize_perm) {
-        /* Must succeed, because we are only giving up the RESIZE permission */
-        ret_check = blk_set_perm(exp->common.blk, blk_perm,
-                                 blk_shared_perm, &error_abort);
-        assert(ret_check == 0);
-    }
-
-    return ret;
+    return blk_co_truncate(exp->common.blk, size, true, prealloc,
+                           truncate_flags, NULL);
 }
 
 /**
@@ -493,8 +623,9 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
  * without allow_other cannot be given a different UID or GID, and
  * they cannot be given non-owner access.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static void coroutine_fn fuse_setattr(fuse_req_t req, fuse_ino_t inode,
+                                      struct stat *statbuf, int to_set,
+                                      struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int supported_attrs;
@@ -573,8 +704,9 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
 /**
  * Handle client reads from the exported image.
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_read(fuse_req_t req, fuse_ino_t inode,
+                                   size_t size, off_t offset,
+                                   struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -591,7 +723,7 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
         return;
@@ -607,7 +739,7 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         return;
     }
 
-    ret = blk_pread(exp->common.blk, offset, size, buf, 0);
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
     if (ret >= 0) {
         fuse_reply_buf(req, buf, size);
     } else {
@@ -620,8 +752,9 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 /**
  * Handle client writes to the exported image.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_write(fuse_req_t req, fuse_ino_t inode,
+                                    const char *buf, size_t size, off_t offset,
+                                    struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -642,7 +775,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
         return;
@@ -660,7 +793,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
+    ret = blk_co_pwrite(exp->common.blk, offset, size, buf, 0);
     if (ret >= 0) {
         fuse_reply_write(req, size);
     } else {
@@ -671,9 +804,9 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static void coroutine_fn fuse_fallocate(fuse_req_t req, fuse_ino_t inode,
+                                        int mode, off_t offset, off_t length,
+                                        struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
@@ -684,7 +817,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         return;
     }
 
-    blk_len = blk_getlength(exp->common.blk);
+    blk_len = blk_co_getlength(exp->common.blk);
     if (blk_len < 0) {
         fuse_reply_err(req, -blk_len);
         return;
@@ -725,7 +858,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk, offset, size,
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size,
                                     BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
             if (ret == -ENOTSUP) {
                 /*
@@ -755,7 +888,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk,
+            ret = blk_co_pwrite_zeroes(exp->common.blk,
                                     offset, size, 0);
             offset += size;
             length -= size;
@@ -772,13 +905,13 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 /**
  * Let clients fsync the exported image.
  */
-static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
-                       struct fuse_file_info *fi)
+static void coroutine_fn fuse_fsync(fuse_req_t req, fuse_ino_t inode,
+                                    int datasync, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int ret;
 
-    ret = blk_flush(exp->common.blk);
+    ret = blk_co_flush(exp->common.blk);
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
 
@@ -786,8 +919,8 @@ static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
  * Called before an FD to the exported image is closed.  (libfuse
  * notes this to be a way to return last-minute errors.)
  */
-static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
-                        struct fuse_file_info *fi)
+static void coroutine_fn fuse_flush(fuse_req_t req, fuse_ino_t inode,
+                                    struct fuse_file_info *fi)
 {
     fuse_fsync(req, inode, 1, fi);
 }
@@ -796,8 +929,9 @@ static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
 /**
  * Let clients inquire allocation status.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static void coroutine_fn fuse_lseek(fuse_req_t req, fuse_ino_t inode,
+                                    off_t offset, int whence,
+                                    struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
 
@@ -810,8 +944,11 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
         int64_t pnum;
         int ret;
 
-        ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+        WITH_GRAPH_RDLOCK_GUARD() {
+            ret = bdrv_co_block_status_above(blk_bs(exp->common.blk), NULL,
+                                             offset, INT64_MAX, &pnum,
+                                             NULL, NULL);
+        }
         if (ret < 0) {
             fuse_reply_err(req, -ret);
             return;
@@ -829,7 +966,7 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
              * and @blk_len (the client-visible EOF).
              */
 
-            blk_len = blk_getlength(exp->common.blk);
+            blk_len = blk_co_getlength(exp->common.blk);
             if (blk_len < 0) {
                 fuse_reply_err(req, -blk_len);
                 return;
@@ -885,6 +1022,7 @@ static const struct fuse_lowlevel_ops fuse_ops = {
 const BlockExportDriver blk_exp_fuse = {
     .type               = BLOCK_EXPORT_TYPE_FUSE,
     .instance_size      = sizeof(FuseExport),
+    .supports_multithread = true,
     .create             = fuse_export_create,
     .delete             = fuse_export_delete,
     .request_shutdown   = fuse_export_shutdown,
@@ -25,6 +25,9 @@
 #define VDUSE_DEFAULT_NUM_QUEUE 1
 #define VDUSE_DEFAULT_QUEUE_SIZE 256
 
+/* How often a device message waits for in-flight requests to complete */
+#define VDUSE_QUIESCE_POLL_NS (100 * SCALE_US)
+
 typedef struct VduseBlkExport {
     BlockExport export;
     VirtioBlkHandler handler;
@@ -33,6 +36,12 @@ typedef struct VduseBlkExport {
     char *recon_file;
     unsigned int inflight; /* atomic */
     bool vqs_started;
+
+    /*
+     * With iothreads, set while a device message is processed and the
+     * virtqueues are quiesced
+     */
+    bool dev_msg_pending; /* atomic */
 } VduseBlkExport;
 
 typedef struct VduseBlkReq {
@@ -117,15 +126,41 @@ static void on_vduse_vq_kick(void *opaque)
 {
     VduseVirtq *vq = opaque;
     VduseDev *dev = vduse_queue_get_dev(vq);
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    bool multithread = vblk_exp->export.iothread_ctxs != NULL;
     int fd = vduse_queue_get_fd(vq);
     eventfd_t kick_data;
 
+    if (multithread) {
+        /* Make vduse_blk_co_dev_handler() wait for us, or back off */
+        vduse_blk_inflight_inc(vblk_exp);
+        if (qatomic_read(&vblk_exp->dev_msg_pending)) {
+            vduse_blk_inflight_dec(vblk_exp);
+            return;
+        }
+    }
+
     if (eventfd_read(fd, &kick_data) == -1) {
         error_report("failed to read data from eventfd");
-        return;
+    } else {
+        vduse_blk_vq_handler(dev, vq);
+    }
+
+    if (multithread) {
+        vduse_blk_inflight_dec(vblk_exp);
     }
+}
+
+/* Returns the AioContext in which @vq is processed */
+static AioContext *vduse_blk_vq_ctx(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    BlockExport *exp = &vblk_exp->export;
 
-    vduse_blk_vq_handler(dev, vq);
+    if (exp->iothread_ctxs) {
+        return exp->iothread_ctxs[vduse_queue_get_index(vq) %
+                                  exp->num_iothread_ctxs];
+    }
+    return exp->ctx;
 }
 
 static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
@@ -135,8 +170,14 @@ static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
     if (!vblk_exp->vqs_started) {
         return; /* vduse_blk_drained_end() will start vqs later */
     }
+    if (qatomic_read(&vblk_exp->dev_msg_pending)) {
+        return; /* vduse_blk_co_dev_handler() will start vqs later */
+    }
+    if (vduse_queue_get_fd(vq) < 0) {
+        return; /* Not set up by the driver (yet) */
+    }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, vduse_queue_get_fd(vq),
+    aio_set_fd_handler(vduse_blk_vq_ctx(vblk_exp, vq), vduse_queue_get_fd(vq),
                        on_vduse_vq_kick, NULL, NULL, NULL, vq);
     /* Make sure we don't miss any kick after reconnecting */
     eventfd_write(vduse_queue_get_fd(vq), 1);
@@ -151,7 +192,7 @@ static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
         return;
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, fd,
+    aio_set_fd_handler(vduse_blk_vq_ctx(vblk_exp, vq), fd,
                        NULL, NULL, NULL, NULL, NULL);
 }
 
@@ -160,15 +201,73 @@ static const VduseOps vduse_blk_ops = {
     .disable_queue = vduse_blk_disable_queue,
 };
 
+static void on_vduse_dev_kick(void *opaque);
+
+/*
+ * With iothreads, virtqueues are processed in other threads while device
+ * messages (which may e.g. change the IOTLB) are processed in export.ctx.
+ * libvduse is not thread-safe, so quiesce all virtqueues around each message.
+ */
+static void coroutine_fn vduse_blk_co_dev_handler(void *opaque)
+{
+    VduseBlkExport *vblk_exp = opaque;
+    VduseDev *dev = vblk_exp->dev;
+    uint16_t i;
+
+    for (i = 0; i < vblk_exp->num_queues; i++) {
+        vduse_blk_disable_queue(dev, vduse_dev_get_queue(dev, i));
+    }
+
+    /* Includes kick handlers that were already running */
+    while (qatomic_read(&vblk_exp->inflight) > 0) {
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, VDUSE_QUIESCE_POLL_NS);
+    }
+
+    vduse_dev_handler(dev);
+
+    qatomic_set(&vblk_exp->dev_msg_pending, false);
+
+    for (i = 0; i < vblk_exp->num_queues; i++) {
+        vduse_blk_enable_queue(dev, vduse_dev_get_queue(dev, i));
+    }
+
+    if (vblk_exp->export.ctx) {
+        aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(dev),
+                           on_vduse_dev_kick, NULL, NULL, NULL, dev);
+    }
+
+    blk_exp_unref(&vblk_exp->export);
+}
+
 static void on_vduse_dev_kick(void *opaque)
 {
     VduseDev *dev = opaque;
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    Coroutine *co;
 
-    vduse_dev_handler(dev);
+    if (!vblk_exp->export.iothread_ctxs) {
+        vduse_dev_handler(dev);
+        return;
+    }
+
+    /* vduse_blk_co_dev_handler() reinstalls this handler when it is done */
+    aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(dev),
+                       NULL, NULL, NULL, NULL, NULL);
+
+    qatomic_set(&vblk_exp->dev_msg_pending, true);
+    smp_mb(); /* pairs with vduse_blk_inflight_inc() in on_vduse_vq_kick() */
+
+    blk_exp_ref(&vblk_exp->export);
+    co = qemu_coroutine_create(vduse_blk_co_dev_handler, vblk_exp);
+    qemu_coroutine_enter(co);
 }
 
 static void vduse_blk_attach_ctx(VduseBlkExport *vblk_exp, AioContext *ctx)
 {
+    if (qatomic_read(&vblk_exp->dev_msg_pending)) {
+        return; /* vduse_blk_co_dev_handler() will do this */
+    }
+
     aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(vblk_exp->dev),
                        on_vduse_dev_kick, NULL, NULL, NULL,
                        vblk_exp->dev);
@@ -413,6 +512,7 @@ static void vduse_blk_exp_request_shutdown(BlockExport *exp)
 const BlockExportDriver blk_exp_vduse_blk = {
     .type               = BLOCK_EXPORT_TYPE_VDUSE_BLK,
     .instance_size      = sizeof(VduseBlkExport),
+    .supports_multithread = true,
     .create             = vduse_blk_exp_create,
     .delete             = vduse_blk_exp_delete,
     .request_shutdown   = vduse_blk_exp_request_shutdown,
@@ -361,6 +361,9 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         return -EADDRNOTAVAIL;
     }
 
+    vhost_user_server_set_queue_ctxs(&vexp->vu_server, exp->iothread_ctxs,
+                                     exp->num_iothread_ctxs);
+
     return 0;
 }
 
@@ -376,6 +379,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
 const BlockExportDriver blk_exp_vhost_user_blk = {
     .type               = BLOCK_EXPORT_TYPE_VHOST_USER_BLK,
     .instance_size      = sizeof(VuBlkExport),
+    .supports_multithread = true,
     .create             = vu_blk_exp_create,
     .delete             = vu_blk_exp_delete,
     .request_shutdown   = vu_blk_exp_request_shutdown,
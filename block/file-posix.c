@@ -184,6 +184,7 @@ typedef struct BDRVRawState {
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
     bool use_mpath:1;
+    unsigned int luring_mode; /* LURING_MODE_* for aio=io_uring */
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -585,6 +586,20 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "use a kernel thread to poll the io_uring submission "
+                    "queue (default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "busy-poll for io_uring completions, requires "
+                    "cache.direct=on (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -662,6 +677,20 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+
+    s->luring_mode = 0;
+    if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false)) {
+        s->luring_mode |= LURING_MODE_SQPOLL;
+    }
+    if (qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+        s->luring_mode |= LURING_MODE_IOPOLL;
+    }
+    if (s->luring_mode && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-sqpoll and io-uring-iopoll require "
+                   "aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -755,7 +784,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
-#ifndef CONFIG_LINUX_IO_URING
+#ifdef CONFIG_LINUX_IO_URING
+    /* Polled I/O bypasses the page cache */
+    if ((s->luring_mode & LURING_MODE_IOPOLL) &&
+        !(s->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll was specified, but it requires "
+                         "cache.direct=on, which was not specified.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
     if (s->use_linux_io_uring) {
         error_setg(errp, "aio=io_uring was specified, but is not supported "
                          "in this build.");
@@ -1159,6 +1197,15 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     rs->check_cache_dropped =
         qemu_opt_get_bool_del(opts, "x-check-cache-dropped", false);
 
+    /* Polled I/O fails on an fd without O_DIRECT, see raw_open_common() */
+    if ((s->luring_mode & LURING_MODE_IOPOLL) &&
+        !(state->flags & BDRV_O_NOCACHE)) {
+        error_setg(errp, "io-uring-iopoll requires cache.direct=on, which "
+                         "cannot be switched off on reopen");
+        ret = -EINVAL;
+        goto out;
+    }
+
     /* This driver's reopen function doesn't currently allow changing
      * other options, so let's put them back in the original QDict and
      * bdrv_reopen_prepare() will detect changes and complain. */
@@ -2523,7 +2570,8 @@ static bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 }
 
 #ifdef CONFIG_LINUX_IO_URING
-static inline bool raw_check_linux_io_uring(BDRVRawState *s)
+static inline bool raw_check_linux_io_uring(BDRVRawState *s,
+                                            unsigned int mode)
 {
     Error *local_err = NULL;
     AioContext *ctx;
@@ -2533,7 +2581,7 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
     }
 
     ctx = qemu_get_current_aio_context();
-    if (unlikely(!aio_setup_linux_io_uring(ctx, &local_err))) {
+    if (unlikely(!aio_setup_linux_io_uring(ctx, mode, &local_err))) {
         error_reportf_err(local_err, "Unable to use linux io_uring, "
                                      "falling back to thread pool: ");
         s->use_linux_io_uring = false;
@@ -2541,6 +2589,27 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
     }
     return true;
 }
+
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Best-effort, requests fall back to readv/writev if this fails */
+    if (s->use_linux_io_uring) {
+        luring_register_buf(host, size);
+    }
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        luring_unregister_buf(host, size);
+    }
+}
 #endif
 
 #ifdef CONFIG_LINUX_AIO
@@ -2595,9 +2664,10 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (raw_check_linux_io_uring(s)) {
+    } else if (raw_check_linux_io_uring(s, s->luring_mode)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type, flags);
+        ret = luring_co_submit(bs, s->fd, offset, qiov, type, flags,
+                               s->luring_mode);
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2692,8 +2762,10 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH, 0);
+    /* IOPOLL rings cannot fsync, use the matching interrupt-driven ring */
+    if (raw_check_linux_io_uring(s, s->luring_mode & ~LURING_MODE_IOPOLL)) {
+        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH, 0,
+                                s->luring_mode & ~LURING_MODE_IOPOLL);
     }
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2711,6 +2783,9 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        luring_unregister_fd(s->fd);
 #endif
         qemu_close(s->fd);
         s->fd = -1;
@@ -3903,6 +3978,9 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        luring_unregister_fd(s->fd);
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -4000,6 +4078,10 @@ BlockDriver bdrv_file = {
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate                   = raw_co_truncate,
     .bdrv_co_getlength                  = raw_co_getlength,
@@ -4458,6 +4540,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate                   = raw_co_truncate,
     .bdrv_co_getlength                  = raw_co_getlength,
@@ -37,6 +37,7 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "system/qtest.h"
 #include "system/replay.h"
 #include "qemu/units.h"
 
@@ -52,6 +53,13 @@ bdrv_parent_cb_resize(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int64_t bytes, BdrvRequestFlags flags);
 
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_coalesce(BdrvChild *child, bool zero, int64_t offset, int64_t bytes,
+                 BdrvRequestFlags flags);
+
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_do_pdiscard(BdrvChild *child, int64_t offset, int64_t bytes);
+
 static void GRAPH_RDLOCK
 bdrv_parent_drained_begin(BlockDriverState *bs, BdrvChild *ignore)
 {
@@ -2228,6 +2236,23 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     return bdrv_co_pwritev_part(child, offset, bytes, qiov, 0, flags);
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_zero_pwritev_tracked(BdrvChild *child, int64_t offset, int64_t bytes,
+                             BdrvRequestFlags flags)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+    ret = bdrv_co_do_zero_pwritev(child, offset, bytes, flags, &req);
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     int64_t offset, int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset,
     BdrvRequestFlags flags)
@@ -2287,15 +2312,18 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
         }
     }
 
-    bdrv_inc_in_flight(bs);
-    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
-
     if (flags & BDRV_REQ_ZERO_WRITE) {
         assert(!padded);
-        ret = bdrv_co_do_zero_pwritev(child, offset, bytes, flags, &req);
-        goto out;
+        if (bs->coalesce_ns && bytes &&
+            !(flags & (BDRV_REQ_SERIALISING | BDRV_REQ_NO_WAIT))) {
+            return bdrv_co_coalesce(child, true, offset, bytes, flags);
+        }
+        return bdrv_co_zero_pwritev_tracked(child, offset, bytes, flags);
     }
 
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+
     if (padded) {
         /*
          * Request was unaligned to request_alignment and therefore
@@ -2313,7 +2341,6 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
     bdrv_padding_finalize(&pad);
 
-out:
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
 
@@ -3141,10 +3168,7 @@ early_exit:
 int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
                                   int64_t bytes)
 {
-    BdrvTrackedRequest req;
     int ret;
-    int64_t max_pdiscard;
-    int head, tail, align;
     BlockDriverState *bs = child->bs;
     IO_CODE();
     assert_bdrv_graph_readable();
@@ -3171,6 +3195,147 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
         return 0;
     }
 
+    if (bs->coalesce_ns) {
+        return bdrv_co_coalesce(child, false, offset, bytes, 0);
+    }
+    return bdrv_co_do_pdiscard(child, offset, bytes);
+}
+
+/*
+ * Discard and write zeroes coalescing
+ *
+ * Guests trimming a filesystem send floods of small discard requests, mostly
+ * for adjacent ranges.  If the discard-coalesce-ns option is set for a node,
+ * the first discard or write zeroes request waits that long before it is
+ * submitted.  Requests of the same kind that arrive in the meantime and are
+ * adjacent to or overlap it are merged into it, up to the node's maximum
+ * request size for the operation, and complete with the result of the
+ * combined request.
+ *
+ * With qtest, the window is measured on the virtual clock, so that tests
+ * decide when a batch is submitted by stepping the clock.
+ */
+typedef struct BdrvCoalesceBatch {
+    bool zero;              /* write zeroes with @flags, or discard */
+    BdrvRequestFlags flags;
+    int64_t offset;
+    int64_t bytes;
+
+    bool completed;
+    int ret;
+    unsigned refcnt;
+    CoQueue completion;     /* merged requests waiting for @ret */
+    QLIST_ENTRY(BdrvCoalesceBatch) next;
+} BdrvCoalesceBatch;
+
+/* Called with bs->reqs_lock held */
+static BdrvCoalesceBatch *bdrv_coalesce_find(BlockDriverState *bs, bool zero,
+                                             BdrvRequestFlags flags,
+                                             int64_t offset, int64_t bytes)
+{
+    int64_t max_bytes = zero ? bs->bl.max_pwrite_zeroes : bs->bl.max_pdiscard;
+    BdrvCoalesceBatch *b;
+
+    max_bytes = MIN_NON_ZERO(max_bytes, BDRV_REQUEST_MAX_BYTES);
+
+    QLIST_FOREACH(b, &bs->coalesce_batches, next) {
+        int64_t start, end;
+
+        if (b->zero != zero || b->flags != flags ||
+            offset > b->offset + b->bytes || b->offset > offset + bytes) {
+            continue;
+        }
+        start = MIN(offset, b->offset);
+        end = MAX(offset + bytes, b->offset + b->bytes);
+        if (end - start <= max_bytes) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_coalesce(BdrvChild *child, bool zero, int64_t offset, int64_t bytes,
+                 BdrvRequestFlags flags)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvCoalesceBatch *b;
+    int ret;
+
+    /* Drain must wait for requests that are sitting in a batch */
+    bdrv_inc_in_flight(bs);
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    b = bdrv_coalesce_find(bs, zero, flags, offset, bytes);
+    if (b) {
+        int64_t end = MAX(offset + bytes, b->offset + b->bytes);
+
+        b->offset = MIN(offset, b->offset);
+        b->bytes = end - b->offset;
+        b->refcnt++;
+        stat64_add(zero ? &bs->zero_coalesced : &bs->unmap_coalesced, 1);
+        trace_bdrv_co_coalesce_merge(bs, zero, offset, bytes,
+                                     b->offset, b->bytes);
+
+        while (!b->completed) {
+            qemu_co_queue_wait(&b->completion, &bs->reqs_lock);
+        }
+        ret = b->ret;
+        goto out;
+    }
+
+    b = g_new(BdrvCoalesceBatch, 1);
+    *b = (BdrvCoalesceBatch) {
+        .zero = zero,
+        .flags = flags,
+        .offset = offset,
+        .bytes = bytes,
+        .refcnt = 1,
+    };
+    qemu_co_queue_init(&b->completion);
+    QLIST_INSERT_HEAD(&bs->coalesce_batches, b, next);
+    qemu_mutex_unlock(&bs->reqs_lock);
+
+    qemu_co_sleep_ns(qtest_enabled() ? QEMU_CLOCK_VIRTUAL : QEMU_CLOCK_REALTIME,
+                     bs->coalesce_ns);
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    QLIST_REMOVE(b, next);
+    offset = b->offset;
+    bytes = b->bytes;
+    trace_bdrv_co_coalesce_submit(bs, zero, offset, bytes, b->refcnt);
+    qemu_mutex_unlock(&bs->reqs_lock);
+
+    stat64_add(&bs->coalesce_batches_submitted, 1);
+    if (zero) {
+        ret = bdrv_co_zero_pwritev_tracked(child, offset, bytes, flags);
+    } else {
+        ret = bdrv_co_do_pdiscard(child, offset, bytes);
+    }
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    b->ret = ret;
+    b->completed = true;
+    qemu_co_queue_restart_all(&b->completion);
+out:
+    if (--b->refcnt == 0) {
+        g_free(b);
+    }
+    qemu_mutex_unlock(&bs->reqs_lock);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/* The caller has checked the request and whether the discard is enabled */
+static int coroutine_fn GRAPH_RDLOCK
+bdrv_co_do_pdiscard(BdrvChild *child, int64_t offset, int64_t bytes)
+{
+    BdrvTrackedRequest req;
+    int ret;
+    int64_t max_pdiscard;
+    int head, tail, align;
+    BlockDriverState *bs = child->bs;
+
     /* Invalidate the cached block-status data range if this discard overlaps */
     bdrv_bsc_invalidate_range(bs, offset, bytes);
 
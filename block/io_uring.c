@@ -16,8 +16,13 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/bitmap.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "system/block-backend.h"
+#include "system/memory.h" /* for ram_block_discard_disable() */
 #include "trace.h"
 
 /* Only used for assertions.  */
@@ -26,6 +31,9 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Idle time before the SQPOLL kernel thread goes to sleep */
+#define SQPOLL_IDLE_MS 100
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -54,12 +62,510 @@ struct LuringState {
 
     struct io_uring ring;
 
+    /* LURING_MODE_* the ring was set up with */
+    unsigned int mode;
+
+    /*
+     * With IORING_SETUP_IOPOLL and no SQPOLL thread, completions are only
+     * reaped when we enter the kernel, the ring fd never becomes readable.
+     */
+    bool iopoll_reap;
+
+    /* Protected by luring_fixed.lock */
+    QLIST_ENTRY(LuringState) next;
+
+    /*
+     * Whether this ring mirrors the fixed buffer and file tables.  Cleared
+     * when registration fails for this ring so it falls back to plain
+     * readv/writev with an ordinary fd.
+     */
+    bool fixed_bufs;
+    bool fixed_files;
+
     /* No locking required, only accessed from AioContext home thread */
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
 };
 
+/*
+ * Registered (fixed) buffers and files
+ *
+ * Guest RAM registered through bdrv_register_buf() and the fds of images
+ * submitting I/O are registered once with every ring instead of being
+ * pinned/looked up by the kernel for each request.  All rings mirror the same
+ * slot layout so a lookup in the shared table yields a slot index that is
+ * valid for whichever ring submits the request.
+ *
+ * The table is updated under luring_fixed.lock, which also protects the list
+ * of rings, and read under RCU from the submission path.
+ */
+
+/* The kernel limits each registered buffer to 1 GiB */
+#define FIXED_BUF_MAX_LEN (1 * GiB)
+
+/* Number of kernel buffer slots, i.e. 4 TiB of RAM in 1 GiB chunks */
+#define MAX_FIXED_BUFS 4096
+
+/* Number of distinct buffer regions (RAMBlocks) tracked */
+#define MAX_FIXED_REGIONS 64
+
+#define MAX_FIXED_FILES 256
+
+typedef struct {
+    void *host;
+    size_t size;
+    unsigned int first_slot; /* one slot per FIXED_BUF_MAX_LEN chunk */
+    unsigned int refcnt;     /* one reference per registering BDS */
+} LuringFixedBuf;
+
+typedef struct {
+    int fd;
+    unsigned int slot;
+} LuringFixedFile;
+
+typedef struct {
+    struct rcu_head rcu;
+    unsigned int nr_bufs;
+    unsigned int nr_files;
+    LuringFixedBuf bufs[MAX_FIXED_REGIONS];
+    LuringFixedFile files[MAX_FIXED_FILES];
+} LuringFixedTable;
+
+static struct {
+    QemuMutex lock;
+    QLIST_HEAD(, LuringState) rings;
+    LuringFixedTable *table; /* RCU */
+    DECLARE_BITMAP(buf_slots, MAX_FIXED_BUFS);
+    DECLARE_BITMAP(file_slots, MAX_FIXED_FILES);
+
+    /* Set when the kernel or liburing lacks sparse registration */
+    bool unsupported;
+} luring_fixed;
+
+static void __attribute__((constructor)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed.lock);
+    QLIST_INIT(&luring_fixed.rings);
+    luring_fixed.table = g_new0(LuringFixedTable, 1);
+}
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/* Returns a private copy of the table for modification, call with lock held */
+static LuringFixedTable *luring_fixed_table_dup(void)
+{
+    return g_memdup2(luring_fixed.table, sizeof(LuringFixedTable));
+}
+
+/* Publish a modified table, call with lock held */
+static void luring_fixed_table_publish(LuringFixedTable *t)
+{
+    LuringFixedTable *old = luring_fixed.table;
+
+    qatomic_rcu_set(&luring_fixed.table, t);
+    g_free_rcu(old, rcu);
+}
+
+static unsigned int fixed_buf_nr_slots(size_t size)
+{
+    return DIV_ROUND_UP(size, FIXED_BUF_MAX_LEN);
+}
+
+/* Fill in the kernel iovec for each chunk of a registered buffer */
+static void fixed_buf_iovecs(const LuringFixedBuf *b, struct iovec *iov)
+{
+    unsigned int i;
+
+    for (i = 0; i < fixed_buf_nr_slots(b->size); i++) {
+        size_t offset = (size_t)i * FIXED_BUF_MAX_LEN;
+
+        iov[i].iov_base = b->host + offset;
+        iov[i].iov_len = MIN(b->size - offset, FIXED_BUF_MAX_LEN);
+    }
+}
+
+static int ring_update_bufs(LuringState *s, unsigned int slot,
+                            const struct iovec *iov, unsigned int nr)
+{
+    int ret = io_uring_register_buffers_update_tag(&s->ring, slot, iov,
+                                                   NULL, nr);
+    return ret < 0 ? ret : 0;
+}
+
+static void ring_clear_bufs(LuringState *s, unsigned int slot, unsigned int nr)
+{
+    g_autofree struct iovec *iov = g_new0(struct iovec, nr);
+
+    ring_update_bufs(s, slot, iov, nr);
+}
+
+static int ring_update_file(LuringState *s, unsigned int slot, int fd)
+{
+    int ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * luring_fixed_attach:
+ *
+ * Register sparse buffer and file tables with a new ring and populate them
+ * from the shared table.
+ */
+static void luring_fixed_attach(LuringState *s)
+{
+    LuringFixedTable *t;
+    unsigned int i;
+    int ret;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    QLIST_INSERT_HEAD(&luring_fixed.rings, s, next);
+
+    if (luring_fixed.unsupported) {
+        return;
+    }
+
+    t = luring_fixed.table;
+
+    ret = io_uring_register_buffers_sparse(&s->ring, MAX_FIXED_BUFS);
+    if (ret < 0) {
+        /* Pre-5.19 kernel, don't bother with other rings either */
+        trace_luring_fixed_unsupported(s, ret);
+        luring_fixed.unsupported = true;
+        return;
+    }
+    s->fixed_bufs = true;
+    for (i = 0; i < t->nr_bufs; i++) {
+        unsigned int nr = fixed_buf_nr_slots(t->bufs[i].size);
+        g_autofree struct iovec *iov = g_new(struct iovec, nr);
+
+        fixed_buf_iovecs(&t->bufs[i], iov);
+        ret = ring_update_bufs(s, t->bufs[i].first_slot, iov, nr);
+        if (ret < 0) {
+            trace_luring_fixed_buf_register_failed(s, t->bufs[i].host,
+                                                   t->bufs[i].size, ret);
+            io_uring_unregister_buffers(&s->ring);
+            s->fixed_bufs = false;
+            break;
+        }
+    }
+
+    ret = io_uring_register_files_sparse(&s->ring, MAX_FIXED_FILES);
+    if (ret < 0) {
+        trace_luring_fixed_unsupported(s, ret);
+        return;
+    }
+    s->fixed_files = true;
+    for (i = 0; i < t->nr_files; i++) {
+        ret = ring_update_file(s, t->files[i].slot, t->files[i].fd);
+        if (ret < 0) {
+            io_uring_unregister_files(&s->ring);
+            s->fixed_files = false;
+            break;
+        }
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @host: start of the memory region
+ * @size: size of the memory region in bytes
+ *
+ * Register a memory region, typically a RAMBlock, with all io_uring rings so
+ * that requests whose buffer lies within the region can be submitted with
+ * IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED.
+ *
+ * Registration is best-effort.  If the region cannot be registered (e.g. due
+ * to RLIMIT_MEMLOCK) requests fall back to ordinary readv/writev.
+ *
+ * Fixed buffers pin the memory long-term, so RAM discard (virtio-balloon,
+ * virtio-mem) is disabled while any region is registered.  Otherwise the
+ * guest would get fresh pages while io_uring keeps using the old ones.  If
+ * discard cannot be disabled the region is not registered.
+ */
+void luring_register_buf(void *host, size_t size)
+{
+    unsigned int nr = fixed_buf_nr_slots(size);
+    g_autofree struct iovec *iov = NULL;
+    LuringFixedTable *t;
+    LuringFixedBuf *b;
+    LuringState *s;
+    unsigned long slot;
+    unsigned int i;
+    int ret;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    if (luring_fixed.unsupported) {
+        return;
+    }
+
+    for (i = 0; i < luring_fixed.table->nr_bufs; i++) {
+        b = &luring_fixed.table->bufs[i];
+        if (b->host == host && b->size == size) {
+            /* No readers look at refcnt, so it is safe to update in place */
+            b->refcnt++;
+            return;
+        }
+    }
+
+    if (luring_fixed.table->nr_bufs == MAX_FIXED_REGIONS) {
+        return;
+    }
+    slot = bitmap_find_next_zero_area(luring_fixed.buf_slots, MAX_FIXED_BUFS,
+                                      0, nr, 0);
+    if (slot >= MAX_FIXED_BUFS) {
+        return;
+    }
+
+    ret = ram_block_discard_disable(true);
+    if (ret < 0) {
+        trace_luring_fixed_buf_register_failed(NULL, host, size, ret);
+        return;
+    }
+
+    t = luring_fixed_table_dup();
+    b = &t->bufs[t->nr_bufs];
+    *b = (LuringFixedBuf) {
+        .host = host,
+        .size = size,
+        .first_slot = slot,
+        .refcnt = 1,
+    };
+
+    iov = g_new(struct iovec, nr);
+    fixed_buf_iovecs(b, iov);
+
+    QLIST_FOREACH(s, &luring_fixed.rings, next) {
+        if (!s->fixed_bufs) {
+            continue;
+        }
+        ret = ring_update_bufs(s, slot, iov, nr);
+        trace_luring_fixed_buf_register(s, host, size, slot, ret);
+        if (ret < 0) {
+            LuringState *s2;
+
+            /* Roll back so all rings keep the same slot layout */
+            QLIST_FOREACH(s2, &luring_fixed.rings, next) {
+                if (s2 == s) {
+                    break;
+                }
+                if (s2->fixed_bufs) {
+                    ring_clear_bufs(s2, slot, nr);
+                }
+            }
+            trace_luring_fixed_buf_register_failed(s, host, size, ret);
+            g_free(t);
+            ram_block_discard_disable(false);
+            return;
+        }
+    }
+
+    bitmap_set(luring_fixed.buf_slots, slot, nr);
+    t->nr_bufs++;
+    luring_fixed_table_publish(t);
+}
+
+/**
+ * luring_unregister_buf:
+ * @host: start of the memory region
+ * @size: size of the memory region in bytes
+ *
+ * Undo luring_register_buf().  There must be no requests in flight that use
+ * the region.
+ */
+void luring_unregister_buf(void *host, size_t size)
+{
+    LuringFixedTable *t;
+    LuringFixedBuf *b;
+    LuringState *s;
+    unsigned int slot;
+    unsigned int nr;
+    unsigned int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < luring_fixed.table->nr_bufs; i++) {
+        b = &luring_fixed.table->bufs[i];
+        if (b->host == host && b->size == size) {
+            break;
+        }
+    }
+    if (i == luring_fixed.table->nr_bufs) {
+        return; /* registration failed or was never attempted */
+    }
+    if (--b->refcnt > 0) {
+        return;
+    }
+
+    slot = b->first_slot;
+    nr = fixed_buf_nr_slots(size);
+
+    t = luring_fixed_table_dup();
+    t->bufs[i] = t->bufs[--t->nr_bufs];
+    luring_fixed_table_publish(t);
+
+    QLIST_FOREACH(s, &luring_fixed.rings, next) {
+        if (s->fixed_bufs) {
+            ring_clear_bufs(s, slot, nr);
+        }
+    }
+    bitmap_clear(luring_fixed.buf_slots, slot, nr);
+    ram_block_discard_disable(false);
+}
+
+/* Register @fd with all rings, called on the first request for @fd */
+static void luring_register_fd(int fd)
+{
+    LuringFixedTable *t;
+    LuringState *s;
+    unsigned long slot;
+    unsigned int i;
+    int ret;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    if (luring_fixed.unsupported ||
+        luring_fixed.table->nr_files == MAX_FIXED_FILES) {
+        return;
+    }
+
+    /* Another thread may have raced with us */
+    for (i = 0; i < luring_fixed.table->nr_files; i++) {
+        if (luring_fixed.table->files[i].fd == fd) {
+            return;
+        }
+    }
+
+    slot = find_first_zero_bit(luring_fixed.file_slots, MAX_FIXED_FILES);
+    assert(slot < MAX_FIXED_FILES);
+
+    QLIST_FOREACH(s, &luring_fixed.rings, next) {
+        if (!s->fixed_files) {
+            continue;
+        }
+        ret = ring_update_file(s, slot, fd);
+        trace_luring_fixed_file_register(s, fd, slot, ret);
+        if (ret < 0) {
+            /* Stop using fixed files on this ring rather than roll back */
+            io_uring_unregister_files(&s->ring);
+            s->fixed_files = false;
+        }
+    }
+
+    t = luring_fixed_table_dup();
+    t->files[t->nr_files++] = (LuringFixedFile) {
+        .fd = fd,
+        .slot = slot,
+    };
+    set_bit(slot, luring_fixed.file_slots);
+    luring_fixed_table_publish(t);
+}
+
+/**
+ * luring_unregister_fd:
+ * @fd: file descriptor that is about to be closed
+ *
+ * Drop the fixed file registration of @fd, if any.  Must be called before
+ * closing a file descriptor that was used with luring_co_submit(), otherwise
+ * the rings keep the file open and a new file that reuses the fd number would
+ * be mistaken for the old one.
+ */
+void luring_unregister_fd(int fd)
+{
+    LuringFixedTable *t;
+    LuringState *s;
+    unsigned int slot;
+    unsigned int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+
+    for (i = 0; i < luring_fixed.table->nr_files; i++) {
+        if (luring_fixed.table->files[i].fd == fd) {
+            break;
+        }
+    }
+    if (i == luring_fixed.table->nr_files) {
+        return;
+    }
+    slot = luring_fixed.table->files[i].slot;
+
+    t = luring_fixed_table_dup();
+    t->files[i] = t->files[--t->nr_files];
+    luring_fixed_table_publish(t);
+
+    QLIST_FOREACH(s, &luring_fixed.rings, next) {
+        if (s->fixed_files) {
+            ring_update_file(s, slot, -1);
+        }
+    }
+    clear_bit(slot, luring_fixed.file_slots);
+}
+#else
+static void luring_fixed_attach(LuringState *s)
+{
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    QLIST_INSERT_HEAD(&luring_fixed.rings, s, next);
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+}
+
+static void luring_register_fd(int fd)
+{
+}
+
+void luring_unregister_fd(int fd)
+{
+}
+#endif /* HAVE_IO_URING_REGISTER_SPARSE */
+
+static void luring_fixed_detach(LuringState *s)
+{
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    QLIST_REMOVE(s, next);
+}
+
+/* Returns the fixed buffer slot covering [base, base + len) or -1 */
+static int luring_fixed_buf_slot(const LuringFixedTable *t, void *base,
+                                 size_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->nr_bufs; i++) {
+        const LuringFixedBuf *b = &t->bufs[i];
+        uintptr_t offset = (uintptr_t)base - (uintptr_t)b->host;
+
+        if ((uintptr_t)base < (uintptr_t)b->host || offset >= b->size) {
+            continue;
+        }
+        if (len > b->size - offset ||
+            offset / FIXED_BUF_MAX_LEN !=
+            (offset + len - 1) / FIXED_BUF_MAX_LEN) {
+            return -1; /* straddles a chunk boundary */
+        }
+        return b->first_slot + offset / FIXED_BUF_MAX_LEN;
+    }
+    return -1;
+}
+
+/* Returns the fixed file slot for @fd or -1 */
+static int luring_fixed_file_slot(const LuringFixedTable *t, int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->nr_files; i++) {
+        if (t->files[i].fd == fd) {
+            return t->files[i].slot;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_resubmit:
  *
@@ -102,8 +608,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
 
     /* Update sqe */
     luringcb->sqeq.off += nread;
-    luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
-    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* Still within the same registered buffer, just advance */
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len -= nread;
+    } else {
+        luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
+        luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    }
 
     luring_resubmit(s, luringcb);
 }
@@ -121,6 +633,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
  * canceled.
  *
  */
+/* Poll the device for completions of an IOPOLL ring */
+static void luring_iopoll_reap(LuringState *s)
+{
+    if (s->io_q.in_flight && !io_uring_cq_ready(&s->ring)) {
+        io_uring_enter(s->ring.ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL);
+    }
+}
+
 static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
@@ -128,6 +648,10 @@ static void luring_process_completions(LuringState *s)
 
     defer_call_begin();
 
+    if (s->iopoll_reap) {
+        luring_iopoll_reap(s);
+    }
+
     /*
      * Request completion callbacks can run the nested event loop.
      * Schedule ourselves so the nested event loop will "see" remaining
@@ -221,7 +745,14 @@ end:
         }
     }
 
-    qemu_bh_cancel(s->completion_bh);
+    /*
+     * Keep the BH scheduled while IOPOLL requests are in flight so the event
+     * loop keeps reaping them instead of blocking on a ring fd that will not
+     * become readable.
+     */
+    if (!s->iopoll_reap || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 
     defer_call_end();
 }
@@ -295,6 +826,9 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    if (s->iopoll_reap) {
+        luring_iopoll_reap(s);
+    }
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -339,9 +873,46 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int buf_slot = -1;
+    int file_slot = -1;
+
+    if (s->fixed_bufs || s->fixed_files) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            LuringFixedTable *t = qatomic_rcu_read(&luring_fixed.table);
+
+            /* Fixed buffer ops take a single buffer rather than an iovec */
+            if (s->fixed_bufs && (flags & BDRV_REQ_REGISTERED_BUF) &&
+                (type == QEMU_AIO_READ || type == QEMU_AIO_WRITE) &&
+                luringcb->qiov->niov == 1) {
+                buf_slot = luring_fixed_buf_slot(t,
+                                                 luringcb->qiov->iov[0].iov_base,
+                                                 luringcb->qiov->iov[0].iov_len);
+            }
+            if (s->fixed_files) {
+                file_slot = luring_fixed_file_slot(t, fd);
+            }
+        }
+
+        if (s->fixed_files && file_slot < 0) {
+            /* Takes effect from the next request on */
+            luring_register_fd(fd);
+        }
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
+        if (buf_slot >= 0) {
+            io_uring_prep_write_fixed(sqes, fd,
+                                      luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->iov[0].iov_len,
+                                      offset, buf_slot);
+#ifdef HAVE_IO_URING_PREP_WRITEV2
+            sqes->rw_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
+#else
+            assert(!(flags & BDRV_REQ_FUA));
+#endif
+            break;
+        }
 #ifdef HAVE_IO_URING_PREP_WRITEV2
     {
         int luring_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
@@ -349,7 +920,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                               luringcb->qiov->niov, offset, luring_flags);
     }
 #else
-        assert(flags == 0);
+        assert(!(flags & BDRV_REQ_FUA));
         io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
                              luringcb->qiov->niov, offset);
 #endif
@@ -359,6 +930,13 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
+        if (buf_slot >= 0) {
+            io_uring_prep_read_fixed(sqes, fd,
+                                     luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->iov[0].iov_len,
+                                     offset, buf_slot);
+            break;
+        }
         io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
                             luringcb->qiov->niov, offset);
         break;
@@ -370,6 +948,10 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file_slot >= 0) {
+        sqes->fd = file_slot;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -390,11 +972,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type,
-                                  BdrvRequestFlags flags)
+                                  BdrvRequestFlags flags, unsigned int mode)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
-    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringState *s = aio_get_linux_io_uring(ctx, mode);
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
         .ret        = -EINPROGRESS,
@@ -432,28 +1014,45 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned int mode, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (mode & LURING_MODE_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    if (mode & LURING_MODE_IOPOLL) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring%s%s",
+                         mode & LURING_MODE_SQPOLL ? " with SQPOLL" : "",
+                         mode & LURING_MODE_IOPOLL ? " with IOPOLL" : "");
         g_free(s);
         return NULL;
     }
 
+    s->mode = mode;
+    s->iopoll_reap = (mode & LURING_MODE_IOPOLL) &&
+                     !(mode & LURING_MODE_SQPOLL);
+
     ioq_init(&s->io_q);
+    luring_fixed_attach(s);
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    luring_fixed_detach(s);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
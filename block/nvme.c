@@ -50,11 +50,14 @@ typedef struct BDRVNVMeState BDRVNVMeState;
 #define INDEX_ADMIN     0
 #define INDEX_IO(n)     (1 + n)
 
-/* This driver shares a single MSIX IRQ for the admin and I/O queues */
-enum {
-    MSIX_SHARED_IRQ_IDX = 0,
-    MSIX_IRQ_COUNT = 1
-};
+/*
+ * The admin queue uses MSI-X vector 0.  I/O queues get a vector of their own
+ * if the device has enough of them and share vector 0 otherwise.
+ */
+#define MSIX_SHARED_IRQ_IDX 0
+
+/* Upper limit for the "queues" option */
+#define NVME_MAX_IO_QUEUES 64
 
 typedef struct {
     int32_t  head, tail;
@@ -79,6 +82,16 @@ typedef struct {
     /* Read from I/O code path, initialized under BQL */
     BDRVNVMeState   *s;
     int             index;
+    unsigned        irq_vector;
+    EventNotifier   irq_notifier;
+
+    /*
+     * AioContext that submits requests to this I/O queue pair, NULL while
+     * unassigned.  If the queue pair has its own MSI-X vector, completions
+     * are processed there as well.  Set under s->queue_assign_lock, cleared
+     * under BQL while drained.
+     */
+    AioContext      *aio_context;
 
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
@@ -115,7 +128,13 @@ struct BDRVNVMeState {
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
     bool write_cache_supported;
-    EventNotifier irq_notifier[MSIX_IRQ_COUNT];
+
+    /* Protects assignment of I/O queue pairs to AioContexts */
+    QemuMutex queue_assign_lock;
+    /* Next I/O queue pair to hand out once each one has been assigned */
+    unsigned next_shared_queue;
+    /* AioContexts that had to share, mapped to their I/O queue pair */
+    GHashTable *shared_queues;
 
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
@@ -144,6 +163,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -161,6 +181,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -202,6 +227,7 @@ static void nvme_free_queue_pair(NVMeQueuePair *q)
     nvme_free_queue(&q->sq);
     nvme_free_queue(&q->cq);
     qemu_vfree(q->prp_list_pages);
+    event_notifier_cleanup(&q->irq_notifier);
     qemu_mutex_destroy(&q->lock);
     g_free(q);
 }
@@ -234,8 +260,14 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
         error_setg(errp, "Cannot allocate queue pair");
         return NULL;
     }
+    qemu_mutex_init(&q->lock);
+    r = event_notifier_init(&q->irq_notifier, 0);
+    if (r) {
+        error_setg_errno(errp, -r, "Failed to init event notifier");
+        goto fail;
+    }
     trace_nvme_create_queue_pair(idx, q, size, aio_context,
-                                 event_notifier_get_fd(s->irq_notifier));
+                                 event_notifier_get_fd(&q->irq_notifier));
     bytes = QEMU_ALIGN_UP(s->page_size * NVME_NUM_REQS,
                           qemu_real_host_page_size());
     q->prp_list_pages = qemu_try_memalign(qemu_real_host_page_size(), bytes);
@@ -244,7 +276,6 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
         goto fail;
     }
     memset(q->prp_list_pages, 0, bytes);
-    qemu_mutex_init(&q->lock);
     q->s = s;
     q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
@@ -413,7 +444,7 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         }
         ret = nvme_translate_error(c);
         if (ret) {
-            s->stats.completion_errors++;
+            qatomic_inc(&s->stats.completion_errors);
         }
         q->cq.head = (q->cq.head + 1) % NVME_QUEUE_SIZE;
         if (!q->cq.head) {
@@ -626,18 +657,24 @@ out:
     return ret;
 }
 
-static void nvme_poll_queue(NVMeQueuePair *q)
+/*
+ * Checks for new completions without taking q->lock.  A stale result is
+ * harmless: nvme_process_completion() looks at the completion queue again
+ * under the lock, and a missed entry is picked up on the next check.
+ */
+static bool nvme_queue_has_completion(NVMeQueuePair *q)
 {
     const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
     NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
+    return (le16_to_cpu(cqe->status) & 0x1) != q->cq_phase;
+}
+
+static void nvme_poll_queue(NVMeQueuePair *q)
+{
     trace_nvme_poll_queue(q->s, q->index);
-    /*
-     * Do an early check for completions. q->lock isn't needed because
-     * nvme_process_completion() only runs in the event loop thread and
-     * cannot race with itself.
-     */
-    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+    /* Do an early check for completions */
+    if (!nvme_queue_has_completion(q)) {
         return;
     }
 
@@ -648,48 +685,47 @@ static void nvme_poll_queue(NVMeQueuePair *q)
     qemu_mutex_unlock(&q->lock);
 }
 
+/* Poll the queues that are signalled through the shared MSI-X vector */
 static void nvme_poll_queues(BDRVNVMeState *s)
 {
     int i;
 
     for (i = 0; i < s->queue_count; i++) {
-        nvme_poll_queue(s->queues[i]);
+        if (s->queues[i]->irq_vector == MSIX_SHARED_IRQ_IDX) {
+            nvme_poll_queue(s->queues[i]);
+        }
     }
 }
 
 static void nvme_handle_event(EventNotifier *n)
 {
-    BDRVNVMeState *s = container_of(n, BDRVNVMeState,
-                                    irq_notifier[MSIX_SHARED_IRQ_IDX]);
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+    BDRVNVMeState *s = q->s;
 
     trace_nvme_handle_event(s);
     event_notifier_test_and_clear(n);
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+/* Creates @q on the device, it must have been allocated already */
+static bool nvme_add_io_queue(BlockDriverState *bs, NVMeQueuePair *q,
+                              Error **errp)
 {
-    BDRVNVMeState *s = bs->opaque;
-    unsigned n = s->queue_count;
-    NVMeQueuePair *q;
+    unsigned n = q->index;
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
 
     assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
-    if (!q) {
-        return false;
-    }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .dptr.prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
-        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
+        .cdw11 = cpu_to_le32((q->irq_vector << 16) |
+                             NVME_CQ_IEN | NVME_CQ_PC),
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
-        goto out_error;
+        return false;
     }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_SQ,
@@ -699,34 +735,61 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
-        goto out_error;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Creates the I/O queue pairs allocated in nvme_init() on the device.  Only
+ * the first one is required, the controller may grant fewer than requested
+ * and the others are then dropped.
+ */
+static bool nvme_add_io_queues(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    unsigned requested = s->queue_count - INDEX_IO(0);
+    Error *local_err = NULL;
+    unsigned n;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((requested - 1) << 16) | (requested - 1)),
+    };
+
+    /* Failure is not fatal, queue creation below tells what we got */
+    nvme_admin_cmd_sync(bs, &cmd);
+
+    for (n = INDEX_IO(0); n < s->queue_count; n++) {
+        if (!nvme_add_io_queue(bs, s->queues[n], &local_err)) {
+            break;
+        }
+    }
+    if (n == INDEX_IO(0)) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+    if (local_err) {
+        warn_reportf_err(local_err, "Using %u of %u requested I/O queues: ",
+                         n - INDEX_IO(0), requested);
+    }
+    while (s->queue_count > n) {
+        nvme_free_queue_pair(s->queues[--s->queue_count]);
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
-    s->queues[n] = q;
-    s->queue_count++;
     return true;
-out_error:
-    nvme_free_queue_pair(q);
-    return false;
 }
 
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
-    BDRVNVMeState *s = container_of(e, BDRVNVMeState,
-                                    irq_notifier[MSIX_SHARED_IRQ_IDX]);
+    BDRVNVMeState *s = container_of(e, NVMeQueuePair, irq_notifier)->s;
     int i;
 
     for (i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
-        const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
-        NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
-
-        /*
-         * q->lock isn't needed because nvme_process_completion() only runs in
-         * the event loop thread and cannot race with itself.
-         */
-        if ((le16_to_cpu(cqe->status) & 0x1) != q->cq_phase) {
+
+        if (q->irq_vector == MSIX_SHARED_IRQ_IDX &&
+            nvme_queue_has_completion(q)) {
             return true;
         }
     }
@@ -735,18 +798,109 @@ static bool nvme_poll_cb(void *opaque)
 
 static void nvme_poll_ready(EventNotifier *e)
 {
-    BDRVNVMeState *s = container_of(e, BDRVNVMeState,
-                                    irq_notifier[MSIX_SHARED_IRQ_IDX]);
+    BDRVNVMeState *s = container_of(e, NVMeQueuePair, irq_notifier)->s;
 
     nvme_poll_queues(s);
 }
 
+/*
+ * Handlers for I/O queue pairs with their own MSI-X vector.  These run in the
+ * AioContext the queue pair is assigned to, so with adaptive polling enabled
+ * (the iothread poll-max-ns property) completions of busy queues are reaped
+ * by polling the completion queue without waiting for the interrupt.
+ */
+static void nvme_handle_queue_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_handle_queue_event(q->s, q->index);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+
+    return nvme_queue_has_completion(container_of(e, NVMeQueuePair,
+                                                  irq_notifier));
+}
+
+static void nvme_queue_poll_ready(EventNotifier *e)
+{
+    nvme_poll_queue(container_of(e, NVMeQueuePair, irq_notifier));
+}
+
+/* Called with s->queue_assign_lock held, @q must be idle */
+static void nvme_assign_io_queue(NVMeQueuePair *q, AioContext *ctx)
+{
+    trace_nvme_assign_io_queue(q->s, q->index, ctx);
+    if (q->irq_vector != MSIX_SHARED_IRQ_IDX) {
+        qemu_bh_delete(q->completion_bh);
+        q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+        aio_set_event_notifier(ctx, &q->irq_notifier,
+                               nvme_handle_queue_event, nvme_queue_poll_cb,
+                               nvme_queue_poll_ready);
+    }
+    qatomic_store_release(&q->aio_context, ctx);
+}
+
+/* Called under BQL with no requests in flight */
+static void nvme_unassign_io_queue(NVMeQueuePair *q)
+{
+    if (q->aio_context && q->irq_vector != MSIX_SHARED_IRQ_IDX) {
+        aio_set_event_notifier(q->aio_context, &q->irq_notifier,
+                               NULL, NULL, NULL);
+    }
+    qatomic_set(&q->aio_context, NULL);
+}
+
+/*
+ * Returns the I/O queue pair for requests from the current AioContext.  Each
+ * AioContext gets a queue pair of its own on first use so that iothreads
+ * don't contend on q->lock; once all of them are taken, further AioContexts
+ * are assigned one of them round-robin, which they keep for all their
+ * requests.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned nr_io_queues = s->queue_count - INDEX_IO(0);
+    NVMeQueuePair *q;
+    unsigned i;
+
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        if (qatomic_load_acquire(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    QEMU_LOCK_GUARD(&s->queue_assign_lock);
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        q = s->queues[i];
+
+        if (!q->aio_context) {
+            nvme_assign_io_queue(q, ctx);
+            return q;
+        }
+    }
+
+    q = g_hash_table_lookup(s->shared_queues, ctx);
+    if (!q) {
+        q = s->queues[INDEX_IO(s->next_shared_queue++ % nr_io_queues)];
+        g_hash_table_insert(s->shared_queues, ctx, q);
+    }
+    return q;
+}
+
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned nr_io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
     AioContext *aio_context = bdrv_get_aio_context(bs);
+    g_autofree EventNotifier **irq_notifiers = NULL;
+    int nr_vectors;
     int ret;
     uint64_t cap;
     uint32_t ver;
@@ -757,14 +911,11 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->queue_assign_lock);
+    s->shared_queues = g_hash_table_new(NULL, NULL);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
-    ret = event_notifier_init(&s->irq_notifier[MSIX_SHARED_IRQ_IDX], 0);
-    if (ret) {
-        error_setg(errp, "Failed to init event notifier");
-        return ret;
-    }
 
     s->vfio = qemu_vfio_open_pci(device, errp);
     if (!s->vfio) {
@@ -852,6 +1003,23 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     host_pci_stq_le_p(&regs->asq, q->sq.iova);
     host_pci_stq_le_p(&regs->acq, q->cq.iova);
 
+    /*
+     * The I/O queue pairs are allocated before setting up interrupts so that
+     * each can get an MSI-X vector of its own.  They are created on the
+     * device in nvme_add_io_queues().
+     */
+    s->queues = g_renew(NVMeQueuePair *, s->queues, INDEX_IO(nr_io_queues));
+    for (unsigned i = 0; i < nr_io_queues; i++) {
+        q = nvme_create_queue_pair(s, aio_context, INDEX_IO(i),
+                                   NVME_QUEUE_SIZE, errp);
+        if (!q) {
+            ret = -EINVAL;
+            goto out;
+        }
+        s->queues[INDEX_IO(i)] = q;
+        s->queue_count++;
+    }
+
     /* After setting up all control registers we can enable device now. */
     host_pci_stl_le_p(&regs->cc,
                       (ctz32(NVME_CQ_ENTRY_BYTES) << CC_IOCQES_SHIFT) |
@@ -870,13 +1038,22 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
-    if (ret) {
+    irq_notifiers = g_new(EventNotifier *, s->queue_count);
+    for (unsigned i = 0; i < s->queue_count; i++) {
+        irq_notifiers[i] = &s->queues[i]->irq_notifier;
+    }
+    nr_vectors = qemu_vfio_pci_init_irqs(s->vfio, irq_notifiers,
+                                         s->queue_count,
+                                         VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (nr_vectors < 0) {
+        ret = nr_vectors;
         goto out;
     }
-    aio_set_event_notifier(bdrv_get_aio_context(bs),
-                           &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
+    for (unsigned i = INDEX_IO(0); i < s->queue_count; i++) {
+        s->queues[i]->irq_vector = i < nr_vectors ? i : MSIX_SHARED_IRQ_IDX;
+    }
+    aio_set_event_notifier(aio_context,
+                           &s->queues[INDEX_ADMIN]->irq_notifier,
                            nvme_handle_event, nvme_poll_cb,
                            nvme_poll_ready);
 
@@ -886,7 +1063,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queues(bs, errp)) {
         ret = -EIO;
     }
 out:
@@ -957,14 +1134,20 @@ static void nvme_close(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
+    if (s->queue_count) {
+        aio_set_event_notifier(bdrv_get_aio_context(bs),
+                               &s->queues[INDEX_ADMIN]->irq_notifier,
+                               NULL, NULL, NULL);
+    }
+    for (unsigned i = INDEX_IO(0); i < s->queue_count; ++i) {
+        nvme_unassign_io_queue(s->queues[i]);
+    }
     for (unsigned i = 0; i < s->queue_count; ++i) {
         nvme_free_queue_pair(s->queues[i]);
     }
     g_free(s->queues);
-    aio_set_event_notifier(bdrv_get_aio_context(bs),
-                           &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
-                           NULL, NULL, NULL);
-    event_notifier_cleanup(&s->irq_notifier[MSIX_SHARED_IRQ_IDX]);
+    g_hash_table_destroy(s->shared_queues);
+    qemu_mutex_destroy(&s->queue_assign_lock);
     qemu_vfio_pci_unmap_bar(s->vfio, 0, s->bar0_wo_map,
                             0, sizeof(NvmeBar) + NVME_DOORBELL_SIZE);
     qemu_vfio_close(s->vfio);
@@ -978,6 +1161,7 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t nr_io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -993,7 +1177,14 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    nr_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES, 1);
+    if (nr_io_queues < 1 || nr_io_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 and %d",
+                   NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, nr_io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1055,6 +1246,71 @@ static coroutine_fn int nvme_cmd_unmap_qiov(BlockDriverState *bs,
     return r;
 }
 
+/* Point @cmd at the first @entries pages in @req's PRP list page */
+static void nvme_cmd_set_prps(BDRVNVMeState *s, NvmeCmd *cmd,
+                              NVMeRequest *req, QEMUIOVector *qiov,
+                              int entries)
+{
+    uint64_t *pagelist = req->prp_list_page;
+    int i;
+
+    assert(entries <= s->page_size / sizeof(uint64_t));
+    switch (entries) {
+    case 0:
+        abort();
+    case 1:
+        cmd->dptr.prp1 = pagelist[0];
+        cmd->dptr.prp2 = 0;
+        break;
+    case 2:
+        cmd->dptr.prp1 = pagelist[0];
+        cmd->dptr.prp2 = pagelist[1];
+        break;
+    default:
+        cmd->dptr.prp1 = pagelist[0];
+        cmd->dptr.prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+        break;
+    }
+    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
+    for (i = 0; i < entries; ++i) {
+        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
+    }
+}
+
+/*
+ * Fast path for buffers that are covered by fixed mappings, in particular
+ * guest RAM registered through bdrv_register_buf() by block-ram-registrar.
+ * Neither s->dma_map_lock nor temporary IOVA space is needed for those.
+ *
+ * Returns false if some part of @qiov isn't mapped yet.
+ */
+static bool nvme_cmd_map_qiov_fixed(BlockDriverState *bs, NvmeCmd *cmd,
+                                    NVMeRequest *req, QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t *pagelist = req->prp_list_page;
+    int i, j;
+    int entries = 0;
+
+    assert(qiov->size);
+    assert(QEMU_IS_ALIGNED(qiov->size, s->page_size));
+    assert(qiov->size / s->page_size <= s->page_size / sizeof(uint64_t));
+    for (i = 0; i < qiov->niov; ++i) {
+        uint64_t iova;
+
+        if (!qemu_vfio_dma_find_fixed(s->vfio, qiov->iov[i].iov_base,
+                                      qiov->iov[i].iov_len, &iova)) {
+            return false;
+        }
+        for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+    }
+
+    nvme_cmd_set_prps(s, cmd, req, qiov, entries);
+    return true;
+}
+
 /* Called with s->dma_map_lock */
 static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
                                           NVMeRequest *req, QEMUIOVector *qiov)
@@ -1128,27 +1384,7 @@ try_map:
 
     s->dma_map_count += qiov->size;
 
-    assert(entries <= s->page_size / sizeof(uint64_t));
-    switch (entries) {
-    case 0:
-        abort();
-    case 1:
-        cmd->dptr.prp1 = pagelist[0];
-        cmd->dptr.prp2 = 0;
-        break;
-    case 2:
-        cmd->dptr.prp1 = pagelist[0];
-        cmd->dptr.prp2 = pagelist[1];
-        break;
-    default:
-        cmd->dptr.prp1 = pagelist[0];
-        cmd->dptr.prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
-        break;
-    }
-    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
-    for (i = 0; i < entries; ++i) {
-        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
-    }
+    nvme_cmd_set_prps(s, cmd, req, qiov, entries);
     return 0;
 fail:
     /* No need to unmap [0 - i) iovs even if we've failed, since we don't
@@ -1193,8 +1429,9 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
+    bool temporary_mapping = false;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -1206,21 +1443,25 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
     assert(s->queue_count > 1);
+    ioq = nvme_get_io_queue(s);
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        nvme_put_free_req_and_wake(ioq, req);
-        return r;
+    if (!nvme_cmd_map_qiov_fixed(bs, &cmd, req, qiov)) {
+        qemu_co_mutex_lock(&s->dma_map_lock);
+        r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
+        qemu_co_mutex_unlock(&s->dma_map_lock);
+        if (r) {
+            nvme_put_free_req_and_wake(ioq, req);
+            return r;
+        }
+        temporary_mapping = true;
     }
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
 
@@ -1229,11 +1470,13 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         qemu_coroutine_yield();
     }
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_unmap_qiov(bs, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        return r;
+    if (temporary_mapping) {
+        qemu_co_mutex_lock(&s->dma_map_lock);
+        r = nvme_cmd_unmap_qiov(bs, qiov);
+        qemu_co_mutex_unlock(&s->dma_map_lock);
+        if (r) {
+            return r;
+        }
     }
 
     trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
@@ -1272,10 +1515,10 @@ static coroutine_fn int nvme_co_prw(BlockDriverState *bs,
     assert(QEMU_IS_ALIGNED(bytes, s->page_size));
     assert(bytes <= s->max_transfer);
     if (nvme_qiov_aligned(bs, qiov)) {
-        s->stats.aligned_accesses++;
+        qatomic_inc(&s->stats.aligned_accesses);
         return nvme_co_prw_aligned(bs, offset, bytes, qiov, is_write, flags);
     }
-    s->stats.unaligned_accesses++;
+    qatomic_inc(&s->stats.unaligned_accesses);
     trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
     buf = qemu_try_memalign(qemu_real_host_page_size(), len);
 
@@ -1314,18 +1557,19 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
     assert(s->queue_count > 1);
+    ioq = nvme_get_io_queue(s);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1345,7 +1589,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1372,7 +1616,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1388,6 +1632,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
 
     trace_nvme_write_zeroes(s, offset, bytes, flags);
     assert(s->queue_count > 1);
+    ioq = nvme_get_io_queue(s);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1408,7 +1653,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
     QEMUIOVector local_qiov;
@@ -1422,7 +1667,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1452,6 +1697,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     qemu_iovec_init(&local_qiov, 1);
     qemu_iovec_add(&local_qiov, buf, 4096);
 
+    ioq = nvme_get_io_queue(s);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1552,6 +1798,18 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
+    /*
+     * I/O queue pairs are reassigned on their next use, which also lets go
+     * of AioContexts that no longer submit requests.
+     */
+    for (unsigned i = INDEX_IO(0); i < s->queue_count; i++) {
+        nvme_unassign_io_queue(s->queues[i]);
+    }
+    WITH_QEMU_LOCK_GUARD(&s->queue_assign_lock) {
+        g_hash_table_remove_all(s->shared_queues);
+        s->next_shared_queue = 0;
+    }
+
     for (unsigned i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
@@ -1560,7 +1818,7 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     }
 
     aio_set_event_notifier(bdrv_get_aio_context(bs),
-                           &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
+                           &s->queues[INDEX_ADMIN]->irq_notifier,
                            NULL, NULL, NULL);
 }
 
@@ -1570,7 +1828,7 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
 
     s->aio_context = new_context;
-    aio_set_event_notifier(new_context, &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
+    aio_set_event_notifier(new_context, &s->queues[INDEX_ADMIN]->irq_notifier,
                            nvme_handle_event, nvme_poll_cb,
                            nvme_poll_ready);
 
@@ -1611,9 +1869,9 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
 
     stats->driver = BLOCKDEV_DRIVER_NVME;
     stats->u.nvme = (BlockStatsSpecificNvme) {
-        .completion_errors = s->stats.completion_errors,
-        .aligned_accesses = s->stats.aligned_accesses,
-        .unaligned_accesses = s->stats.unaligned_accesses,
+        .completion_errors = qatomic_read(&s->stats.completion_errors),
+        .aligned_accesses = qatomic_read(&s->stats.aligned_accesses),
+        .unaligned_accesses = qatomic_read(&s->stats.unaligned_accesses),
     };
 
     return stats;
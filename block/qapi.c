@@ -616,6 +616,16 @@ bdrv_query_bds_stats(BlockDriverState *bs, bool blk_level)
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    if (bs->coalesce_ns) {
+        s->stats->has_coalesce_batches = true;
+        s->stats->coalesce_batches =
+            stat64_get(&bs->coalesce_batches_submitted);
+        s->stats->has_unmap_coalesced = true;
+        s->stats->unmap_coalesced = stat64_get(&bs->unmap_coalesced);
+        s->stats->has_zero_coalesced = true;
+        s->stats->zero_coalesced = stat64_get(&bs->zero_coalesced);
+    }
+
     s->driver_specific = bdrv_get_specific_stats(bs);
 
     parent_child = bdrv_primary_child(bs);
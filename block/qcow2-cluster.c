@@ -219,6 +219,126 @@ l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+typedef struct Qcow2L2Readahead {
+    BlockDriverState *bs;
+    uint64_t offset; /* guest offset of the first cluster in the slice */
+} Qcow2L2Readahead;
+
+static void coroutine_fn qcow2_co_l2_readahead_entry(void *opaque)
+{
+    Qcow2L2Readahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, ra->offset);
+    uint64_t l1_entry = 0, slice_offset = 0, gen = 0;
+    size_t slice_size = s->l2_slice_size * l2_entry_size(s);
+    void *buf = NULL;
+    int ret;
+
+    GRAPH_RDLOCK_GUARD();
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (l1_index < s->l1_size) {
+        l1_entry = s->l1_table[l1_index];
+        slice_offset = l1_entry & L1E_OFFSET_MASK;
+    }
+
+    /* Errors are left for the foreground request to find and report */
+    if (slice_offset && !offset_into_cluster(s, slice_offset)) {
+        slice_offset += l2_entry_size(s) * offset_to_l2_index(s, ra->offset);
+        if (!qcow2_cache_is_table_offset(s->l2_table_cache, slice_offset)) {
+            buf = qemu_try_blockalign(bs->file->bs, slice_size);
+            gen = qcow2_cache_generation(s->l2_table_cache);
+        }
+    }
+
+    if (buf) {
+        trace_qcow2_l2_readahead(bs, ra->offset, slice_offset);
+        qemu_co_mutex_unlock(&s->lock);
+
+        ret = bdrv_co_pread(bs->file, slice_offset, slice_size, buf, 0);
+
+        qemu_co_mutex_lock(&s->lock);
+        if (ret >= 0 && l1_index < s->l1_size &&
+            s->l1_table[l1_index] == l1_entry)
+        {
+            qcow2_cache_insert(s->l2_table_cache, slice_offset, buf, gen);
+        }
+    }
+
+    s->l2_ra_in_flight--;
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_vfree(buf);
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * qcow2_l2_readahead
+ *
+ * Called with s->lock held before L2 lookups done on behalf of reads and
+ * block status queries. Once lookups have advanced
+ * through QCOW2_READAHEAD_TRIGGER consecutive L2 slices, the following
+ * s->l2_readahead slices are loaded into the L2 cache in the background, so
+ * that a sequential scan does not stall on a metadata read every time it
+ * crosses into a new slice.
+ */
+void coroutine_fn qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    uint64_t slice = offset / slice_bytes;
+    uint64_t nb_slices;
+
+    if (!s->l2_readahead || slice == s->l2_ra_last_slice) {
+        return;
+    }
+
+    /*
+     * Lookups lagging a little behind (e.g. block status and data reads of
+     * the same scan) belong to the same stream
+     */
+    if (slice < s->l2_ra_last_slice &&
+        s->l2_ra_last_slice - slice <= s->l2_readahead) {
+        return;
+    }
+
+    if (slice == s->l2_ra_last_slice + 1) {
+        s->l2_ra_seq++;
+    } else {
+        s->l2_ra_seq = 0;
+        s->l2_ra_next_slice = slice + 1;
+    }
+    s->l2_ra_last_slice = slice;
+
+    if (s->l2_ra_seq < QCOW2_READAHEAD_TRIGGER) {
+        return;
+    }
+
+    nb_slices = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                             slice_bytes);
+    s->l2_ra_next_slice = MAX(s->l2_ra_next_slice, slice + 1);
+
+    while (s->l2_ra_next_slice <= slice + s->l2_readahead &&
+           s->l2_ra_next_slice < nb_slices &&
+           s->l2_ra_in_flight < s->l2_readahead)
+    {
+        Qcow2L2Readahead *ra = g_new(Qcow2L2Readahead, 1);
+
+        *ra = (Qcow2L2Readahead) {
+            .bs = bs,
+            .offset = s->l2_ra_next_slice++ * slice_bytes,
+        };
+
+        s->l2_ra_in_flight++;
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs),
+                     qemu_coroutine_create(qcow2_co_l2_readahead_entry, ra));
+    }
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
@@ -598,6 +718,16 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
 
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
+    *host_offset = 0;
+
+    /* ranges known to be unallocated need no L2 lookup at all */
+    bytes_available =
+        qcow2_alloc_summary_unallocated(bs, offset - offset_in_cluster,
+                                        bytes_needed);
+    if (bytes_available) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
+    }
 
     /* compute how many bytes there are between the start of the cluster
      * containing offset and the end of the l2 slice that contains
@@ -610,8 +740,6 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
         bytes_needed = bytes_available;
     }
 
-    *host_offset = 0;
-
     /* seek to the l2 offset in the l1 table */
 
     l1_index = offset_to_l1_index(s, offset);
@@ -879,6 +1007,7 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
         set_l2_bitmap(s, l2_slice, l2_index, 0);
     }
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    qcow2_alloc_summary_mark(bs, offset, 1);
 
     *host_offset = cluster_offset & s->cluster_offset_mask;
     return 0;
@@ -1101,6 +1230,8 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         }
      }
 
+    qcow2_alloc_summary_mark(bs, m->offset,
+                             (uint64_t)m->nb_clusters << s->cluster_bits);
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
@@ -2009,6 +2140,11 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, bytes);
 
+    /* Without full_discard, entries may be replaced by zero clusters */
+    if (!full_discard) {
+        qcow2_alloc_summary_mark(bs, offset, bytes);
+    }
+
     s->cache_discards = true;
 
     /* Each L2 slice is handled by its own loop iteration */
@@ -2191,6 +2327,8 @@ int coroutine_fn qcow2_subcluster_zeroize(BlockDriverState *bs, uint64_t offset,
         return -ENOTSUP;
     }
 
+    qcow2_alloc_summary_mark(bs, offset, bytes);
+
     head = MIN(end_offset, ROUND_UP(offset, s->cluster_size)) - offset;
     offset += head;
 
@@ -2237,6 +2375,124 @@ fail:
     return ret;
 }
 
+/*
+ * Make QCOW_OFLAG_COPIED in the L2 entry of the guest cluster at @offset
+ * match the refcount of its data cluster, provided that the entry still maps
+ * the normal cluster at @host_offset.  This is used by deduplication when it
+ * takes or drops an additional reference to a data cluster.
+ *
+ * Returns 1 if the entry maps @host_offset, 0 if it does not, and -errno on
+ * failure.
+ */
+int GRAPH_RDLOCK
+qcow2_dedup_update_copied(BlockDriverState *bs, uint64_t offset,
+                          uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    uint64_t l2_entry, new_l2_entry, refcount;
+    int l2_index, ret;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset 0x%" PRIx64
+                                " unaligned (L1 index: 0x%" PRIx64 ")",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        (l2_entry & L2E_OFFSET_MASK) != host_offset)
+    {
+        ret = 0;
+        goto out;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        goto out;
+    }
+
+    new_l2_entry = l2_entry & ~QCOW_OFLAG_COPIED;
+    if (refcount == 1) {
+        new_l2_entry |= QCOW_OFLAG_COPIED;
+    }
+
+    /* A shared L2 table is never modified in place */
+    if (new_l2_entry != l2_entry &&
+        (s->l1_table[l1_index] & QCOW_OFLAG_COPIED))
+    {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index, new_l2_entry);
+    }
+    ret = 1;
+
+out:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
+/*
+ * Map the guest cluster at @offset to the data cluster at @host_offset and
+ * release the cluster it mapped before.  The caller must already hold the
+ * reference to @host_offset that the new L2 entry represents, so the cluster
+ * is always shared and the entry is not marked as copied.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+int GRAPH_RDLOCK
+qcow2_dedup_link_cluster(BlockDriverState *bs, uint64_t offset,
+                         uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t old_l2_entry;
+    int l2_index;
+    int ret;
+
+    assert(!has_subclusters(s));
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_l2_entry = get_l2_entry(s, l2_slice, l2_index);
+
+    /* The refcount must be on disk before the L2 entry that uses it */
+    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    qcow2_alloc_summary_mark(bs, offset, s->cluster_size);
+
+    /* Then decrease the refcount of the old cluster */
+    qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_NEVER);
+
+    return 0;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
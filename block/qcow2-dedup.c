@@ -0,0 +1,654 @@
+/*
+ * Deduplication of written clusters for the QCOW version 2 format
+ *
+ * Full clusters written by the guest are hashed, and an index maps each hash
+ * to the guest offset of a cluster that was written with that content.  When
+ * a later write carries the same content, the target guest cluster is mapped
+ * to the existing data cluster instead: its refcount is incremented and both
+ * L2 entries lose QCOW_OFLAG_COPIED, so that further writes to either of
+ * them allocate a new cluster as they do for clusters shared with internal
+ * snapshots.
+ *
+ * Index entries are hints.  Before a cluster is shared, the L2 entry of the
+ * indexed guest offset is checked and the data is compared byte by byte, so
+ * stale entries and hash collisions only cost a read.  The index is written to
+ * the image on inactivation, guarded by an autoclear feature bit that only
+ * tells whether the clusters holding it may be freed.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/range.h"
+#include "qemu/xxhash.h"
+
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DedupEntry {
+    uint64_t hash;
+    uint64_t offset; /* guest offset of a cluster with this content */
+} Qcow2DedupEntry;
+
+/* Data write that may modify an allocated cluster in place */
+typedef struct Qcow2DedupWrite {
+    uint64_t host_offset;
+    uint64_t bytes;
+    QLIST_ENTRY(Qcow2DedupWrite) next;
+} Qcow2DedupWrite;
+
+static uint64_t dedup_hash(const void *buf, size_t size)
+{
+    const uint64_t *p = buf;
+    uint64_t v1, v2, v3, v4;
+    size_t i;
+
+    v1 = QEMU_XXHASH_SEED + XXH_PRIME64_1 + XXH_PRIME64_2;
+    v2 = QEMU_XXHASH_SEED + XXH_PRIME64_2;
+    v3 = QEMU_XXHASH_SEED + 0;
+    v4 = QEMU_XXHASH_SEED - XXH_PRIME64_1;
+    for (i = 0; i < size / 8; i += 4) {
+        v1 = XXH64_round(v1, le64_to_cpu(p[i + 0]));
+        v2 = XXH64_round(v2, le64_to_cpu(p[i + 1]));
+        v3 = XXH64_round(v3, le64_to_cpu(p[i + 2]));
+        v4 = XXH64_round(v4, le64_to_cpu(p[i + 3]));
+    }
+
+    return XXH64_avalanche(XXH64_mergerounds(v1, v2, v3, v4) + size);
+}
+
+static GHashTable *dedup_index_new(void)
+{
+    return g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+}
+
+static void dedup_index_insert(BDRVQcow2State *s, uint64_t hash,
+                               uint64_t offset)
+{
+    Qcow2DedupEntry *e = g_hash_table_lookup(s->dedup_index, &hash);
+
+    if (e) {
+        e->offset = offset;
+    } else if (g_hash_table_size(s->dedup_index) < QCOW2_DEDUP_MAX_ENTRIES) {
+        e = g_new(Qcow2DedupEntry, 1);
+        e->hash = hash;
+        e->offset = offset;
+        g_hash_table_insert(s->dedup_index, &e->hash, e);
+    } else {
+        return;
+    }
+
+    s->dedup_index_dirty = true;
+}
+
+/* Forget @hash unless it was reassigned to another cluster meanwhile */
+static void dedup_index_remove(BDRVQcow2State *s, uint64_t hash,
+                               uint64_t offset)
+{
+    Qcow2DedupEntry *e = g_hash_table_lookup(s->dedup_index, &hash);
+
+    if (e && e->offset == offset) {
+        g_hash_table_remove(s->dedup_index, &hash);
+        s->dedup_index_dirty = true;
+    }
+}
+
+/*
+ * Return whether the guest cluster at @offset is being allocated, or whether
+ * its data cluster at @host_offset (if not 0) is being written to.
+ */
+static bool dedup_cluster_busy(BlockDriverState *bs, uint64_t offset,
+                               uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *m;
+    Qcow2DedupWrite *w;
+
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (ranges_overlap(m->offset, (uint64_t)m->nb_clusters <<
+                           s->cluster_bits, offset, s->cluster_size)) {
+            return true;
+        }
+    }
+
+    if (host_offset) {
+        QLIST_FOREACH(w, &s->dedup_writes, next) {
+            if (ranges_overlap(w->host_offset, w->bytes, host_offset,
+                               s->cluster_size)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Make writes to the guest cluster at @offset wait until
+ * dedup_unblock_cluster() is called, like an allocation in flight does.
+ */
+static QCowL2Meta *dedup_block_cluster(BDRVQcow2State *s, uint64_t offset)
+{
+    QCowL2Meta *m = g_new(QCowL2Meta, 1);
+
+    *m = (QCowL2Meta) {
+        .offset         = offset,
+        .nb_clusters    = 1,
+        .cow_end = {
+            .offset     = s->cluster_size,
+        },
+    };
+
+    qemu_co_queue_init(&m->dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, m, next_in_flight);
+
+    return m;
+}
+
+static void coroutine_fn dedup_unblock_cluster(QCowL2Meta *m)
+{
+    QLIST_REMOVE(m, next_in_flight);
+    qemu_co_queue_restart_all(&m->dependent_requests);
+    g_free(m);
+}
+
+/*
+ * Try to map the guest cluster at @offset, whose new content is @buf, to the
+ * data cluster that @src_offset maps.  @cmp_buf is scratch space for one
+ * cluster.
+ *
+ * Called with s->lock held, which is dropped while the data is compared.
+ * Returns 1 if the guest cluster now maps data equal to @buf, 0 if it has to
+ * be written normally, and -errno on failure.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_try_link(BlockDriverState *bs, uint64_t offset, uint64_t src_offset,
+               uint64_t hash, const void *buf, void *cmp_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t host_offset, dst_host_offset, refcount;
+    unsigned int bytes;
+    QCow2SubclusterType type;
+    QCowL2Meta *src_block = NULL, *dst_block;
+    int ret, ret2;
+
+    if (src_offset + s->cluster_size >
+        (uint64_t)bs->total_sectors * BDRV_SECTOR_SIZE)
+    {
+        dedup_index_remove(s, hash, src_offset);
+        return 0;
+    }
+
+    bytes = s->cluster_size;
+    ret = qcow2_get_host_offset(bs, src_offset, &bytes, &host_offset, &type);
+    if (ret < 0) {
+        return ret;
+    }
+    if (type != QCOW2_SUBCLUSTER_NORMAL) {
+        dedup_index_remove(s, hash, src_offset);
+        return 0;
+    }
+
+    bytes = s->cluster_size;
+    ret = qcow2_get_host_offset(bs, offset, &bytes, &dst_host_offset, &type);
+    if (ret < 0) {
+        return ret;
+    }
+    if (type != QCOW2_SUBCLUSTER_NORMAL &&
+        type != QCOW2_SUBCLUSTER_ZERO_ALLOC)
+    {
+        dst_host_offset = 0;
+    }
+
+    if (dedup_cluster_busy(bs, src_offset, host_offset) ||
+        dedup_cluster_busy(bs, offset, dst_host_offset))
+    {
+        return 0;
+    }
+
+    /* Unless the target shares the cluster already, take a reference */
+    if (dst_host_offset != host_offset) {
+        ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits,
+                                 &refcount);
+        if (ret < 0) {
+            return ret;
+        }
+        if (refcount >= s->refcount_max) {
+            return 0;
+        }
+
+        ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                            1, false, QCOW2_DISCARD_NEVER);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* From now on, writes to the source do not touch the cluster */
+        ret = qcow2_dedup_update_copied(bs, src_offset, host_offset);
+        if (ret < 0) {
+            qcow2_free_clusters(bs, host_offset, s->cluster_size,
+                                QCOW2_DISCARD_NEVER);
+            return ret;
+        }
+
+        src_block = dedup_block_cluster(s, src_offset);
+    }
+    dst_block = dedup_block_cluster(s, offset);
+
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_AIO);
+    ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size, cmp_buf,
+                        0);
+    qemu_co_mutex_lock(&s->lock);
+
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (memcmp(buf, cmp_buf, s->cluster_size)) {
+        trace_qcow2_dedup_mismatch(qemu_coroutine_self(), offset, src_offset);
+        dedup_index_remove(s, hash, src_offset);
+        ret = 0;
+        goto out;
+    }
+
+    if (src_block) {
+        ret = qcow2_dedup_link_cluster(bs, offset, host_offset);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    trace_qcow2_dedup_link(qemu_coroutine_self(), offset, src_offset,
+                           host_offset);
+    ret = 1;
+
+out:
+    if (src_block) {
+        if (ret != 1) {
+            /* Drop the reference again and let the source own the cluster */
+            qcow2_free_clusters(bs, host_offset, s->cluster_size,
+                                QCOW2_DISCARD_NEVER);
+            ret2 = qcow2_dedup_update_copied(bs, src_offset, host_offset);
+        } else {
+            /* The source may have been discarded in the meantime */
+            ret2 = qcow2_dedup_update_copied(bs, offset, host_offset);
+        }
+        if (ret2 < 0 && ret >= 0) {
+            ret = ret2;
+        }
+        dedup_unblock_cluster(src_block);
+    }
+    dedup_unblock_cluster(dst_block);
+
+    return ret;
+}
+
+/*
+ * Look up the full clusters of a write request starting at the cluster
+ * aligned @offset in the deduplication index.
+ *
+ * Returns 1 if the first cluster was mapped to an existing data cluster with
+ * the same content; *cur_bytes is set to the cluster size then.  Returns 0 if
+ * the first *cur_bytes must be written normally; *cur_bytes is shortened to
+ * end before the next cluster that may be deduplicated.  Returns -errno on
+ * failure.
+ *
+ * Called without s->lock.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_dedup_pwritev(BlockDriverState *bs, uint64_t offset,
+                       QEMUIOVector *qiov, size_t qiov_offset,
+                       unsigned int *cur_bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bytes = 0;
+    void *buf, *cmp_buf;
+    int ret = 0;
+
+    assert(!offset_into_cluster(s, offset));
+    assert(*cur_bytes >= s->cluster_size);
+
+    if (!s->dedup_index) {
+        return 0;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    cmp_buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!buf || !cmp_buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    while (bytes + s->cluster_size <= *cur_bytes) {
+        uint64_t cluster_offset = offset + bytes;
+        Qcow2DedupEntry *e;
+        uint64_t hash;
+
+        qemu_iovec_to_buf(qiov, qiov_offset + bytes, buf, s->cluster_size);
+
+        /* Zero clusters are left to zero detection */
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            bytes += s->cluster_size;
+            continue;
+        }
+
+        hash = dedup_hash(buf, s->cluster_size);
+
+        qemu_co_mutex_lock(&s->lock);
+        e = g_hash_table_lookup(s->dedup_index, &hash);
+        if (e && e->offset != cluster_offset) {
+            if (bytes) {
+                /* Leave it to the next call, which starts at this cluster */
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+
+            ret = dedup_try_link(bs, offset, e->offset, hash, buf, cmp_buf);
+            if (ret != 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                if (ret > 0) {
+                    *cur_bytes = s->cluster_size;
+                }
+                goto out;
+            }
+        }
+
+        /* The cluster is written with this content now */
+        dedup_index_insert(s, hash, cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+
+        bytes += s->cluster_size;
+    }
+
+    *cur_bytes = bytes;
+
+out:
+    qemu_vfree(buf);
+    qemu_vfree(cmp_buf);
+    return ret;
+}
+
+/*
+ * Record a data write to [host_offset, host_offset + bytes), so that the
+ * clusters are not shared before it has completed.  Called with s->lock held.
+ */
+void qcow2_dedup_write_begin(BlockDriverState *bs, uint64_t host_offset,
+                             uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupWrite *w;
+
+    if (!s->dedup) {
+        return;
+    }
+
+    w = g_new(Qcow2DedupWrite, 1);
+    *w = (Qcow2DedupWrite) {
+        .host_offset    = host_offset,
+        .bytes          = bytes,
+    };
+    QLIST_INSERT_HEAD(&s->dedup_writes, w, next);
+}
+
+/* Called with s->lock held */
+void qcow2_dedup_write_end(BlockDriverState *bs, uint64_t host_offset,
+                           uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupWrite *w;
+
+    QLIST_FOREACH(w, &s->dedup_writes, next) {
+        if (w->host_offset == host_offset && w->bytes == bytes) {
+            QLIST_REMOVE(w, next);
+            g_free(w);
+            return;
+        }
+    }
+}
+
+static int GRAPH_RDLOCK dedup_index_read(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bytes = s->dedup_index_entries * sizeof(Qcow2DedupEntry);
+    Qcow2DedupEntry *entries;
+    uint64_t i;
+    int ret;
+
+    entries = g_try_malloc(bytes);
+    if (!entries) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->dedup_index_offset, bytes, entries, 0);
+    if (ret < 0) {
+        g_free(entries);
+        return ret;
+    }
+
+    for (i = 0; i < s->dedup_index_entries; i++) {
+        uint64_t offset = be64_to_cpu(entries[i].offset);
+
+        if (!offset_into_cluster(s, offset)) {
+            dedup_index_insert(s, be64_to_cpu(entries[i].hash), offset);
+        }
+    }
+    s->dedup_index_dirty = false;
+
+    g_free(entries);
+    return 0;
+}
+
+/*
+ * Set up the in-memory index when deduplication is enabled for a writable
+ * image, starting from the index stored in the image if there is a valid one.
+ * Failing to read the stored index is not fatal, deduplication then starts
+ * with an empty index.
+ */
+void GRAPH_RDLOCK qcow2_load_dedup_index(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->dedup || s->dedup_index || !bdrv_is_writable(bs)) {
+        return;
+    }
+
+    s->dedup_index = dedup_index_new();
+    s->dedup_index_dirty = false;
+
+    if (!s->dedup_index_offset ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX))
+    {
+        return;
+    }
+
+    ret = dedup_index_read(bs);
+    if (ret < 0) {
+        warn_report("Could not read the deduplication index of '%s': %s",
+                    bdrv_get_device_or_node_name(bs), strerror(-ret));
+    }
+}
+
+void qcow2_free_dedup_index(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup_index) {
+        g_hash_table_destroy(s->dedup_index);
+        s->dedup_index = NULL;
+    }
+    s->dedup_index_dirty = false;
+}
+
+/*
+ * Write the in-memory index to newly allocated clusters if it has changed.
+ * With @release, the in-memory index is dropped afterwards.
+ *
+ * The index is only stored in version 3 images, which have autoclear bits.
+ */
+int qcow2_store_dedup_index(BlockDriverState *bs, bool release, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->dedup_index_offset;
+    uint64_t old_entries = s->dedup_index_entries;
+    uint64_t old_autocl = s->autoclear_features;
+    bool old_valid = old_autocl & QCOW2_AUTOCLEAR_DEDUP_INDEX;
+    Qcow2DedupEntry *entries = NULL, *e;
+    GHashTableIter iter;
+    uint64_t nb_entries, bytes, i;
+    int64_t offset = 0;
+    int ret;
+
+    if (!s->dedup_index || !s->dedup_index_dirty ||
+        !bdrv_is_writable(bs) || s->qcow_version < 3)
+    {
+        goto out;
+    }
+
+    nb_entries = g_hash_table_size(s->dedup_index);
+    bytes = nb_entries * sizeof(Qcow2DedupEntry);
+
+    if (nb_entries) {
+        entries = g_try_malloc(bytes);
+        if (!entries) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        i = 0;
+        g_hash_table_iter_init(&iter, s->dedup_index);
+        while (g_hash_table_iter_next(&iter, NULL, (void **) &e)) {
+            entries[i].hash = cpu_to_be64(e->hash);
+            entries[i].offset = cpu_to_be64(e->offset);
+            i++;
+        }
+
+        offset = qcow2_alloc_clusters(bs, bytes);
+        if (offset < 0) {
+            ret = offset;
+            offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, bytes, false);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, offset, bytes, entries, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* The refcounts of the new clusters must be on disk first */
+        ret = qcow2_flush_caches(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    s->dedup_index_offset = offset;
+    s->dedup_index_entries = nb_entries;
+    if (offset) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP_INDEX;
+    } else {
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DEDUP_INDEX;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Without the bit, the old clusters may have been reused by others */
+    if (old_offset && old_valid) {
+        qcow2_free_clusters(bs, old_offset,
+                            old_entries * sizeof(Qcow2DedupEntry),
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    g_free(entries);
+    s->dedup_index_dirty = false;
+
+out:
+    if (release) {
+        qcow2_free_dedup_index(bs);
+    }
+    return 0;
+
+fail:
+    g_free(entries);
+    if (offset) {
+        qcow2_free_clusters(bs, offset, bytes, QCOW2_DISCARD_OTHER);
+    }
+
+    s->dedup_index_offset = old_offset;
+    s->dedup_index_entries = old_entries;
+    s->autoclear_features = old_autocl;
+
+    error_setg_errno(errp, -ret, "Failed to store the deduplication index");
+    return ret;
+}
+
+/* Remove the stored index from the image, the in-memory index is kept */
+int qcow2_remove_dedup_index(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->dedup_index_offset;
+    uint64_t old_entries = s->dedup_index_entries;
+    uint64_t old_autocl = s->autoclear_features;
+    int ret;
+
+    if (!old_offset) {
+        return 0;
+    }
+
+    s->dedup_index_offset = 0;
+    s->dedup_index_entries = 0;
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DEDUP_INDEX;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_index_offset = old_offset;
+        s->dedup_index_entries = old_entries;
+        s->autoclear_features = old_autocl;
+        error_setg_errno(errp, -ret, "Failed to update the image header");
+        return ret;
+    }
+
+    if (old_autocl & QCOW2_AUTOCLEAR_DEDUP_INDEX) {
+        qcow2_free_clusters(bs, old_offset,
+                            old_entries * sizeof(Qcow2DedupEntry),
+                            QCOW2_DISCARD_OTHER);
+    }
+    return 0;
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_index_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->dedup_index_offset ||
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX))
+    {
+        return 0;
+    }
+
+    return qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                    refcount_table_size,
+                                    s->dedup_index_offset,
+                                    s->dedup_index_entries *
+                                    sizeof(Qcow2DedupEntry));
+}
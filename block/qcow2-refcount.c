@@ -1651,10 +1651,213 @@ fail:
     return ret;
 }
 
+/*
+ * Reading the L2 tables one after another makes checking large images
+ * latency bound.  The check therefore reads the tables referenced by an L1
+ * table ahead, keeping several reads in flight.  The tables are still
+ * processed one at a time and in L1 order, so the results and messages are
+ * the same as without readahead.
+ */
+#define CHECK_L2_READAHEAD          16
+#define CHECK_L2_READAHEAD_BYTES    (16 * MiB)
+
+typedef struct CheckL2Readahead CheckL2Readahead;
+
+typedef struct CheckL2Read {
+    CheckL2Readahead *ra;
+    uint64_t *table;
+    int l1_index;
+    uint64_t offset;
+    uint64_t fixed;
+    int ret;
+    bool done;
+} CheckL2Read;
+
+struct CheckL2Readahead {
+    BlockDriverState *bs;
+    BdrvCheckResult *res;
+    const uint64_t *l1_table;
+    int l1_size;
+    size_t table_size;
+
+    int depth;
+    int next_l1_index;      /* next L1 index to be considered for reading */
+    uint64_t issued;        /* number of reads started */
+    uint64_t consumed;      /* number of reads handed out and released */
+    bool head_in_use;       /* the oldest read is handed out */
+    int in_flight;
+    Coroutine *waiter;
+    uint64_t *sync_table;   /* for tables that were not read ahead */
+    CheckL2Read reads[CHECK_L2_READAHEAD];
+};
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    CheckL2Read *r = opaque;
+    CheckL2Readahead *ra = r->ra;
+
+    GRAPH_RDLOCK_GUARD();
+
+    r->ret = bdrv_co_pread(ra->bs->file, r->offset, ra->table_size, r->table,
+                           0);
+    r->done = true;
+    ra->in_flight--;
+
+    if (ra->waiter) {
+        Coroutine *co = ra->waiter;
+
+        ra->waiter = NULL;
+        aio_co_wake(co);
+    }
+}
+
+/* Starts reads until the readahead window is full */
+static void check_l2_readahead_fill(CheckL2Readahead *ra)
+{
+    while (ra->issued - ra->consumed < ra->depth &&
+           ra->next_l1_index < ra->l1_size)
+    {
+        int i = ra->next_l1_index++;
+        uint64_t l2_offset = ra->l1_table[i] & L1E_OFFSET_MASK;
+        CheckL2Read *r;
+
+        if (!l2_offset) {
+            continue;
+        }
+
+        r = &ra->reads[ra->issued++ % ra->depth];
+        r->l1_index = i;
+        r->offset = l2_offset;
+        r->fixed = ra->res->corruptions_fixed;
+        r->done = false;
+        ra->in_flight++;
+
+        aio_co_enter(bdrv_get_aio_context(ra->bs),
+                     qemu_coroutine_create(check_l2_read_entry, r));
+    }
+}
+
+/*
+ * Prepares reading the L2 tables referenced by @l1_table, which must be in
+ * host byte order and stay valid until check_l2_readahead_cleanup().  The
+ * latter must be called even if this function fails.
+ */
+static int check_l2_readahead_init(CheckL2Readahead *ra, BlockDriverState *bs,
+                                   BdrvCheckResult *res,
+                                   const uint64_t *l1_table, int l1_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    *ra = (CheckL2Readahead) {
+        .bs         = bs,
+        .res        = res,
+        .l1_table   = l1_table,
+        .l1_size    = l1_size,
+        .table_size = s->l2_size * l2_entry_size(s),
+    };
+    ra->depth = MAX(1, MIN(CHECK_L2_READAHEAD,
+                           CHECK_L2_READAHEAD_BYTES / ra->table_size));
+
+    for (i = 0; i < ra->depth; i++) {
+        ra->reads[i].ra = ra;
+        ra->reads[i].table = qemu_try_blockalign(bs->file->bs, ra->table_size);
+        if (!ra->reads[i].table) {
+            return -ENOMEM;
+        }
+    }
+
+    check_l2_readahead_fill(ra);
+    return 0;
+}
+
+/*
+ * Returns in *@table the L2 table at @l2_offset, which @l1_index of the L1
+ * table refers to.  Tables must be requested in L1 order, but callers may skip
+ * some.  The table may be modified by the caller and stays valid until the
+ * next call.
+ *
+ * Tables that a repair may have changed since they were read ahead are read
+ * again, as are tables that were not read ahead at all (e.g. because the L1
+ * entry has no offset).
+ */
+static int coroutine_fn GRAPH_RDLOCK
+check_l2_readahead_get(CheckL2Readahead *ra, int l1_index, uint64_t l2_offset,
+                       uint64_t **table)
+{
+    CheckL2Read *r;
+
+    if (ra->head_in_use) {
+        ra->head_in_use = false;
+        ra->consumed++;
+        check_l2_readahead_fill(ra);
+    }
+
+    /* Release the reads of tables the caller skipped */
+    while (ra->consumed < ra->issued &&
+           ra->reads[ra->consumed % ra->depth].l1_index < l1_index)
+    {
+        r = &ra->reads[ra->consumed % ra->depth];
+        while (!r->done) {
+            ra->waiter = qemu_coroutine_self();
+            qemu_coroutine_yield();
+        }
+        ra->consumed++;
+        check_l2_readahead_fill(ra);
+    }
+
+    r = &ra->reads[ra->consumed % ra->depth];
+    if (ra->consumed == ra->issued ||
+        r->l1_index != l1_index || r->offset != l2_offset)
+    {
+        if (!ra->sync_table) {
+            ra->sync_table = qemu_try_blockalign(ra->bs->file->bs,
+                                                 ra->table_size);
+            if (!ra->sync_table) {
+                return -ENOMEM;
+            }
+        }
+        *table = ra->sync_table;
+        return bdrv_co_pread(ra->bs->file, l2_offset, ra->table_size,
+                             ra->sync_table, 0);
+    }
+
+    while (!r->done) {
+        ra->waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    ra->head_in_use = true;
+    *table = r->table;
+
+    if (r->ret >= 0 && r->fixed != ra->res->corruptions_fixed) {
+        return bdrv_co_pread(ra->bs->file, l2_offset, ra->table_size,
+                             r->table, 0);
+    }
+    return r->ret;
+}
+
+static void coroutine_fn check_l2_readahead_cleanup(CheckL2Readahead *ra)
+{
+    int i;
+
+    /* Stop starting new reads and wait for those in flight */
+    ra->next_l1_index = ra->l1_size;
+    while (ra->in_flight) {
+        ra->waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    for (i = 0; i < ra->depth; i++) {
+        qemu_vfree(ra->reads[i].table);
+    }
+    qemu_vfree(ra->sync_table);
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * entries. @l2_table is the content of the L2 table at @l2_offset; entries
+ * that are repaired are updated in it.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,24 +1866,15 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
-                   int flags, BdrvCheckMode fix, bool active)
+                   uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                   bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1868,7 +2062,9 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
     g_autofree uint64_t *l1_table = NULL;
+    CheckL2Readahead ra;
     uint64_t l2_offset;
+    uint64_t *l2_table;
     int i, ret;
 
     if (!l1_size) {
@@ -1900,6 +2096,12 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
         be64_to_cpus(&l1_table[i]);
     }
 
+    ret = check_l2_readahead_init(&ra, bs, res, l1_table, l1_size);
+    if (ret < 0) {
+        res->check_errors++;
+        goto out;
+    }
+
     /* Do the actual checks */
     for (i = 0; i < l1_size; i++) {
         if (!l1_table[i]) {
@@ -1919,7 +2121,7 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
                                        refcount_table, refcount_table_size,
                                        l2_offset, s->cluster_size);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
 
         /* L2 tables are cluster aligned */
@@ -1929,16 +2131,27 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
             res->corruptions++;
         }
 
+        /* Read L2 table from disk */
+        ret = check_l2_readahead_get(&ra, i, l2_offset, &l2_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            goto out;
+        }
+
         /* Process and check L2 entries */
         ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
+                                 refcount_table_size, l2_offset, l2_table,
+                                 flags, fix, active);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
-    return 0;
+    ret = 0;
+out:
+    check_l2_readahead_cleanup(&ra);
+    return ret;
 }
 
 /*
@@ -1953,7 +2166,8 @@ static int coroutine_fn GRAPH_RDLOCK
 check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
+    CheckL2Readahead ra;
+    uint64_t *l2_table;
     int ret;
     uint64_t refcount;
     int i, j;
@@ -1971,6 +2185,13 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
         repair = false;
     }
 
+    /* Repairs only touch the flags, so the offsets in s->l1_table are stable */
+    ret = check_l2_readahead_init(&ra, bs, res, s->l1_table, s->l1_size);
+    if (ret < 0) {
+        res->check_errors++;
+        goto fail;
+    }
+
     for (i = 0; i < s->l1_size; i++) {
         uint64_t l1_entry = s->l1_table[i];
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
@@ -2005,8 +2226,7 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
             }
         }
 
-        ret = bdrv_co_pread(bs->file, l2_offset, s->l2_size * l2_entry_size(s),
-                            l2_table, 0);
+        ret = check_l2_readahead_get(&ra, i, l2_offset, &l2_table);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -2074,7 +2294,7 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    check_l2_readahead_cleanup(&ra);
     return ret;
 }
 
@@ -2293,6 +2513,20 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* allocation summary */
+    ret = qcow2_check_alloc_summary_refcounts(bs, res, refcount_table,
+                                              nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* deduplication index */
+    ret = qcow2_check_dedup_index_refcounts(bs, res, refcount_table,
+                                            nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -873,6 +873,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
      * Now update the in-memory L1 table to be in sync with the on-disk one. We
      * need to do this even if updating refcounts failed.
      */
+    qcow2_alloc_summary_mark_all(bs);
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
@@ -1063,6 +1064,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 
     /* Switch the L1 table */
     qemu_vfree(s->l1_table);
+    qcow2_alloc_summary_mark_all(bs);
 
     s->l1_size = sn->l1_size;
     s->l1_table_offset = sn->l1_table_offset;
@@ -0,0 +1,572 @@
+/*
+ * Allocation summary for the QCOW version 2 format
+ *
+ * The allocation summary is a coarse bitmap over the virtual disk.  A clear
+ * bit means that no L2 entry of the active L1 table maps anything in the
+ * covered range, so lookups there can be answered without loading L2 tables.
+ * The summary is kept in memory while the image is writable and written back
+ * to the image on inactivation, guarded by an autoclear feature bit.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+
+#include "qcow2.h"
+
+static uint64_t alloc_summary_bits(uint64_t disk_size, int granularity_bits)
+{
+    return DIV_ROUND_UP(disk_size, 1ULL << granularity_bits);
+}
+
+static uint64_t alloc_summary_bytes(uint64_t nb_bits)
+{
+    return DIV_ROUND_UP(nb_bits, BITS_PER_BYTE);
+}
+
+static uint64_t alloc_summary_disk_size(BlockDriverState *bs)
+{
+    return (uint64_t)bs->total_sectors * BDRV_SECTOR_SIZE;
+}
+
+/*
+ * Smallest granularity of at least 2^QCOW2_ALLOC_SUMMARY_MIN_CLUSTER_BITS
+ * clusters per bit that keeps the summary within
+ * QCOW2_ALLOC_SUMMARY_MAX_SIZE.
+ */
+static int alloc_summary_granularity(BDRVQcow2State *s, uint64_t disk_size,
+                                     int granularity_bits)
+{
+    granularity_bits = MAX(granularity_bits,
+                           s->cluster_bits +
+                           QCOW2_ALLOC_SUMMARY_MIN_CLUSTER_BITS);
+
+    while (granularity_bits < 63 &&
+           alloc_summary_bytes(alloc_summary_bits(disk_size, granularity_bits))
+           > QCOW2_ALLOC_SUMMARY_MAX_SIZE)
+    {
+        granularity_bits++;
+    }
+
+    return granularity_bits;
+}
+
+/* Halve the resolution of the in-memory summary */
+static void alloc_summary_coarsen(BDRVQcow2State *s)
+{
+    uint64_t nb_bits = DIV_ROUND_UP(s->alloc_summary_nb_bits, 2);
+    unsigned long *bitmap = bitmap_new(nb_bits);
+    uint64_t bit;
+
+    for (bit = find_first_bit(s->alloc_summary, s->alloc_summary_nb_bits);
+         bit < s->alloc_summary_nb_bits;
+         bit = find_next_bit(s->alloc_summary, s->alloc_summary_nb_bits,
+                             bit + 1))
+    {
+        set_bit(bit / 2, bitmap);
+    }
+
+    g_free(s->alloc_summary);
+    s->alloc_summary = bitmap;
+    s->alloc_summary_nb_bits = nb_bits;
+    s->alloc_summary_granularity_bits++;
+}
+
+/*
+ * Fill @bitmap, which covers the virtual disk with the current granularity,
+ * from the L2 tables of the active L1 table.
+ */
+static int GRAPH_RDLOCK
+alloc_summary_build(BlockDriverState *bs, unsigned long *bitmap,
+                    uint64_t nb_bits)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits = s->alloc_summary_granularity_bits;
+    unsigned slice, slice_size2, n_slices;
+    uint64_t *l2_slice;
+    int i, j, ret;
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
+    for (i = 0; i < s->l1_size; i++) {
+        uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+
+        if (!l2_offset) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, l2_offset)) {
+            return -EIO;
+        }
+
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_start = ((uint64_t)i << (s->l2_bits +
+                                                    s->cluster_bits)) +
+                ((uint64_t)slice * s->l2_slice_size << s->cluster_bits);
+
+            if ((slice_start >> granularity_bits) >= nb_bits) {
+                return 0;
+            }
+
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                  l2_offset + slice * slice_size2,
+                                  (void **) &l2_slice);
+            if (ret < 0) {
+                return ret;
+            }
+
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t guest_offset =
+                    slice_start + ((uint64_t)j << s->cluster_bits);
+                uint64_t bit = guest_offset >> granularity_bits;
+
+                if (bit >= nb_bits) {
+                    break;
+                }
+
+                if (get_l2_entry(s, l2_slice, j) ||
+                    get_l2_bitmap(s, l2_slice, j))
+                {
+                    set_bit(bit, bitmap);
+                }
+            }
+
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Create the in-memory summary for the current virtual disk size by scanning
+ * the active L2 tables.  The granularity starts at @granularity_bits and is
+ * raised as needed.
+ */
+static int GRAPH_RDLOCK
+alloc_summary_rebuild(BlockDriverState *bs, int granularity_bits)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t disk_size = alloc_summary_disk_size(bs);
+    unsigned long *bitmap;
+    uint64_t nb_bits;
+    int ret;
+
+    granularity_bits = alloc_summary_granularity(s, disk_size,
+                                                 granularity_bits);
+    nb_bits = alloc_summary_bits(disk_size, granularity_bits);
+
+    bitmap = bitmap_try_new(nb_bits);
+    if (!bitmap) {
+        return -ENOMEM;
+    }
+
+    s->alloc_summary_granularity_bits = granularity_bits;
+    ret = alloc_summary_build(bs, bitmap, nb_bits);
+    if (ret < 0) {
+        g_free(bitmap);
+        return ret;
+    }
+
+    g_free(s->alloc_summary);
+    s->alloc_summary = bitmap;
+    s->alloc_summary_nb_bits = nb_bits;
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+alloc_summary_read(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_bits = alloc_summary_bits(alloc_summary_disk_size(bs),
+                                          s->alloc_summary_granularity_bits);
+    uint64_t bytes = alloc_summary_bytes(nb_bits);
+    unsigned long *buf, *bitmap;
+    int ret;
+
+    if (bytes > s->alloc_summary_size) {
+        return -EINVAL;
+    }
+
+    buf = bitmap_try_new(nb_bits);
+    bitmap = bitmap_try_new(nb_bits);
+    if (!buf || !bitmap) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->alloc_summary_offset, bytes, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    bitmap_from_le(bitmap, buf, nb_bits);
+    g_free(buf);
+
+    s->alloc_summary = bitmap;
+    s->alloc_summary_nb_bits = nb_bits;
+
+    return 0;
+
+fail:
+    g_free(buf);
+    g_free(bitmap);
+    return ret;
+}
+
+/*
+ * Load the allocation summary on open.  A consistent summary is read from the
+ * image; an inconsistent one is rebuilt from the L2 tables if the image is
+ * writable.  Since the image may be modified from now on, the autoclear bit
+ * is dropped, and *need_update_header is set to make the caller write the
+ * header.
+ *
+ * Failing to load the summary is not fatal, the image is used without it.
+ */
+void coroutine_fn GRAPH_RDLOCK
+qcow2_load_alloc_summary(BlockDriverState *bs, int flags,
+                         bool *need_update_header)
+{
+    BDRVQcow2State *s = bs->opaque;
+    bool consistent = s->autoclear_features & QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+    bool writable = bdrv_is_writable(bs);
+    int ret;
+
+    if (!s->alloc_summary_offset) {
+        return;
+    }
+
+    /* qemu-img check must not trust the data it is about to verify */
+    if (!(flags & BDRV_O_CHECK)) {
+        if (consistent) {
+            ret = alloc_summary_read(bs);
+            if (ret < 0) {
+                warn_report("Could not read the allocation summary of '%s': %s",
+                            bdrv_get_device_or_node_name(bs), strerror(-ret));
+            }
+        }
+
+        if (!s->alloc_summary && writable && s->qcow_version >= 3) {
+            ret = alloc_summary_rebuild(bs, s->alloc_summary_granularity_bits);
+            if (ret < 0) {
+                warn_report("Could not rebuild the allocation summary of "
+                            "'%s': %s", bdrv_get_device_or_node_name(bs),
+                            strerror(-ret));
+            }
+        }
+    }
+
+    if (writable && consistent) {
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+        *need_update_header = true;
+    }
+}
+
+/*
+ * Write the in-memory summary to newly allocated clusters and mark it
+ * consistent.  With @release, the in-memory summary is dropped afterwards.
+ *
+ * The clusters of the previous summary are only freed if the summary owns
+ * them.  If the autoclear bit was clear on open, a program that does not
+ * know about the summary may have had them freed and reused, so they are
+ * leaked instead.
+ */
+int qcow2_store_alloc_summary(BlockDriverState *bs, bool release,
+                              Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->alloc_summary_offset;
+    uint64_t old_size = s->alloc_summary_size;
+    uint64_t old_autocl = s->autoclear_features;
+    bool old_owned = s->alloc_summary_owned;
+    uint64_t bytes;
+    int64_t offset = 0;
+    unsigned long *buf;
+    int ret;
+
+    if (!s->alloc_summary) {
+        return 0;
+    }
+
+    if (!bdrv_is_writable(bs)) {
+        /* Loaded from a consistent summary, nothing has changed since */
+        if (release) {
+            g_free(s->alloc_summary);
+            s->alloc_summary = NULL;
+        }
+        return 0;
+    }
+
+    bytes = alloc_summary_bytes(s->alloc_summary_nb_bits);
+    buf = bitmap_try_new(s->alloc_summary_nb_bits);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    bitmap_to_le(buf, s->alloc_summary, s->alloc_summary_nb_bits);
+
+    offset = qcow2_alloc_clusters(bs, bytes);
+    if (offset < 0) {
+        ret = offset;
+        offset = 0;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, bytes, false);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, bytes, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* All L2 updates the summary describes must be on disk before the bit */
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->alloc_summary_offset = offset;
+    s->alloc_summary_size = bytes;
+    s->alloc_summary_owned = true;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* Clusters the summary does not own are leaked rather than freed */
+    if (old_offset && old_owned) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    g_free(buf);
+    if (release) {
+        g_free(s->alloc_summary);
+        s->alloc_summary = NULL;
+    }
+
+    return 0;
+
+fail:
+    g_free(buf);
+    if (offset) {
+        qcow2_free_clusters(bs, offset, bytes, QCOW2_DISCARD_OTHER);
+    }
+
+    s->alloc_summary_offset = old_offset;
+    s->alloc_summary_size = old_size;
+    s->alloc_summary_owned = old_owned;
+    s->autoclear_features = old_autocl;
+
+    error_setg_errno(errp, -ret, "Failed to store the allocation summary");
+    return ret;
+}
+
+/* Drop the autoclear bit before the image becomes writable again */
+int qcow2_reopen_alloc_summary_rw(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_ALLOC_SUMMARY)) {
+        return 0;
+    }
+
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+        error_setg_errno(errp, -ret, "Failed to update the image header");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Start keeping an allocation summary.  It is written to the image the next
+ * time the image is inactivated.
+ */
+int qcow2_enable_alloc_summary(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (s->alloc_summary) {
+        return 0;
+    }
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "The allocation summary requires compatibility level "
+                   "1.1 or above (use compat=1.1 or greater)");
+        return -EINVAL;
+    }
+
+    ret = alloc_summary_rebuild(bs, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to build the allocation summary");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop keeping an allocation summary and remove it from the image.  As in
+ * qcow2_store_alloc_summary(), clusters the summary does not own are leaked.
+ */
+int qcow2_disable_alloc_summary(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->alloc_summary_offset;
+    uint64_t old_size = s->alloc_summary_size;
+    uint64_t old_autocl = s->autoclear_features;
+    bool old_owned = s->alloc_summary_owned;
+    int ret;
+
+    g_free(s->alloc_summary);
+    s->alloc_summary = NULL;
+    s->alloc_summary_nb_bits = 0;
+
+    if (!old_offset) {
+        return 0;
+    }
+
+    s->alloc_summary_offset = 0;
+    s->alloc_summary_size = 0;
+    s->alloc_summary_owned = false;
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->alloc_summary_offset = old_offset;
+        s->alloc_summary_size = old_size;
+        s->alloc_summary_owned = old_owned;
+        s->autoclear_features = old_autocl;
+        error_setg_errno(errp, -ret, "Failed to update the image header");
+        return ret;
+    }
+
+    if (old_owned) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+    return 0;
+}
+
+/* Adjust the summary to a new virtual disk size */
+void qcow2_alloc_summary_resize(BlockDriverState *bs, uint64_t disk_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits;
+    uint64_t nb_bits;
+
+    if (!s->alloc_summary) {
+        return;
+    }
+
+    granularity_bits = s->alloc_summary_granularity_bits;
+    granularity_bits = alloc_summary_granularity(s, disk_size,
+                                                 granularity_bits);
+    while (s->alloc_summary_granularity_bits < granularity_bits) {
+        alloc_summary_coarsen(s);
+    }
+
+    nb_bits = alloc_summary_bits(disk_size, granularity_bits);
+    if (nb_bits > s->alloc_summary_nb_bits) {
+        s->alloc_summary = bitmap_zero_extend(s->alloc_summary,
+                                              s->alloc_summary_nb_bits,
+                                              nb_bits);
+    }
+    s->alloc_summary_nb_bits = nb_bits;
+}
+
+/* Record that [offset, offset + bytes) may now be allocated */
+void qcow2_alloc_summary_mark(BlockDriverState *bs, uint64_t offset,
+                              uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start, end;
+
+    if (!s->alloc_summary || !bytes) {
+        return;
+    }
+
+    start = offset >> s->alloc_summary_granularity_bits;
+    end = MIN(DIV_ROUND_UP(offset + bytes,
+                           1ULL << s->alloc_summary_granularity_bits),
+              s->alloc_summary_nb_bits);
+    if (start < end) {
+        bitmap_set(s->alloc_summary, start, end - start);
+    }
+}
+
+/* The active L1 table is replaced, nothing is known about it any more */
+void qcow2_alloc_summary_mark_all(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->alloc_summary) {
+        bitmap_fill(s->alloc_summary, s->alloc_summary_nb_bits);
+    }
+}
+
+/*
+ * Return the number of bytes starting at @offset, up to @bytes, that are
+ * known to be unallocated in the active L1 table, or 0 if the summary does not
+ * tell anything about @offset.
+ */
+uint64_t qcow2_alloc_summary_unallocated(BlockDriverState *bs, uint64_t offset,
+                                         uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bit, next;
+
+    if (!s->alloc_summary) {
+        return 0;
+    }
+
+    bit = offset >> s->alloc_summary_granularity_bits;
+    if (bit >= s->alloc_summary_nb_bits || test_bit(bit, s->alloc_summary)) {
+        return 0;
+    }
+
+    next = find_next_bit(s->alloc_summary, s->alloc_summary_nb_bits, bit);
+    if (next >= s->alloc_summary_nb_bits) {
+        return bytes;
+    }
+
+    return MIN(bytes, (next << s->alloc_summary_granularity_bits) - offset);
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_alloc_summary_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                    void **refcount_table,
+                                    int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    /* Clusters the summary does not own show up as leaked */
+    if (!s->alloc_summary_offset || !s->alloc_summary_owned) {
+        return 0;
+    }
+
+    return qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                    refcount_table_size,
+                                    s->alloc_summary_offset,
+                                    s->alloc_summary_size);
+}
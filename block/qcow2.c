@@ -73,6 +73,8 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_ALLOC_SUMMARY 0x414c4c43
+#define  QCOW2_EXT_MAGIC_DEDUP_INDEX 0x44454455
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -194,6 +196,112 @@ qcow2_extract_crypto_opts(QemuOpts *opts, const char *fmt, Error **errp)
     return cryptoopts_qdict;
 }
 
+/*
+ * Read and validate the allocation summary extension at @offset.  On success
+ * the summary location is stored in @bs; nothing is changed on failure.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_read_alloc_summary_ext(BlockDriverState *bs, uint64_t offset,
+                             uint32_t len, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2AllocSummaryHeaderExt summary_ext;
+    int ret;
+
+    if (len != sizeof(summary_ext)) {
+        error_setg(errp, "summary_ext: Invalid extension length");
+        return -EINVAL;
+    }
+
+    ret = bdrv_co_pread(bs->file, offset, len, &summary_ext, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "summary_ext: "
+                         "Could not read ext header");
+        return ret;
+    }
+
+    if (!buffer_is_zero(summary_ext.reserved, sizeof(summary_ext.reserved))) {
+        error_setg(errp, "summary_ext: Reserved field is not zero");
+        return -EINVAL;
+    }
+
+    summary_ext.summary_offset = be64_to_cpu(summary_ext.summary_offset);
+    summary_ext.summary_size = be64_to_cpu(summary_ext.summary_size);
+
+    if (summary_ext.summary_offset == 0 ||
+        offset_into_cluster(s, summary_ext.summary_offset)) {
+        error_setg(errp, "summary_ext: Invalid summary offset");
+        return -EINVAL;
+    }
+
+    if (summary_ext.summary_size == 0 ||
+        summary_ext.summary_size > QCOW2_ALLOC_SUMMARY_MAX_SIZE) {
+        error_setg(errp, "summary_ext: Invalid summary size "
+                   "(%" PRIu64 ")", summary_ext.summary_size);
+        return -EINVAL;
+    }
+
+    if (summary_ext.granularity_bits < s->cluster_bits ||
+        summary_ext.granularity_bits > 63) {
+        error_setg(errp, "summary_ext: Invalid granularity (%d bits)",
+                   summary_ext.granularity_bits);
+        return -EINVAL;
+    }
+
+    s->alloc_summary_offset = summary_ext.summary_offset;
+    s->alloc_summary_size = summary_ext.summary_size;
+    s->alloc_summary_granularity_bits = summary_ext.granularity_bits;
+    s->alloc_summary_owned =
+        s->autoclear_features & QCOW2_AUTOCLEAR_ALLOC_SUMMARY;
+
+    return 0;
+}
+
+/*
+ * Read and validate the deduplication index extension at @offset.  On success
+ * the index location is stored in @bs; nothing is changed on failure.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_read_dedup_index_ext(BlockDriverState *bs, uint64_t offset,
+                           uint32_t len, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndexHeaderExt dedup_ext;
+    int ret;
+
+    if (len != sizeof(dedup_ext)) {
+        error_setg(errp, "dedup_ext: Invalid extension length");
+        return -EINVAL;
+    }
+
+    ret = bdrv_co_pread(bs->file, offset, len, &dedup_ext, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "dedup_ext: Could not read ext header");
+        return ret;
+    }
+
+    dedup_ext.index_offset = be64_to_cpu(dedup_ext.index_offset);
+    dedup_ext.nb_entries = be64_to_cpu(dedup_ext.nb_entries);
+
+    if (dedup_ext.index_offset == 0 ||
+        offset_into_cluster(s, dedup_ext.index_offset)) {
+        error_setg(errp, "dedup_ext: Invalid index offset");
+        return -EINVAL;
+    }
+
+    if (dedup_ext.nb_entries == 0 ||
+        dedup_ext.nb_entries > QCOW2_DEDUP_MAX_ENTRIES) {
+        error_setg(errp, "dedup_ext: Invalid number of entries "
+                   "(%" PRIu64 ")", dedup_ext.nb_entries);
+        return -EINVAL;
+    }
+
+    s->dedup_index_offset = dedup_ext.index_offset;
+    s->dedup_index_entries = dedup_ext.nb_entries;
+
+    return 0;
+}
+
 /*
  * read qcow2 extension and fill bs
  * start reading from start_offset
@@ -211,6 +319,7 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     uint64_t offset;
     int ret;
     Qcow2BitmapHeaderExt bitmaps_ext;
+    Error *local_err = NULL;
 
     if (need_update_header != NULL) {
         *need_update_header = false;
@@ -432,6 +541,59 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_ALLOC_SUMMARY:
+            ret = qcow2_read_alloc_summary_ext(bs, offset, ext.len,
+                                               &local_err);
+            if (ret == -EINVAL &&
+                !(s->autoclear_features & QCOW2_AUTOCLEAR_ALLOC_SUMMARY)) {
+                /*
+                 * A program lacking allocation summary support may have
+                 * rewritten the image; the extension is stale anyway and is
+                 * dropped with the next header update.
+                 */
+                warn_reportf_err(local_err,
+                                 "Ignoring the allocation summary: ");
+                local_err = NULL;
+                if (need_update_header != NULL) {
+                    *need_update_header = true;
+                }
+                break;
+            } else if (ret < 0) {
+                error_propagate(errp, local_err);
+                return ret;
+            }
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got allocation summary extension: "
+                   "offset=%" PRIu64 " size=%" PRIu64 "\n",
+                   s->alloc_summary_offset, s->alloc_summary_size);
+#endif
+            break;
+
+        case QCOW2_EXT_MAGIC_DEDUP_INDEX:
+            ret = qcow2_read_dedup_index_ext(bs, offset, ext.len, &local_err);
+            if (ret == -EINVAL &&
+                !(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX)) {
+                /* Without the bit the index is not used anyway */
+                warn_reportf_err(local_err,
+                                 "Ignoring the deduplication index: ");
+                local_err = NULL;
+                if (need_update_header != NULL) {
+                    *need_update_header = true;
+                }
+                break;
+            } else if (ret < 0) {
+                error_propagate(errp, local_err);
+                return ret;
+            }
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got deduplication index extension: "
+                   "offset=%" PRIu64 " entries=%" PRIu64 "\n",
+                   s->dedup_index_offset, s->dedup_index_entries);
+#endif
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -701,6 +863,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_L2_READAHEAD,
+    QCOW2_OPT_BACKING_READAHEAD,
+    QCOW2_OPT_DEDUP,
     NULL
 };
 
@@ -817,6 +982,22 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_L2_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of L2 slices to read ahead for sequential access",
+        },
+        {
+            .name = QCOW2_OPT_BACKING_READAHEAD,
+            .type = QEMU_OPT_SIZE,
+            .help = "Bytes of the backing file to read ahead for sequential "
+                    "access",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share the data clusters of identical written clusters",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -979,6 +1160,9 @@ typedef struct Qcow2ReopenState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    uint64_t l2_readahead;
+    uint64_t backing_readahead;
+    bool dedup;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1079,6 +1263,26 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    /* Readahead for sequential access */
+    r->l2_readahead = qemu_opt_get_number(opts, QCOW2_OPT_L2_READAHEAD, 0);
+    if (r->l2_readahead > QCOW2_MAX_L2_READAHEAD) {
+        error_setg(errp, QCOW2_OPT_L2_READAHEAD " must be at most %d",
+                   QCOW2_MAX_L2_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    /* Slices read ahead must not push out the ones still in use */
+    r->l2_readahead = MIN(r->l2_readahead, l2_cache_size / 2);
+
+    r->backing_readahead = qemu_opt_get_size(opts, QCOW2_OPT_BACKING_READAHEAD,
+                                             0);
+    if (r->backing_readahead > QCOW2_MAX_BACKING_READAHEAD) {
+        error_setg(errp, QCOW2_OPT_BACKING_READAHEAD " must be at most %"
+                   PRIu64, (uint64_t) QCOW2_MAX_BACKING_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1157,6 +1361,29 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->dedup = qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false);
+    if (r->dedup) {
+        const char *conflict = NULL;
+
+        if (s->crypt_method_header != QCOW_CRYPT_NONE) {
+            conflict = "encrypted images";
+        } else if (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE) {
+            conflict = "external data files";
+        } else if (has_subclusters(s)) {
+            conflict = "extended L2 entries";
+        } else if (r->discard_no_unref) {
+            /* Discarding a kept cluster would pass through to its sharers */
+            conflict = "discard-no-unref";
+        }
+
+        if (conflict) {
+            error_setg(errp, QCOW2_OPT_DEDUP " cannot be used with %s",
+                       conflict);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1239,6 +1466,17 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->discard_no_unref = r->discard_no_unref;
 
+    s->l2_readahead = r->l2_readahead;
+    s->l2_ra_seq = 0;
+    s->backing_readahead = r->backing_readahead;
+    s->backing_ra_seq = 0;
+
+    /* qcow2_reopen_prepare() has stored the index if it was in use */
+    s->dedup = r->dedup;
+    if (!s->dedup) {
+        qcow2_free_dedup_index(bs);
+    }
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -1850,6 +2088,9 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
 
         update_header = update_header && !header_updated;
+
+        qcow2_load_alloc_summary(bs, flags, &update_header);
+        qcow2_load_dedup_index(bs);
     }
 
     if (update_header) {
@@ -1888,6 +2129,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->max_threads = MAX(QCOW2_MAX_THREADS, g_get_num_processors());
 
     return ret;
 
@@ -2006,6 +2248,14 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
         goto fail;
     }
 
+    /* The index is dropped from memory or cannot change any more */
+    if (!r->dedup || (state->flags & BDRV_O_RDWR) == 0) {
+        ret = qcow2_store_dedup_index(state->bs, false, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
@@ -2013,6 +2263,11 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        ret = qcow2_store_alloc_summary(state->bs, false, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2076,6 +2331,14 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        if (qcow2_reopen_alloc_summary_rw(state->bs, &local_err) < 0) {
+            error_reportf_err(local_err,
+                              "%s: Failed to invalidate the allocation "
+                              "summary: ", bdrv_get_node_name(state->bs));
+        }
+
+        qcow2_load_dedup_index(state->bs);
     }
 }
 
@@ -2092,6 +2355,17 @@ static void qcow2_reopen_abort(BDRVReopenState *state)
          */
         s->data_file = state->bs->file;
     }
+
+    /* qcow2_reopen_prepare() may have stored the summary for read-only */
+    if (bdrv_is_writable(state->bs)) {
+        Error *local_err = NULL;
+
+        if (qcow2_reopen_alloc_summary_rw(state->bs, &local_err) < 0) {
+            error_reportf_err(local_err,
+                              "%s: Failed to invalidate the allocation "
+                              "summary: ", bdrv_get_node_name(state->bs));
+        }
+    }
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
 }
@@ -2162,6 +2436,7 @@ qcow2_co_block_status(BlockDriverState *bs, unsigned int mode,
     }
 
     bytes = MIN(INT_MAX, count);
+    qcow2_l2_readahead(bs, offset);
     ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
     qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
@@ -2370,6 +2645,123 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
     g_assert_not_reached();
 }
 
+typedef struct Qcow2BackingReadahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+} Qcow2BackingReadahead;
+
+static void coroutine_fn qcow2_co_backing_readahead_entry(void *opaque)
+{
+    Qcow2BackingReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = ra->offset;
+    uint64_t end = ra->offset + ra->bytes;
+    void *buf = NULL;
+    int ret;
+
+    GRAPH_RDLOCK_GUARD();
+
+    if (bs->backing) {
+        buf = qemu_try_blockalign(bs->backing->bs, ra->bytes);
+    }
+
+    trace_qcow2_backing_readahead(bs, ra->offset, ra->bytes);
+
+    /* Only read the parts that this image does not cover itself */
+    while (buf && offset < end) {
+        unsigned int cur_bytes = end - offset;
+        uint64_t host_offset;
+        QCow2SubclusterType type;
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                    &host_offset, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            break;
+        }
+
+        if (type == QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN ||
+            type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) {
+            ret = bdrv_co_pread(bs->backing, offset, cur_bytes, buf, 0);
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        offset += cur_bytes;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    s->backing_ra_in_flight = false;
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_vfree(buf);
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Called with s->lock held when a read of [offset, offset + bytes) is about
+ * to be passed to the backing file.  For sequential reads, keep the next
+ * s->backing_readahead bytes of the backing file read ahead of the guest.
+ * The data is discarded; this only pays off when the backing chain has a
+ * cache of its own, such as the host page cache, the L2 cache of a qcow2
+ * backing file or the cache of a network storage client.  With
+ * cache.direct=on nothing keeps the data, so readahead is skipped then.
+ */
+static void coroutine_fn
+qcow2_backing_readahead(BlockDriverState *bs, uint64_t offset, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t start, end;
+    Qcow2BackingReadahead *ra;
+
+    if (!s->backing_readahead ||
+        (bdrv_get_flags(bs->backing->bs) & BDRV_O_NOCACHE)) {
+        return;
+    }
+
+    /* Allocated clusters in between do not interrupt a sequential stream */
+    if (offset >= s->backing_ra_next &&
+        offset - s->backing_ra_next <= s->backing_readahead) {
+        s->backing_ra_seq++;
+    } else {
+        s->backing_ra_seq = 0;
+        s->backing_ra_end = 0;
+    }
+    s->backing_ra_next = offset + bytes;
+
+    if (s->backing_ra_seq < QCOW2_READAHEAD_TRIGGER ||
+        s->backing_ra_in_flight) {
+        return;
+    }
+
+    /* Refill once half of the window has been consumed */
+    start = MAX(offset + bytes, s->backing_ra_end);
+    end = MIN(offset + bytes + s->backing_readahead, disk_size);
+    if (start >= end ||
+        (end < disk_size && end - start < s->backing_readahead / 2)) {
+        return;
+    }
+
+    ra = g_new(Qcow2BackingReadahead, 1);
+    *ra = (Qcow2BackingReadahead) {
+        .bs = bs,
+        .offset = start,
+        .bytes = end - start,
+    };
+
+    s->backing_ra_end = end;
+    s->backing_ra_in_flight = true;
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(qcow2_co_backing_readahead_entry, ra));
+}
+
 /*
  * This function can count as GRAPH_RDLOCK because qcow2_co_preadv_part() holds
  * the graph lock and keeps it until this coroutine has terminated.
@@ -2406,8 +2798,14 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
         }
 
         qemu_co_mutex_lock(&s->lock);
+        qcow2_l2_readahead(bs, offset);
         ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
                                     &host_offset, &type);
+        if (ret == 0 && bs->backing &&
+            (type == QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN ||
+             type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC)) {
+            qcow2_backing_readahead(bs, offset, cur_bytes);
+        }
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -2652,6 +3050,7 @@ out_unlocked:
     qemu_co_mutex_lock(&s->lock);
 
 out_locked:
+    qcow2_dedup_write_end(bs, host_offset, bytes);
     qcow2_handle_l2meta(bs, &l2meta, false);
     qemu_co_mutex_unlock(&s->lock);
 
@@ -2703,6 +3102,20 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
+        if (s->dedup && !offset_in_cluster && cur_bytes >= s->cluster_size) {
+            ret = qcow2_co_dedup_pwritev(bs, offset, qiov, qiov_offset,
+                                         &cur_bytes);
+            if (ret < 0) {
+                goto fail_nometa;
+            } else if (ret > 0) {
+                /* Mapped to an existing cluster, nothing to write */
+                bytes -= cur_bytes;
+                offset += cur_bytes;
+                qiov_offset += cur_bytes;
+                continue;
+            }
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
@@ -2717,6 +3130,9 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto out_locked;
         }
 
+        /* Ended by qcow2_co_pwritev_task() */
+        qcow2_dedup_write_begin(bs, host_offset, cur_bytes);
+
         qemu_co_mutex_unlock(&s->lock);
 
         if (!aio && cur_bytes != bytes) {
@@ -2772,6 +3188,22 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    ret = qcow2_store_alloc_summary(bs, true, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_reportf_err(local_err, "Lost the allocation summary during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
+    ret = qcow2_store_dedup_index(bs, true, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_reportf_err(local_err, "Lost the deduplication index during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2820,6 +3252,11 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
+    g_free(s->alloc_summary);
+    s->alloc_summary = NULL;
+
+    qcow2_free_dedup_index(bs);
+
     if (close_data_file && has_data_file(bs)) {
         GLOBAL_STATE_CODE();
         bdrv_graph_rdunlock_main_loop();
@@ -3130,6 +3567,38 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Allocation summary extension */
+    if (s->alloc_summary_offset) {
+        Qcow2AllocSummaryHeaderExt summary_header = {
+            .summary_offset = cpu_to_be64(s->alloc_summary_offset),
+            .summary_size = cpu_to_be64(s->alloc_summary_size),
+            .granularity_bits = s->alloc_summary_granularity_bits,
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_ALLOC_SUMMARY,
+                             &summary_header, sizeof(summary_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Deduplication index extension */
+    if (s->dedup_index_offset) {
+        Qcow2DedupIndexHeaderExt dedup_header = {
+            .index_offset = cpu_to_be64(s->dedup_index_offset),
+            .nb_entries = cpu_to_be64(s->dedup_index_entries),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP_INDEX,
+                             &dedup_header, sizeof(dedup_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -3611,6 +4080,14 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (qcow2_opts->allocation_summary && version < 3) {
+        error_setg(errp, "The allocation summary is only supported with "
+                   "compatibility level 1.1 and above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+
     if (!qcow2_opts->has_refcount_bits) {
         qcow2_opts->refcount_bits = 16;
     }
@@ -3833,6 +4310,17 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    /* Track allocations from the start; the summary is stored on close */
+    if (qcow2_opts->allocation_summary) {
+        bdrv_graph_co_rdlock();
+        ret = qcow2_enable_alloc_summary(blk_bs(blk), errp);
+        bdrv_graph_co_rdunlock();
+
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Want a backing file? There you go. */
     if (qcow2_opts->backing_file) {
         const char *backing_format = NULL;
@@ -3949,6 +4437,7 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
         { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_ALLOC_SUMMARY,      "allocation-summary" },
         { NULL, NULL },
     };
 
@@ -4269,10 +4758,12 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
             goto fail;
         }
 
+        qcow2_dedup_write_begin(bs, host_offset, cur_bytes);
         qemu_co_mutex_unlock(&s->lock);
         ret = bdrv_co_copy_range_to(src, src_offset, s->data_file, host_offset,
                                     cur_bytes, read_flags, write_flags);
         qemu_co_mutex_lock(&s->lock);
+        qcow2_dedup_write_end(bs, host_offset, cur_bytes);
         if (ret < 0) {
             goto fail;
         }
@@ -4414,6 +4905,9 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
             goto fail;
         }
 
+        /* Preallocation below must already be recorded in the summary */
+        qcow2_alloc_summary_resize(bs, offset);
+
         if (data_file_is_raw(bs) && prealloc == PREALLOC_MODE_OFF) {
             /*
              * When creating a qcow2 image with data-file-raw, we enforce
@@ -4649,6 +5143,7 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
         }
     }
 
+    qcow2_alloc_summary_resize(bs, offset);
     bs->total_sectors = offset / BDRV_SECTOR_SIZE;
 
     /* write updated header.size */
@@ -4739,20 +5234,183 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2CompressedCluster {
+    uint64_t offset;
+    uint64_t bytes;
+    size_t qiov_offset;
+    uint8_t *out_buf;
+    ssize_t out_len;     /* -ENOMEM if the cluster does not compress */
+    uint64_t host_offset;
+    bool linked;         /* L2 entry points to host_offset */
+    bool written;        /* compressed data is on disk */
+} Qcow2CompressedCluster;
+
+typedef struct Qcow2CompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    Qcow2CompressedCluster *cluster;
+} Qcow2CompressTask;
+
+static int coroutine_fn qcow2_co_compress_task_entry(AioTask *task)
+{
+    Qcow2CompressTask *t = container_of(task, Qcow2CompressTask, task);
+    Qcow2CompressedCluster *cl = t->cluster;
+    BDRVQcow2State *s = t->bs->opaque;
+    uint8_t *buf;
+
+    buf = qemu_blockalign(t->bs, s->cluster_size);
+    if (cl->bytes < s->cluster_size) {
+        /* Zero-pad last write if image size is not cluster aligned */
+        memset(buf + cl->bytes, 0, s->cluster_size - cl->bytes);
+    }
+    qemu_iovec_to_buf(t->qiov, cl->qiov_offset, buf, cl->bytes);
+
+    cl->out_buf = g_malloc(s->cluster_size);
+    cl->out_len = qcow2_co_compress(t->bs, cl->out_buf, s->cluster_size - 1,
+                                    buf, s->cluster_size);
+    qemu_vfree(buf);
+
+    return cl->out_len < 0 && cl->out_len != -ENOMEM ? -EINVAL : 0;
+}
+
 /*
- * This function can count as GRAPH_RDLOCK because
- * qcow2_co_pwritev_compressed_part() holds the graph lock and keeps it until
- * this coroutine has terminated.
+ * qcow2_co_pwritev_compressed_batch:
+ *
+ * Write up to QCOW2_COMPRESS_BATCH clusters.  All clusters are compressed in
+ * parallel first, then host space for all of them is allocated in a single
+ * critical section.  Because consecutive compressed allocations are packed
+ * back to back, the compressed data can then usually be written with one
+ * vectored write rather than one write per cluster.
+ *
+ * The L2 entries are linked before the data is written.  On failure, every
+ * entry that was linked but whose data did not make it to disk is discarded
+ * again, so that no entry is left pointing at unwritten space.
  */
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_pwritev_compressed_task_entry(AioTask *task)
+qcow2_co_pwritev_compressed_batch(BlockDriverState *bs,
+                                  uint64_t offset, uint64_t bytes,
+                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
-    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
+    BDRVQcow2State *s = bs->opaque;
+    int nb_clusters = DIV_ROUND_UP(bytes, s->cluster_size);
+    g_autofree Qcow2CompressedCluster *cl = NULL;
+    QEMUIOVector write_qiov;
+    AioTaskPool *aio;
+    int i, j, k;
+    int ret;
+
+    assert(nb_clusters <= QCOW2_COMPRESS_BATCH);
+
+    cl = g_new0(Qcow2CompressedCluster, nb_clusters);
+    for (i = 0; i < nb_clusters; i++) {
+        cl[i].offset = offset + (uint64_t)i * s->cluster_size;
+        cl[i].bytes = MIN(bytes - (uint64_t)i * s->cluster_size,
+                          s->cluster_size);
+        cl[i].qiov_offset = qiov_offset + (size_t)i * s->cluster_size;
+    }
+
+    /* Compress */
+    aio = aio_task_pool_new(s->max_threads);
+    for (i = 0; i < nb_clusters && aio_task_pool_status(aio) == 0; i++) {
+        Qcow2CompressTask *task = g_new(Qcow2CompressTask, 1);
+
+        *task = (Qcow2CompressTask) {
+            .task.func = qcow2_co_compress_task_entry,
+            .bs = bs,
+            .qiov = qiov,
+            .cluster = &cl[i],
+        };
+        aio_task_pool_start_task(aio, &task->task);
+    }
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    g_free(aio);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Allocate */
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        if (cl[i].out_len < 0) {
+            continue;
+        }
+        ret = qcow2_alloc_compressed_cluster_offset(bs, cl[i].offset,
+                                                    cl[i].out_len,
+                                                    &cl[i].host_offset);
+        if (ret < 0) {
+            break;
+        }
+        cl[i].linked = true;
+        ret = qcow2_pre_write_overlap_check(bs, 0, cl[i].host_offset,
+                                            cl[i].out_len, true);
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Write, merging runs that were allocated back to back */
+    qemu_iovec_init(&write_qiov, nb_clusters);
+    for (i = 0; i < nb_clusters; i = j) {
+        uint64_t run_bytes;
+
+        if (cl[i].out_len < 0) {
+            /* could not compress: write normal cluster */
+            ret = qcow2_co_pwritev_part(bs, cl[i].offset, cl[i].bytes, qiov,
+                                        cl[i].qiov_offset, 0);
+            if (ret < 0) {
+                break;
+            }
+            j = i + 1;
+            continue;
+        }
 
-    assert(!t->subcluster_type && !t->l2meta);
+        qemu_iovec_reset(&write_qiov);
+        run_bytes = 0;
+        for (j = i; j < nb_clusters && cl[j].out_len >= 0 &&
+             cl[j].host_offset == cl[i].host_offset + run_bytes; j++)
+        {
+            qemu_iovec_add(&write_qiov, cl[j].out_buf, cl[j].out_len);
+            run_bytes += cl[j].out_len;
+        }
 
-    return qcow2_co_pwritev_compressed_task(t->bs, t->offset, t->bytes, t->qiov,
-                                            t->qiov_offset);
+        BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwritev(s->data_file, cl[i].host_offset, run_bytes,
+                              &write_qiov, 0);
+        if (ret < 0) {
+            break;
+        }
+        for (k = i; k < j; k++) {
+            cl[k].written = true;
+        }
+    }
+    qemu_iovec_destroy(&write_qiov);
+
+out:
+    if (ret < 0) {
+        /*
+         * The guest-visible content of a failed write is undefined anyway,
+         * what matters is that no L2 entry points at unwritten space.
+         */
+        qemu_co_mutex_lock(&s->lock);
+        for (i = 0; i < nb_clusters; i++) {
+            if (cl[i].linked && !cl[i].written) {
+                qcow2_cluster_discard(bs, cl[i].offset, cl[i].bytes,
+                                      QCOW2_DISCARD_NEVER, true);
+            }
+        }
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    for (i = 0; i < nb_clusters; i++) {
+        g_free(cl[i].out_buf);
+    }
+    return ret < 0 ? ret : 0;
 }
 
 /*
@@ -4765,7 +5423,6 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    AioTaskPool *aio = NULL;
     int ret = 0;
 
     if (has_data_file(bs)) {
@@ -4794,15 +5451,18 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    while (bytes && aio_task_pool_status(aio) == 0) {
-        uint64_t chunk_size = MIN(bytes, s->cluster_size);
+    if (bytes <= s->cluster_size) {
+        return qcow2_co_pwritev_compressed_task(bs, offset, bytes, qiov,
+                                                qiov_offset);
+    }
 
-        if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
-        }
+    while (bytes) {
+        uint64_t chunk_size = MIN(bytes,
+                                  (uint64_t)QCOW2_COMPRESS_BATCH *
+                                  s->cluster_size);
 
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+        ret = qcow2_co_pwritev_compressed_batch(bs, offset, chunk_size, qiov,
+                                                qiov_offset);
         if (ret < 0) {
             break;
         }
@@ -4811,14 +5471,6 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         bytes -= chunk_size;
     }
 
-    if (aio) {
-        aio_task_pool_wait_all(aio);
-        if (ret == 0) {
-            ret = aio_task_pool_status(aio);
-        }
-        g_free(aio);
-    }
-
     return ret;
 }
 
@@ -5026,6 +5678,7 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
+        !s->alloc_summary_offset && !s->dedup_index_offset &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
         !has_data_file(bs)) {
@@ -5248,6 +5901,7 @@ qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->subcluster_size = s->subcluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     bdi->is_dirty = s->incompatible_features & QCOW2_INCOMPAT_DIRTY;
+    bdi->multi_cluster_compressed_writes = true;
     return 0;
 }
 
@@ -5299,6 +5953,10 @@ qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
             .compression_type   = s->compression_type,
+            .has_allocation_summary = s->alloc_summary ||
+                                      s->alloc_summary_offset,
+            .allocation_summary = s->alloc_summary ||
+                                  s->alloc_summary_offset,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5512,6 +6170,18 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
+    /* the allocation summary only exists for v3, so drop it */
+    ret = qcow2_disable_alloc_summary(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* so does the stored deduplication index */
+    ret = qcow2_remove_dedup_index(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
 
@@ -5703,6 +6373,7 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     QemuOptDesc *desc = opts->list->desc;
     Qcow2AmendHelperCBInfo helper_cb_info;
     bool encryption_update = false;
+    bool alloc_summary = s->alloc_summary || s->alloc_summary_offset;
 
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
@@ -5770,6 +6441,9 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_ALLOC_SUMMARY)) {
+            alloc_summary = qemu_opt_get_bool(opts, BLOCK_OPT_ALLOC_SUMMARY,
+                                              alloc_summary);
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5906,6 +6580,23 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
     }
 
+    if (alloc_summary != (s->alloc_summary || s->alloc_summary_offset)) {
+        if (alloc_summary) {
+            if (new_version < 3) {
+                error_setg(errp, "The allocation summary is only supported "
+                           "with compatibility level 1.1 and above (use "
+                           "compat=1.1 or greater)");
+                return -EINVAL;
+            }
+            ret = qcow2_enable_alloc_summary(bs, errp);
+        } else {
+            ret = qcow2_disable_alloc_summary(bs, errp);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (new_size) {
         BlockBackend *blk = blk_new_with_bs(bs, BLK_PERM_RESIZE, BLK_PERM_ALL,
                                             errp);
@@ -6063,6 +6754,11 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
         .help = "Postpone refcount updates",                        \
         .def_value_str = "off"                                      \
     },                                                              \
+    {                                                               \
+        .name = BLOCK_OPT_ALLOC_SUMMARY,                            \
+        .type = QEMU_OPT_BOOL,                                      \
+        .help = "Keep a summary of allocated clusters in the image" \
+    },                                                              \
     {                                                               \
         .name = BLOCK_OPT_REFCOUNT_BITS,                            \
         .type = QEMU_OPT_NUMBER,                                    \
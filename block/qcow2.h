@@ -68,6 +68,16 @@
 #define QCOW2_MAX_BITMAPS 65535
 #define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
 
+/*
+ * Allocation summary constraints: one bit covers at least 16 clusters, and
+ * the granularity is coarsened until the summary fits into 4 MB
+ */
+#define QCOW2_ALLOC_SUMMARY_MIN_CLUSTER_BITS 4
+#define QCOW2_ALLOC_SUMMARY_MAX_SIZE (4 * MiB)
+
+/* Maximum number of clusters remembered for deduplication */
+#define QCOW2_DEDUP_MAX_ENTRIES (1024 * 1024)
+
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
@@ -128,6 +138,13 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of consecutive L2 slices that make an access pattern sequential */
+#define QCOW2_READAHEAD_TRIGGER 2
+
+/* Upper limits for the l2-readahead and backing-readahead options */
+#define QCOW2_MAX_L2_READAHEAD 64 /* L2 slices */
+#define QCOW2_MAX_BACKING_READAHEAD (64 * MiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +167,9 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_L2_READAHEAD "l2-readahead"
+#define QCOW2_OPT_BACKING_READAHEAD "backing-readahead"
+#define QCOW2_OPT_DEDUP "dedup"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -281,11 +301,17 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_ALLOC_SUMMARY_BITNR = 2,
+    QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR   = 3,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_ALLOC_SUMMARY       = 1 << QCOW2_AUTOCLEAR_ALLOC_SUMMARY_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP_INDEX         = 1 << QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_ALLOC_SUMMARY
+                                        | QCOW2_AUTOCLEAR_DEDUP_INDEX,
 };
 
 enum qcow2_discard_type {
@@ -322,8 +348,27 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2AllocSummaryHeaderExt {
+    uint64_t summary_offset;
+    uint64_t summary_size;
+    uint8_t granularity_bits;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2AllocSummaryHeaderExt;
+
+typedef struct Qcow2DedupIndexHeaderExt {
+    uint64_t index_offset;
+    uint64_t nb_entries;
+} QEMU_PACKED Qcow2DedupIndexHeaderExt;
+
+/*
+ * Minimum number of concurrent thread pool jobs per image, raised to the
+ * number of host CPUs at open time
+ */
 #define QCOW2_MAX_THREADS 4
 
+/* Clusters compressed in parallel and written together by one request */
+#define QCOW2_COMPRESS_BATCH 64
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -348,6 +393,20 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* L2 table readahead for sequential scans, see qcow2_l2_readahead() */
+    unsigned l2_readahead; /* L2 slices to read ahead, 0 disables */
+    unsigned l2_ra_seq;
+    unsigned l2_ra_in_flight;
+    uint64_t l2_ra_last_slice;
+    uint64_t l2_ra_next_slice;
+
+    /* Backing file readahead, see qcow2_backing_readahead() */
+    uint64_t backing_readahead; /* bytes, 0 disables */
+    uint64_t backing_ra_next; /* offset following the last backing read */
+    uint64_t backing_ra_end; /* end of the range already read ahead */
+    unsigned backing_ra_seq;
+    bool backing_ra_in_flight;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -374,6 +433,34 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /*
+     * Allocation summary, see qcow2-summary.c.  A clear bit in alloc_summary
+     * means that the covered guest range is unallocated in the active L1.
+     */
+    uint64_t alloc_summary_offset;
+    uint64_t alloc_summary_size;
+    /*
+     * The clusters at alloc_summary_offset belong to the summary: the
+     * autoclear bit was set when the image was opened, or the summary was
+     * stored since.  Otherwise they may have been freed and reused by a
+     * program that does not know about the summary.
+     */
+    bool alloc_summary_owned;
+    int alloc_summary_granularity_bits;
+    unsigned long *alloc_summary;
+    uint64_t alloc_summary_nb_bits;
+
+    /*
+     * Deduplication of written clusters, see qcow2-dedup.c.  dedup_index maps
+     * content hashes to guest offsets whose data clusters may be shared.
+     */
+    bool dedup;
+    GHashTable *dedup_index;
+    bool dedup_index_dirty;
+    uint64_t dedup_index_offset;
+    uint64_t dedup_index_entries;
+    QLIST_HEAD(, Qcow2DedupWrite) dedup_writes;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -410,6 +497,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
 
     BdrvChild *data_file;
 
@@ -931,6 +1019,7 @@ int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
+void coroutine_fn qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset);
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
@@ -957,6 +1046,12 @@ qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
 int coroutine_fn GRAPH_RDLOCK
 qcow2_subcluster_zeroize(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                          int flags);
+int GRAPH_RDLOCK
+qcow2_dedup_update_copied(BlockDriverState *bs, uint64_t offset,
+                          uint64_t host_offset);
+int GRAPH_RDLOCK
+qcow2_dedup_link_cluster(BlockDriverState *bs, uint64_t offset,
+                         uint64_t host_offset);
 
 int GRAPH_RDLOCK
 qcow2_expand_zero_clusters(BlockDriverState *bs,
@@ -1021,6 +1116,52 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+uint64_t qcow2_cache_generation(Qcow2Cache *c);
+void qcow2_cache_insert(Qcow2Cache *c, uint64_t offset, const void *table,
+                        uint64_t gen);
+
+/* qcow2-summary.c functions */
+void coroutine_fn GRAPH_RDLOCK
+qcow2_load_alloc_summary(BlockDriverState *bs, int flags,
+                         bool *need_update_header);
+int GRAPH_RDLOCK
+qcow2_store_alloc_summary(BlockDriverState *bs, bool release, Error **errp);
+int GRAPH_RDLOCK
+qcow2_reopen_alloc_summary_rw(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK
+qcow2_enable_alloc_summary(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK
+qcow2_disable_alloc_summary(BlockDriverState *bs, Error **errp);
+void qcow2_alloc_summary_resize(BlockDriverState *bs, uint64_t disk_size);
+void qcow2_alloc_summary_mark(BlockDriverState *bs, uint64_t offset,
+                              uint64_t bytes);
+void qcow2_alloc_summary_mark_all(BlockDriverState *bs);
+uint64_t qcow2_alloc_summary_unallocated(BlockDriverState *bs, uint64_t offset,
+                                         uint64_t bytes);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_alloc_summary_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                    void **refcount_table,
+                                    int64_t *refcount_table_size);
+
+/* qcow2-dedup.c functions */
+void GRAPH_RDLOCK qcow2_load_dedup_index(BlockDriverState *bs);
+int GRAPH_RDLOCK
+qcow2_store_dedup_index(BlockDriverState *bs, bool release, Error **errp);
+int GRAPH_RDLOCK
+qcow2_remove_dedup_index(BlockDriverState *bs, Error **errp);
+void qcow2_free_dedup_index(BlockDriverState *bs);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_dedup_pwritev(BlockDriverState *bs, uint64_t offset,
+                       QEMUIOVector *qiov, size_t qiov_offset,
+                       unsigned int *cur_bytes);
+void qcow2_dedup_write_begin(BlockDriverState *bs, uint64_t host_offset,
+                             uint64_t bytes);
+void qcow2_dedup_write_end(BlockDriverState *bs, uint64_t host_offset,
+                           uint64_t bytes);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_index_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size);
 
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
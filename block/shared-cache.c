@@ -0,0 +1,691 @@
+/*
+ * Host-wide read cache for read-only nodes
+ *
+ * Caches clusters of a read-only node (typically the protocol node of a base
+ * image shared by many guests) in a memory segment that all processes opening
+ * the same image map, e.g. a file on tmpfs or hugetlbfs.  The first process
+ * that reads a cluster stores it there and all others are served from memory,
+ * independently of their own cache mode.
+ *
+ * The segment starts with a header, followed by one descriptor per slot and
+ * the slots themselves:
+ *
+ *   +--------+---------------------------+--------------------------------+
+ *   | header | slot descriptors (16 B)   | slot 0 | slot 1 | ... | slot n |
+ *   +--------+---------------------------+--------------------------------+
+ *
+ * The slots form a set-associative cache.  There is no lock: each descriptor
+ * has a sequence counter that is odd while the slot is being written, and a
+ * reader only uses the data it copied from a slot if the counter was even and
+ * did not change in the meantime.  A process that dies while writing a slot
+ * leaves it unusable until the segment is recreated.
+ *
+ * Cached data is never invalidated.  Instead, the header records the device,
+ * inode and modification time of the cached file, and attaching to a segment
+ * fails once the file has changed, until the segment is removed.  Nodes that
+ * are not host files are only identified by their name and size, so they must
+ * not change while the segment exists.  The segment is native-endian and only
+ * meant to be shared between processes on one host.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC          0x51454d5553484d43ULL /* "QEMUSHMC" */
+#define SHARED_CACHE_VERSION        2
+#define SHARED_CACHE_HEADER_SIZE    4096
+
+#define SHARED_CACHE_DEFAULT_SIZE           (256 * MiB)
+#define SHARED_CACHE_DEFAULT_CLUSTER_SIZE   (64 * KiB)
+#define SHARED_CACHE_MIN_CLUSTER_SIZE       (4 * KiB)
+#define SHARED_CACHE_MAX_CLUSTER_SIZE       (2 * MiB)
+
+/* Number of slots a cluster can be cached in */
+#define SHARED_CACHE_WAYS           4
+
+/* Maximum number of clusters filled from the cached node in one request */
+#define SHARED_CACHE_MAX_FILL_CLUSTERS  16
+
+/*
+ * Creating or checking the segment only takes a moment, so waiting for
+ * another process doing it is done by polling the lock
+ */
+#define SHARED_CACHE_LOCK_TIMEOUT_MS    10000
+
+/* Identifies the cached file; all zero if it is not a host file */
+typedef struct SharedCacheIdentity {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} SharedCacheIdentity;
+
+typedef struct SharedCacheHeader {
+    uint64_t magic;             /* set last when creating the segment */
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t desc_offset;
+    uint64_t data_offset;
+    uint64_t child_size;
+    SharedCacheIdentity child_id;
+    char child_name[1024];
+} SharedCacheHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheHeader) > SHARED_CACHE_HEADER_SIZE);
+
+typedef struct SharedCacheDesc {
+    uint32_t seq;               /* 0: never filled; odd: being written */
+    uint32_t reserved;
+    int64_t cluster;            /* only valid if seq is even and nonzero */
+} SharedCacheDesc;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheDesc) != 16);
+
+typedef struct BDRVSharedCacheState {
+    char *path;
+    uint32_t cluster_size;
+    int cluster_bits;
+    int64_t child_size;
+    SharedCacheIdentity child_id;
+
+    uint8_t *map;
+    size_t map_size;
+    uint64_t nb_sets;
+    SharedCacheDesc *desc;
+    uint8_t *data;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH "path"
+#define SHARED_CACHE_OPT_SIZE "size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "file holding the shared cache (e.g. on tmpfs)",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the shared cache if it is created, "
+                    "default 256M",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "caching granularity if the cache is created, "
+                    "default 64k",
+        },
+        { /* end of list */ }
+    },
+};
+
+static const char *const shared_cache_strong_runtime_opts[] = {
+    SHARED_CACHE_OPT_PATH,
+
+    NULL
+};
+
+static inline SharedCacheDesc *
+shared_cache_set(BDRVSharedCacheState *s, int64_t cluster)
+{
+    return &s->desc[(qemu_xxhash2(cluster) % s->nb_sets) * SHARED_CACHE_WAYS];
+}
+
+static inline uint8_t *
+shared_cache_slot_data(BDRVSharedCacheState *s, SharedCacheDesc *d)
+{
+    return s->data + ((size_t)(d - s->desc) << s->cluster_bits);
+}
+
+/*
+ * Copy @bytes at @offset_in_cluster of @cluster into @qiov if the cluster is
+ * cached, or merely check whether it is cached if @qiov is NULL.  Returns
+ * false if the cluster is not cached or was replaced while it was copied; in
+ * the latter case, @qiov may have been partially written.
+ */
+static bool shared_cache_read(BDRVSharedCacheState *s, int64_t cluster,
+                              size_t offset_in_cluster, size_t bytes,
+                              QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheDesc *set = shared_cache_set(s, cluster);
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheDesc *d = &set[i];
+        uint32_t seq = qatomic_load_acquire(&d->seq);
+
+        if (!seq || (seq & 1) || d->cluster != cluster) {
+            continue;
+        }
+
+        if (qiov) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                shared_cache_slot_data(s, d) +
+                                offset_in_cluster, bytes);
+        }
+
+        /* Pairs with the cmpxchg in shared_cache_insert() */
+        smp_rmb();
+        return qatomic_read(&d->seq) == seq;
+    }
+
+    return false;
+}
+
+/* Store @buf as the contents of @cluster, unless another process is faster */
+static void shared_cache_insert(BDRVSharedCacheState *s, int64_t cluster,
+                                const uint8_t *buf)
+{
+    SharedCacheDesc *set = shared_cache_set(s, cluster);
+    SharedCacheDesc *d = NULL;
+    uint32_t seq, next;
+    int i;
+
+    if (shared_cache_read(s, cluster, 0, 0, NULL, 0)) {
+        return;
+    }
+
+    /* Prefer slots that were never used, otherwise replace a random one */
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        if (!qatomic_read(&set[i].seq)) {
+            d = &set[i];
+            break;
+        }
+    }
+    if (!d) {
+        d = &set[g_random_int_range(0, SHARED_CACHE_WAYS)];
+    }
+
+    seq = qatomic_read(&d->seq);
+    if ((seq & 1) || qatomic_cmpxchg(&d->seq, seq, seq + 1) != seq) {
+        /* Someone else is writing to this slot */
+        return;
+    }
+
+    d->cluster = cluster;
+    memcpy(shared_cache_slot_data(s, d), buf, s->cluster_size);
+
+    /* Skip zero on wraparound, it stands for a slot that was never used */
+    next = seq + 2 ?: 2;
+    qatomic_store_release(&d->seq, next);
+}
+
+/*
+ * Read clusters that are not cached from the cached node, starting at the
+ * cluster containing @offset, and add them to the shared cache.  *@pnum is set
+ * to the number of bytes of the request that were handled.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, size_t qiov_offset, int64_t *pnum)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    int64_t first = offset >> s->cluster_bits;
+    int64_t last = (offset + bytes - 1) >> s->cluster_bits;
+    int64_t start = first << s->cluster_bits;
+    int64_t len;
+    uint8_t *buf;
+    int nb = 1, i, ret;
+
+    while (nb < SHARED_CACHE_MAX_FILL_CLUSTERS && first + nb <= last &&
+           !shared_cache_read(s, first + nb, 0, 0, NULL, 0))
+    {
+        nb++;
+    }
+
+    *pnum = MIN(bytes, start + ((int64_t)nb << s->cluster_bits) - offset);
+    len = MIN((int64_t)nb << s->cluster_bits, s->child_size - start);
+
+    buf = qemu_try_blockalign(bs->file->bs, (size_t)nb << s->cluster_bits);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, len, buf, 0);
+    trace_shared_cache_fill(bs, start, len, ret);
+    if (ret < 0) {
+        goto out;
+    }
+    memset(buf + len, 0, ((size_t)nb << s->cluster_bits) - len);
+
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), *pnum);
+    for (i = 0; i < nb; i++) {
+        shared_cache_insert(s, first + i, buf + ((size_t)i << s->cluster_bits));
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    while (bytes) {
+        int64_t in_cluster = offset & (s->cluster_size - 1);
+        int64_t n = MIN(bytes, s->cluster_size - in_cluster);
+        int ret;
+
+        if (!shared_cache_read(s, offset >> s->cluster_bits, in_cluster, n,
+                               qiov, qiov_offset))
+        {
+            ret = shared_cache_co_fill(bs, offset, bytes, qiov, qiov_offset,
+                                       &n);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shared_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void shared_cache_setup(BDRVSharedCacheState *s)
+{
+    SharedCacheHeader *h = (SharedCacheHeader *)s->map;
+
+    s->cluster_size = h->cluster_size;
+    s->cluster_bits = ctz32(h->cluster_size);
+    s->nb_sets = h->nb_slots / SHARED_CACHE_WAYS;
+    s->desc = (SharedCacheDesc *)(s->map + h->desc_offset);
+    s->data = s->map + h->data_offset;
+}
+
+/* Lay out a new segment of @size bytes; the caller holds the lock */
+static int shared_cache_create(BlockDriverState *bs, int fd, uint64_t size,
+                               uint32_t cluster_size, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    SharedCacheHeader *h;
+    uint64_t nb_slots, data_offset;
+    int ret;
+
+    nb_slots = (size - MIN(size, SHARED_CACHE_HEADER_SIZE)) /
+               (cluster_size + sizeof(SharedCacheDesc));
+    nb_slots = QEMU_ALIGN_DOWN(nb_slots, SHARED_CACHE_WAYS);
+    for (;;) {
+        data_offset = ROUND_UP(SHARED_CACHE_HEADER_SIZE +
+                               nb_slots * sizeof(SharedCacheDesc),
+                               cluster_size);
+        if (!nb_slots || data_offset + nb_slots * cluster_size <= size) {
+            break;
+        }
+        nb_slots -= SHARED_CACHE_WAYS;
+    }
+    if (!nb_slots) {
+        error_setg(errp, "size is too small for cluster-size %" PRIu32,
+                   cluster_size);
+        return -EINVAL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not resize '%s'", s->path);
+        return ret;
+    }
+
+    s->map_size = size;
+    s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->map == MAP_FAILED) {
+        ret = -errno;
+        s->map = NULL;
+        error_setg_errno(errp, -ret, "Could not map '%s'", s->path);
+        return ret;
+    }
+
+    /* Start with a clean slate if a previous creator died half-way */
+    memset(s->map, 0, data_offset);
+
+    h = (SharedCacheHeader *)s->map;
+    h->version = SHARED_CACHE_VERSION;
+    h->cluster_size = cluster_size;
+    h->nb_slots = nb_slots;
+    h->desc_offset = SHARED_CACHE_HEADER_SIZE;
+    h->data_offset = data_offset;
+    h->child_size = s->child_size;
+    h->child_id = s->child_id;
+    pstrcpy(h->child_name, sizeof(h->child_name), bs->file->bs->filename);
+    /* The header must be complete before the magic marks it valid */
+    smp_wmb();
+    h->magic = SHARED_CACHE_MAGIC;
+
+    shared_cache_setup(s);
+    trace_shared_cache_create(bs, s->path, nb_slots, cluster_size);
+    return 0;
+}
+
+/* Map an existing segment of @size bytes; the caller holds the lock */
+static int shared_cache_attach(BlockDriverState *bs, int fd, uint64_t size,
+                               Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    SharedCacheHeader *h;
+    int ret;
+
+    s->map_size = size;
+    s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->map == MAP_FAILED) {
+        ret = -errno;
+        s->map = NULL;
+        error_setg_errno(errp, -ret, "Could not map '%s'", s->path);
+        return ret;
+    }
+
+    h = (SharedCacheHeader *)s->map;
+    if (h->version != SHARED_CACHE_VERSION ||
+        !is_power_of_2(h->cluster_size) ||
+        h->cluster_size < SHARED_CACHE_MIN_CLUSTER_SIZE ||
+        h->cluster_size > SHARED_CACHE_MAX_CLUSTER_SIZE ||
+        !h->nb_slots || h->nb_slots % SHARED_CACHE_WAYS ||
+        h->desc_offset != SHARED_CACHE_HEADER_SIZE ||
+        h->data_offset < h->desc_offset +
+                         h->nb_slots * sizeof(SharedCacheDesc) ||
+        h->data_offset > size ||
+        h->nb_slots > (size - h->data_offset) / h->cluster_size)
+    {
+        error_setg(errp, "'%s' is not a valid shared cache", s->path);
+        return -EINVAL;
+    }
+
+    if (h->child_size != s->child_size ||
+        strncmp(h->child_name, bs->file->bs->filename,
+                sizeof(h->child_name)))
+    {
+        error_setg(errp, "Shared cache '%s' was created for another image",
+                   s->path);
+        error_append_hint(errp, "It is used for '%.*s' (%" PRIu64 " bytes).\n",
+                          (int)sizeof(h->child_name), h->child_name,
+                          h->child_size);
+        return -EINVAL;
+    }
+
+    if (memcmp(&h->child_id, &s->child_id, sizeof(s->child_id))) {
+        error_setg(errp, "Shared cache '%s' is stale", s->path);
+        error_append_hint(errp, "'%s' changed after the cache was created. "
+                          "Remove the cache file to create a new one.\n",
+                          bs->file->bs->filename);
+        return -EINVAL;
+    }
+
+    shared_cache_setup(s);
+    trace_shared_cache_attach(bs, s->path, h->nb_slots, h->cluster_size);
+    return 0;
+}
+
+static void shared_cache_get_identity(BlockDriverState *child,
+                                      SharedCacheIdentity *id)
+{
+    struct stat st;
+
+    *id = (SharedCacheIdentity) {};
+    if (stat(child->filename, &st) < 0) {
+        return;
+    }
+
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+#ifdef CONFIG_DARWIN
+    id->mtime_sec = st.st_mtimespec.tv_sec;
+    id->mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+    id->mtime_sec = st.st_mtim.tv_sec;
+    id->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+}
+
+static int shared_cache_lock(BDRVSharedCacheState *s, int fd, Error **errp)
+{
+    int64_t deadline = g_get_monotonic_time() +
+                       SHARED_CACHE_LOCK_TIMEOUT_MS * 1000;
+    int ret;
+
+    while ((ret = qemu_lock_fd(fd, 0, 1, true)) == -EAGAIN &&
+           g_get_monotonic_time() < deadline)
+    {
+        g_usleep(1000);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not lock '%s'", s->path);
+    }
+    return ret;
+}
+
+static int shared_cache_map(BlockDriverState *bs, uint64_t size,
+                            uint32_t cluster_size, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    struct stat st;
+    int fd, ret;
+
+    fd = qemu_create(s->path, O_RDWR, 0600, errp);
+    if (fd < 0) {
+        return fd;
+    }
+
+    ret = shared_cache_lock(s, fd, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not stat '%s'", s->path);
+        goto out;
+    }
+
+    if (st.st_size < SHARED_CACHE_HEADER_SIZE) {
+        ret = shared_cache_create(bs, fd, size, cluster_size, errp);
+    } else {
+        uint64_t magic;
+
+        ret = pread(fd, &magic, sizeof(magic), 0);
+        if (ret == sizeof(magic) && magic == SHARED_CACHE_MAGIC) {
+            ret = shared_cache_attach(bs, fd, st.st_size, errp);
+        } else {
+            /* Creation did not complete, so nobody else uses it */
+            ret = shared_cache_create(bs, fd, st.st_size, cluster_size, errp);
+        }
+    }
+
+out:
+    qemu_unlock_fd(fd, 0, 1);
+    qemu_close(fd);
+    return ret;
+}
+
+static bool shared_cache_absorb_opts(BDRVSharedCacheState *s, QDict *options,
+                                     uint64_t *size, uint32_t *cluster_size,
+                                     Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    const char *path;
+    uint64_t value;
+    bool ok = false;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "path is required");
+        goto out;
+    }
+
+    *size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE,
+                              SHARED_CACHE_DEFAULT_SIZE);
+    if (*size > SIZE_MAX) {
+        error_setg(errp, "size is too large");
+        goto out;
+    }
+
+    value = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                              SHARED_CACHE_DEFAULT_CLUSTER_SIZE);
+    if (!is_power_of_2(value) ||
+        value < SHARED_CACHE_MIN_CLUSTER_SIZE ||
+        value > SHARED_CACHE_MAX_CLUSTER_SIZE)
+    {
+        error_setg(errp, "cluster-size must be a power of two between 4k "
+                   "and 2M");
+        goto out;
+    }
+    *cluster_size = value;
+
+    s->path = g_strdup(path);
+    ok = true;
+
+out:
+    qemu_opts_del(opts);
+    return ok;
+}
+
+static void shared_cache_unmap(BDRVSharedCacheState *s)
+{
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    g_free(s->path);
+    s->path = NULL;
+}
+
+static int GRAPH_UNLOCKED
+shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                  Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint64_t size;
+    uint32_t cluster_size;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "shared-cache nodes must be read-only");
+        return -EINVAL;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!shared_cache_absorb_opts(s, options, &size, &cluster_size, errp)) {
+        return -EINVAL;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    s->child_size = bdrv_getlength(bs->file->bs);
+    if (s->child_size < 0) {
+        error_setg_errno(errp, -s->child_size,
+                         "Could not get the size of the cached node");
+        ret = s->child_size;
+        goto fail;
+    }
+
+    shared_cache_get_identity(bs->file->bs, &s->child_id);
+
+    ret = shared_cache_map(bs, size, cluster_size, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (!QEMU_IS_ALIGNED(s->cluster_size,
+                         bs->file->bs->bl.request_alignment)) {
+        error_setg(errp, "The cluster size of the shared cache must be a "
+                   "multiple of the request alignment of the cached node");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    shared_cache_unmap(s);
+    return ret;
+}
+
+static void GRAPH_UNLOCKED shared_cache_close(BlockDriverState *bs)
+{
+    shared_cache_unmap(bs->opaque);
+}
+
+static int GRAPH_UNLOCKED
+shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                            BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "shared-cache nodes must be read-only");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void GRAPH_RDLOCK
+shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                        BlockReopenQueue *reopen_queue, uint64_t perm,
+                        uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Changing the cached node would make the cache stale */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name                        = "shared-cache",
+    .instance_size                      = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                          = shared_cache_open,
+    .bdrv_close                         = shared_cache_close,
+    .bdrv_reopen_prepare                = shared_cache_reopen_prepare,
+    .bdrv_child_perm                    = shared_cache_child_perm,
+
+    .bdrv_co_getlength                  = shared_cache_co_getlength,
+
+    .bdrv_co_preadv_part                = shared_cache_co_preadv_part,
+
+    .strong_runtime_opts                = shared_cache_strong_runtime_opts,
+    .is_filter                          = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
@@ -58,6 +58,14 @@ struct ThreadPoolAio;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
 
+/*
+ * io_uring ring setup modes.  Each AioContext has one ring per combination so
+ * that users with different requirements can coexist.
+ */
+#define LURING_MODE_SQPOLL  0x1 /* kernel thread polls the submission queue */
+#define LURING_MODE_IOPOLL  0x2 /* busy-poll for completions, O_DIRECT only */
+#define LURING_MODE_NR      4
+
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
@@ -217,7 +225,7 @@ struct AioContext {
     struct LinuxAioState *linux_aio;
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    LuringState *linux_io_uring;
+    LuringState *linux_io_uring[LURING_MODE_NR];
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
@@ -512,11 +520,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/* Setup the LuringState with LURING_MODE_* @mode bound to this AioContext */
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, unsigned int mode,
+                                      Error **errp);
 
-/* Return the LuringState bound to this AioContext */
-LuringState *aio_get_linux_io_uring(AioContext *ctx);
+/* Return the LuringState with LURING_MODE_* @mode bound to this AioContext */
+LuringState *aio_get_linux_io_uring(AioContext *ctx, unsigned int mode);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
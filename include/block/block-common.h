@@ -148,6 +148,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a single compressed write may span multiple clusters, which
+     * lets the driver compress them in parallel (currently QCOW2 only)
+     */
+    bool multi_cluster_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -256,6 +261,7 @@ typedef enum {
 #define BDRV_OPT_READ_ONLY      "read-only"
 #define BDRV_OPT_AUTO_READ_ONLY "auto-read-only"
 #define BDRV_OPT_DISCARD        "discard"
+#define BDRV_OPT_DISCARD_COALESCE_NS "discard-coalesce-ns"
 #define BDRV_OPT_FORCE_SHARE    "force-share"
 #define BDRV_OPT_ACTIVE         "active"
 
@@ -350,6 +356,7 @@ typedef struct BDRVReopenState {
     BlockDriverState *bs;
     int flags;
     BlockdevDetectZeroesOptions detect_zeroes;
+    uint64_t coalesce_ns;
     bool backing_missing;
     BlockDriverState *old_backing_bs; /* keep pointer for permissions update */
     BlockDriverState *old_file_bs; /* keep pointer for permissions update */
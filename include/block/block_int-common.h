@@ -57,6 +57,7 @@
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_ALLOC_SUMMARY     "allocation_summary"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -1236,6 +1237,17 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Time in nanoseconds for which discard and write zeroes requests are
+     * held back to merge them with adjacent ones, 0 if disabled.  Only
+     * changes while drained.
+     */
+    uint64_t coalesce_ns;
+    /* Requests submitted by coalescing, and requests merged into them */
+    Stat64 coalesce_batches_submitted;
+    Stat64 unmap_coalesced;
+    Stat64 zero_coalesced;
+
     /*
      * If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
@@ -1261,6 +1273,7 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     QemuMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    QLIST_HEAD(, BdrvCoalesceBatch) coalesce_batches;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
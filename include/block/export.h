@@ -32,6 +32,12 @@ typedef struct BlockExportDriver {
     /* True if the export type supports running on an inactive node */
     bool supports_inactive;
 
+    /*
+     * True if the export type can process requests in several AioContexts
+     * at once, i.e. accepts the 'iothreads' option
+     */
+    bool supports_multithread;
+
     /* Creates and starts a new block export */
     int (*create)(BlockExport *, BlockExportOptions *, Error **);
 
@@ -79,6 +85,14 @@ struct BlockExport {
     /* The block device to export */
     BlockBackend *blk;
 
+    /*
+     * AioContexts of the iothreads given with the 'iothreads' option, in the
+     * order they were specified.  NULL (and num_iothread_ctxs 0) if the
+     * option was not given, in which case requests are processed in @ctx.
+     */
+    AioContext **iothread_ctxs;
+    size_t num_iothread_ctxs;
+
     /* List entry for block_exports */
     QLIST_ENTRY(BlockExport) next;
 };
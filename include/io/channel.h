@@ -975,7 +975,8 @@ int coroutine_mixed_fn qio_channel_writev_full_all(QIOChannel *ioc,
  *
  * Will block until every packet queued with
  * qio_channel_writev_full() + QIO_CHANNEL_WRITE_FLAG_ZERO_COPY
- * is sent, or return in case of any error.
+ * is sent, or return in case of any error.  When called from a
+ * coroutine, it yields instead of blocking the thread.
  *
  * If not implemented, acts as a no-op, and returns 0.
  *
@@ -984,8 +985,8 @@ int coroutine_mixed_fn qio_channel_writev_full_all(QIOChannel *ioc,
  *          0 otherwise.
  */
 
-int qio_channel_flush(QIOChannel *ioc,
-                      Error **errp);
+int coroutine_mixed_fn qio_channel_flush(QIOChannel *ioc,
+                                         Error **errp);
 
 /**
  * qio_channel_get_peercred:
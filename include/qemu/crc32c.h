@@ -32,4 +32,10 @@
 uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
 uint32_t iov_crc32c(uint32_t crc, const struct iovec *iov, size_t iov_cnt);
 
+/*
+ * For testing only: switch to the next slower implementation.
+ * Return false if there are no more implementations.
+ */
+bool test_crc32c_next_accel(void);
+
 #endif
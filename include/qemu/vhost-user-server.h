@@ -52,6 +52,15 @@ typedef struct {
     QTAILQ_HEAD(, VuFdWatch) vu_fd_watches;
 
     Coroutine *co_trip; /* coroutine for processing VhostUserMsg */
+
+    /*
+     * If set, the kick fd of virtqueue n is monitored in
+     * queue_ctxs[n % num_queue_ctxs] rather than in ctx.  vhost-user messages
+     * are still processed in ctx, with all virtqueues quiesced.
+     */
+    AioContext **queue_ctxs;
+    unsigned int num_queue_ctxs;
+    bool queues_quiesced; /* atomic */
 } VuServer;
 
 bool vhost_user_server_start(VuServer *server,
@@ -63,6 +72,9 @@ bool vhost_user_server_start(VuServer *server,
 
 void vhost_user_server_stop(VuServer *server);
 
+void vhost_user_server_set_queue_ctxs(VuServer *server, AioContext **ctxs,
+                                      unsigned int num_ctxs);
+
 void vhost_user_server_inc_in_flight(VuServer *server);
 void vhost_user_server_dec_in_flight(VuServer *server);
 bool vhost_user_server_has_in_flight(VuServer *server);
@@ -482,76 +482,148 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
-/* Called with RCU critical section */
+/*
+ * Whether the dirty bits of [@start, @start + @length) in @rb can be synced
+ * a word at a time by cpu_physical_memory_sync_dirty_words()
+ */
+static inline bool cpu_physical_memory_sync_dirty_aligned(RAMBlock *rb,
+                                                          ram_addr_t start,
+                                                          ram_addr_t length)
+{
+    unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
+
+    /* start address and length is aligned at the start of a word? */
+    return ((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
+           (start + rb->offset) &&
+           !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1));
+}
+
+/*
+ * Account one dirty bitmap sync in @heat, the write heat of a word of a
+ * RAMBlock's bmap: count it up if any of its pages was @written since the
+ * previous sync, let it cool down otherwise.
+ */
+static inline void ramblock_heat_update(uint8_t *heat, bool written)
+{
+    *heat = written ? *heat + (*heat < UINT8_MAX) : *heat >> 1;
+}
+
+/*
+ * Move the migration dirty bits of the word aligned range [@start, @start +
+ * @length) of @rb into @rb->bmap and return the number of newly dirty pages.
+ * Disjoint ranges may be synced concurrently; afterwards, the caller must
+ * call cpu_physical_memory_sync_dirty_done() for the whole range.
+ *
+ * Called with RCU critical section
+ */
 static inline
-uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
-                                               ram_addr_t start,
-                                               ram_addr_t length)
+uint64_t cpu_physical_memory_sync_dirty_words(RAMBlock *rb,
+                                              ram_addr_t start,
+                                              ram_addr_t length)
 {
-    ram_addr_t addr;
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
     unsigned long *dest = rb->bmap;
+    uint8_t *heat = rb->heat;
+    int k;
+    int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+    unsigned long * const *src;
+    unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
+                                    DIRTY_MEMORY_BLOCK_SIZE);
+    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
 
-    /* start address and length is aligned at the start of a word? */
-    if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
-         (start + rb->offset) &&
-        !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long * const *src;
-        unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
-        unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
-                                        DIRTY_MEMORY_BLOCK_SIZE);
-        unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-        src = qatomic_rcu_read(
-                &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
-
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
+    src = qatomic_rcu_read(
+            &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
+    for (k = page; k < page + nr; k++) {
+        unsigned long bits = 0;
+
+        if (src[idx][offset]) {
+            unsigned long new_dirty;
+            bits = qatomic_xchg(&src[idx][offset], 0);
+            new_dirty = ~dest[k];
+            dest[k] |= bits;
+            new_dirty &= bits;
+            num_dirty += ctpopl(new_dirty);
         }
-        if (num_dirty) {
-            cpu_physical_memory_dirty_bits_cleared(start, length);
+
+        if (heat) {
+            ramblock_heat_update(&heat[k], bits);
         }
 
-        if (rb->clear_bmap) {
-            /*
-             * Postpone the dirty bitmap clear to the point before we
-             * really send the pages, also we will split the clear
-             * dirty procedure into smaller chunks.
-             */
-            clear_bmap_set(rb, start >> TARGET_PAGE_BITS,
-                           length >> TARGET_PAGE_BITS);
-        } else {
-            /* Slow path - still do that in a huge chunk */
-            memory_region_clear_dirty_bitmap(rb->mr, start, length);
+        if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            offset = 0;
+            idx++;
         }
+    }
+
+    return num_dirty;
+}
+
+/*
+ * Finish syncing the word aligned range [@start, @start + @length) of @rb,
+ * in which @num_dirty pages became dirty
+ */
+static inline void cpu_physical_memory_sync_dirty_done(RAMBlock *rb,
+                                                       ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       uint64_t num_dirty)
+{
+    if (num_dirty) {
+        cpu_physical_memory_dirty_bits_cleared(start, length);
+    }
+
+    if (rb->clear_bmap) {
+        /*
+         * Postpone the dirty bitmap clear to the point before we
+         * really send the pages, also we will split the clear
+         * dirty procedure into smaller chunks.
+         */
+        clear_bmap_set(rb, start >> TARGET_PAGE_BITS,
+                       length >> TARGET_PAGE_BITS);
+    } else {
+        /* Slow path - still do that in a huge chunk */
+        memory_region_clear_dirty_bitmap(rb->mr, start, length);
+    }
+}
+
+/* Called with RCU critical section */
+static inline
+uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
+                                               ram_addr_t start,
+                                               ram_addr_t length)
+{
+    ram_addr_t addr;
+    uint64_t num_dirty = 0;
+    unsigned long *dest = rb->bmap;
+
+    if (cpu_physical_memory_sync_dirty_aligned(rb, start, length)) {
+        num_dirty = cpu_physical_memory_sync_dirty_words(rb, start, length);
+        cpu_physical_memory_sync_dirty_done(rb, start, length, num_dirty);
     } else {
         ram_addr_t offset = rb->offset;
+        bool written = false;
 
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
+            long k = (start + addr) >> TARGET_PAGE_BITS;
+
             if (cpu_physical_memory_test_and_clear_dirty(
                         start + addr + offset,
                         TARGET_PAGE_SIZE,
                         DIRTY_MEMORY_MIGRATION)) {
-                long k = (start + addr) >> TARGET_PAGE_BITS;
+                written = true;
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
             }
+
+            /* Heat is kept per word of @dest, as on the aligned path */
+            if (rb->heat && (BIT_WORD(k + 1) != BIT_WORD(k) ||
+                             addr + TARGET_PAGE_SIZE >= length)) {
+                ramblock_heat_update(&rb->heat[BIT_WORD(k)], written);
+                written = false;
+            }
         }
     }
 
@@ -80,6 +80,15 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * Write heat of the pages, one counter per word of @bmap: every dirty
+     * bitmap sync increments it if any page of the word was written and
+     * halves it otherwise, whether the block is synced a word or a page at
+     * a time.  Only allocated on the source side when hot pages are
+     * deferred.
+     */
+    uint8_t *heat;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qapi/qapi-visit-sockets.h"
+#include "qemu/coroutine.h"
 #include "qemu/module.h"
 #include "io/channel-socket.h"
 #include "io/channel-util.h"
@@ -37,6 +38,9 @@
 
 #define SOCKET_MAX_FDS 16
 
+/* Interval for polling the error queue from a coroutine */
+#define SOCKET_FLUSH_POLL_NS (100 * SCALE_US)
+
 SocketAddress *
 qio_channel_socket_get_local_address(QIOChannelSocket *ioc,
                                      Error **errp)
@@ -156,6 +160,19 @@ qio_channel_socket_new_fd(int fd,
 }
 
 
+static void qio_channel_socket_probe_zero_copy(QIOChannelSocket *ioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int ret, v = 1;
+    ret = setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
+    if (ret == 0) {
+        /* Zero copy available on host */
+        qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    }
+#endif
+}
+
 int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
                                     SocketAddress *addr,
                                     Error **errp)
@@ -175,15 +192,7 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    qio_channel_socket_probe_zero_copy(ioc);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -421,6 +430,8 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     }
 #endif /* WIN32 */
 
+    qio_channel_socket_probe_zero_copy(cioc);
+
     qio_channel_set_feature(QIO_CHANNEL(cioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
 
@@ -736,8 +747,8 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+static int coroutine_mixed_fn qio_channel_socket_flush(QIOChannel *ioc,
+                                                      Error **errp)
 {
     QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
     struct msghdr msg = {};
@@ -763,7 +774,17 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
             switch (errno) {
             case EAGAIN:
                 /* Nothing on errqueue, wait until something is available */
-                qio_channel_wait(ioc, G_IO_ERR);
+                if (qemu_in_coroutine()) {
+                    /*
+                     * The read handler of the AioContext may be taken by
+                     * another coroutine, so poll instead of waiting for
+                     * G_IO_ERR, without blocking the thread.
+                     */
+                    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME,
+                                     SOCKET_FLUSH_POLL_NS);
+                } else {
+                    qio_channel_wait(ioc, G_IO_ERR);
+                }
                 continue;
             case EINTR:
                 continue;
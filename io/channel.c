@@ -580,8 +580,8 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
     return klass->io_seek(ioc, offset, whence, errp);
 }
 
-int qio_channel_flush(QIOChannel *ioc,
-                                Error **errp)
+int coroutine_mixed_fn qio_channel_flush(QIOChannel *ioc,
+                                         Error **errp)
 {
     QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
 
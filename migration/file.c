@@ -6,9 +6,12 @@
  */
 
 #include "qemu/osdep.h"
+#include "exec/target_page.h"
 #include "system/ramblock.h"
+#include "qemu/bitops.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "channel.h"
 #include "file.h"
@@ -21,6 +24,9 @@
 
 #define OFFSET_OPTION ",offset="
 
+/* Largest single read when loading mapped-ram pages from a bitmap */
+#define MULTIFD_FILE_READ_MAX (8 * MiB)
+
 static struct FileOutgoingArgs {
     char *fname;
 } outgoing_args;
@@ -250,11 +256,61 @@ int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
     return (ret < 0) ? ret : 0;
 }
 
+/*
+ * Load every run of pages set in the bitmap slice straight into guest
+ * memory, splitting long runs so that a single read stays bounded.
+ */
+static int multifd_file_recv_bitmap(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDRecvData *data = p->data;
+    int page_bits = qemu_target_page_bits();
+    unsigned long set_bit_idx, clear_bit_idx;
+    ssize_t ret;
+
+    for (set_bit_idx = find_next_bit(data->bmap, data->last_page,
+                                     data->first_page);
+         set_bit_idx < data->last_page;
+         set_bit_idx = find_next_bit(data->bmap, data->last_page,
+                                     clear_bit_idx + 1)) {
+
+        clear_bit_idx = find_next_zero_bit(data->bmap, data->last_page,
+                                           set_bit_idx + 1);
+
+        while (set_bit_idx < clear_bit_idx) {
+            off_t offset = (off_t)set_bit_idx << page_bits;
+            size_t size = MIN((size_t)(clear_bit_idx - set_bit_idx)
+                              << page_bits, MULTIFD_FILE_READ_MAX);
+
+            ret = qio_channel_pread(p->c, (char *)data->opaque + offset,
+                                    size, data->file_offset + offset, errp);
+            if (ret < 0) {
+                error_prepend(errp, "multifd recv (%u): read at 0x%" PRIx64
+                              " failed: ", p->id,
+                              (uint64_t)(data->file_offset + offset));
+                return -1;
+            }
+            if ((size_t)ret != size) {
+                error_setg(errp, "multifd recv (%u): read 0x%zx at 0x%" PRIx64
+                           ", expected 0x%zx", p->id, (size_t)ret,
+                           (uint64_t)(data->file_offset + offset), size);
+                return -1;
+            }
+            set_bit_idx += size >> page_bits;
+        }
+    }
+
+    return 0;
+}
+
 int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDRecvData *data = p->data;
     size_t ret;
 
+    if (data->bmap) {
+        return multifd_file_recv_bitmap(p, errp);
+    }
+
     ret = qio_channel_pread(p->c, (char *) data->opaque,
                             data->size, data->file_offset, errp);
     if (ret != data->size) {
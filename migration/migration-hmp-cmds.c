@@ -158,6 +158,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, ", zerocopy_fallbacks=%" PRIu64,
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->has_x_deferred_pages) {
+            monitor_printf(mon, ", deferred_pages=%" PRIu64,
+                           info->ram->x_deferred_pages);
+        }
         monitor_printf(mon, "\n");
     }
 
@@ -34,6 +34,11 @@
  * one thread).
  */
 typedef struct {
+    /*
+     * Number of dirty pages held back for the completion stage because
+     * they are written often, summed over all dirty bitmap syncs.
+     */
+    Stat64 deferred_pages;
     /*
      * Number of bytes that were dirty last time that we synced with
      * the guest memory.  We use that to calculate the downtime.  As
@@ -1286,6 +1286,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->precopy_bytes = stat64_get(&mig_stats.precopy_bytes);
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
     info->ram->postcopy_bytes = stat64_get(&mig_stats.postcopy_bytes);
+    if (migrate_defer_hot_pages()) {
+        info->ram->has_x_deferred_pages = true;
+        info->ram->x_deferred_pages = stat64_get(&mig_stats.deferred_pages);
+    }
 
     if (migrate_xbzrle()) {
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
@@ -2122,6 +2126,15 @@ static bool migrate_prepare(MigrationState *s, bool resume, Error **errp)
         }
     }
 
+    if (migrate_multifd() &&
+        migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE &&
+        migrate_zero_page_detection() == ZERO_PAGE_DETECTION_LEGACY) {
+        /* Zero pages would bypass the channels and leave the cache stale */
+        error_setg(errp, "Cannot use xbzrle multifd compression with "
+                   "legacy zero page detection");
+        return false;
+    }
+
     if (migrate_mode_is_cpr(s)) {
         const char *conflict = NULL;
 
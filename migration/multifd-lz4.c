@@ -0,0 +1,249 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * Each normal page of a packet is compressed as an independent LZ4
+ * block.  The packet payload is the sequence of those blocks, each
+ * preceded by its big-endian 32-bit length.  A page that LZ4 cannot
+ * shrink is sent as is, with its length set to the page size.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "system/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/* Per-block header: length of the compressed page */
+#define LZ4_HDR_SIZE sizeof(uint32_t)
+
+struct lz4_data {
+    /* compression state, LZ4_sizeofState() bytes */
+    void *state;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+/*
+ * A packet never holds more than multifd_ram_page_count() pages and a
+ * page never takes more than its own size plus the header, so this
+ * bounds the payload on both sides.
+ */
+static uint32_t multifd_lz4_zbuff_len(void)
+{
+    return multifd_ram_page_count() *
+           (multifd_ram_page_size() + LZ4_HDR_SIZE);
+}
+
+/* Multifd lz4 compression */
+
+static int multifd_lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->state = g_try_malloc(LZ4_sizeofState());
+    if (!z->state) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for lz4 state", p->id);
+        return -1;
+    }
+    z->zbuff_len = multifd_lz4_zbuff_len();
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z->state);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+
+    /* Needs 2 IOVs, one for packet header and one for compressed data */
+    p->iov = g_new0(struct iovec, 2);
+    return 0;
+}
+
+static void multifd_lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->state);
+    z->state = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct lz4_data *z = p->compress_data;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        uint8_t *src = pages->block->host + pages->offset[i];
+        uint8_t *dst = z->zbuff + out_size + LZ4_HDR_SIZE;
+        int len;
+
+        /*
+         * The guest may be writing to the page while we compress it.
+         * LZ4 never writes past the capacity it is given, and a page
+         * modified here is dirty again and will be sent in a later
+         * iteration, so a garbled block is harmless.
+         *
+         * Anything that does not fit in less than a page is not worth
+         * compressing; LZ4 returns 0 in that case.
+         */
+        len = LZ4_compress_fast_extState(z->state, (const char *)src,
+                                         (char *)dst, page_size,
+                                         page_size - 1, 1);
+        if (len <= 0) {
+            memcpy(dst, src, page_size);
+            len = page_size;
+        }
+        stl_be_p(z->zbuff + out_size, len);
+        out_size += LZ4_HDR_SIZE + len;
+    }
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+
+out:
+    p->flags |= MULTIFD_FLAG_LZ4;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->zbuff_len = multifd_lz4_zbuff_len();
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+    return 0;
+}
+
+static void multifd_lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int multifd_lz4_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t in_pos = 0;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lz4_data *z = p->compress_data;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u too big",
+                   p->id, in_size);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *dst = p->host + p->normal[i];
+        uint32_t len;
+
+        if (in_size - in_pos < LZ4_HDR_SIZE) {
+            error_setg(errp, "multifd %u: truncated packet at page %d",
+                       p->id, i);
+            return -1;
+        }
+        len = ldl_be_p(z->zbuff + in_pos);
+        in_pos += LZ4_HDR_SIZE;
+        if (len > page_size || len > in_size - in_pos) {
+            error_setg(errp, "multifd %u: invalid block length %u at page %d",
+                       p->id, len, i);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (len == page_size) {
+            memcpy(dst, z->zbuff + in_pos, page_size);
+        } else {
+            ret = LZ4_decompress_safe((const char *)z->zbuff + in_pos,
+                                      (char *)dst, len, page_size);
+            if (ret != page_size) {
+                error_setg(errp, "multifd %u: decompress returned %d "
+                           "at page %d", p->id, ret, i);
+                return -1;
+            }
+        }
+        in_pos += len;
+    }
+    if (in_pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, in_pos);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDMethods multifd_lz4_ops = {
+    .send_setup = multifd_lz4_send_setup,
+    .send_cleanup = multifd_lz4_send_cleanup,
+    .send_prepare = multifd_lz4_send_prepare,
+    .recv_setup = multifd_lz4_recv_setup,
+    .recv_cleanup = multifd_lz4_recv_cleanup,
+    .recv = multifd_lz4_recv
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
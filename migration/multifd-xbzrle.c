@@ -0,0 +1,408 @@
+/*
+ * Multifd XBZRLE delta compression implementation
+ *
+ * Pages are delta encoded against the copy that was last sent for the
+ * same address, like the xbzrle capability does on the main migration
+ * channel.  The sender keeps those copies in a page cache shared by all
+ * channels and split into shards, each with its own lock; a page always
+ * maps to the same shard whichever channel sends it.  The receiver
+ * applies the delta to guest memory directly, which holds the previous
+ * version of the page, so it needs no cache.
+ *
+ * This relies on multifd never having two versions of the same page in
+ * flight at once: a page is sent at most once per dirty bitmap round,
+ * and rounds are separated by a multifd sync.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "system/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/* Per-page encoding, first byte of each page in the payload */
+#define MULTIFD_XBZRLE_RAW      0
+#define MULTIFD_XBZRLE_DELTA    1
+
+/* Encoding byte plus the 16-bit delta length */
+#define MULTIFD_XBZRLE_HDR_SIZE 3
+
+/* Pages in the same 2 MiB region share a cache shard */
+#define MULTIFD_XBZRLE_SHARD_BITS 21
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} MultiFDXbzrleShard;
+
+typedef struct {
+    MultiFDXbzrleShard *shards;
+    uint32_t num_shards;
+    /* number of send channels using the cache */
+    uint32_t users;
+} MultiFDXbzrleCache;
+
+/* Set up and torn down from the main thread, with the channels */
+static MultiFDXbzrleCache *xbzrle_cache;
+
+struct xbzrle_data {
+    /* copy of the page being encoded */
+    uint8_t *page_buf;
+    /* encoded buffer */
+    uint8_t *zbuff;
+    /* size of encoded buffer */
+    uint32_t zbuff_len;
+};
+
+static uint32_t multifd_xbzrle_zbuff_len(void)
+{
+    return multifd_ram_page_count() *
+           (multifd_ram_page_size() + MULTIFD_XBZRLE_HDR_SIZE);
+}
+
+static MultiFDXbzrleShard *multifd_xbzrle_shard(ram_addr_t addr)
+{
+    uint64_t region = addr >> MULTIFD_XBZRLE_SHARD_BITS;
+
+    return &xbzrle_cache->shards[region % xbzrle_cache->num_shards];
+}
+
+static void multifd_xbzrle_cache_free(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < xbzrle_cache->num_shards; i++) {
+        MultiFDXbzrleShard *shard = &xbzrle_cache->shards[i];
+
+        if (shard->cache) {
+            cache_fini(shard->cache);
+        }
+        qemu_mutex_destroy(&shard->lock);
+    }
+    g_free(xbzrle_cache->shards);
+    g_free(xbzrle_cache);
+    xbzrle_cache = NULL;
+}
+
+static int multifd_xbzrle_cache_get(Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t shard_pages;
+    uint32_t i;
+
+    if (xbzrle_cache) {
+        xbzrle_cache->users++;
+        return 0;
+    }
+
+    xbzrle_cache = g_new0(MultiFDXbzrleCache, 1);
+    xbzrle_cache->num_shards = migrate_multifd_channels();
+    xbzrle_cache->shards = g_new0(MultiFDXbzrleShard,
+                                  xbzrle_cache->num_shards);
+    for (i = 0; i < xbzrle_cache->num_shards; i++) {
+        qemu_mutex_init(&xbzrle_cache->shards[i].lock);
+    }
+
+    /* xbzrle-cache-size is split evenly, each shard needs 2^n pages */
+    shard_pages = migrate_xbzrle_cache_size() / page_size /
+                  xbzrle_cache->num_shards;
+    shard_pages = pow2floor(MAX(shard_pages, 1));
+
+    for (i = 0; i < xbzrle_cache->num_shards; i++) {
+        xbzrle_cache->shards[i].cache = cache_init(shard_pages * page_size,
+                                                   page_size, errp);
+        if (!xbzrle_cache->shards[i].cache) {
+            multifd_xbzrle_cache_free();
+            return -1;
+        }
+    }
+    trace_multifd_xbzrle_cache_init(xbzrle_cache->num_shards, shard_pages);
+
+    xbzrle_cache->users = 1;
+    return 0;
+}
+
+static void multifd_xbzrle_cache_put(void)
+{
+    assert(xbzrle_cache && xbzrle_cache->users);
+
+    if (--xbzrle_cache->users == 0) {
+        multifd_xbzrle_cache_free();
+    }
+}
+
+/*
+ * Encode one page into @dst and return the number of bytes used.  The
+ * cache is updated to what the destination will hold afterwards.
+ */
+static uint32_t multifd_xbzrle_encode_page(struct xbzrle_data *z,
+                                           ram_addr_t addr, uint8_t *src,
+                                           uint8_t *dst, uint64_t generation)
+{
+    MultiFDXbzrleShard *shard = multifd_xbzrle_shard(addr);
+    uint32_t page_size = multifd_ram_page_size();
+    uint8_t *cached;
+    int len = -1;
+
+    /*
+     * The guest may be writing to the page, so encode and cache a
+     * private copy: what is sent and what is cached must agree.
+     */
+    memcpy(z->page_buf, src, page_size);
+
+    qemu_mutex_lock(&shard->lock);
+    if (cache_is_cached(shard->cache, addr, generation)) {
+        cached = get_cached_data(shard->cache, addr);
+        len = xbzrle_encode_buffer(cached, z->page_buf, page_size,
+                                   dst + MULTIFD_XBZRLE_HDR_SIZE,
+                                   page_size - MULTIFD_XBZRLE_HDR_SIZE);
+        if (len > 0) {
+            memcpy(cached, z->page_buf, page_size);
+        }
+    }
+    if (len < 0) {
+        /*
+         * Miss or overflow, send the page as is.  Failing to insert is
+         * fine: the slot then belongs to another page, so no stale copy
+         * of this one is left behind.
+         */
+        cache_insert(shard->cache, addr, z->page_buf, generation);
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    if (len < 0) {
+        dst[0] = MULTIFD_XBZRLE_RAW;
+        memcpy(dst + 1, z->page_buf, page_size);
+        return 1 + page_size;
+    }
+
+    dst[0] = MULTIFD_XBZRLE_DELTA;
+    stw_be_p(dst + 1, len);
+    return MULTIFD_XBZRLE_HDR_SIZE + len;
+}
+
+/*
+ * Zero pages are not part of the payload, but the destination now has
+ * zeroes there; replace any cached copy so it does not go stale.
+ */
+static void multifd_xbzrle_cache_zero_page(ram_addr_t addr,
+                                           uint64_t generation)
+{
+    MultiFDXbzrleShard *shard = multifd_xbzrle_shard(addr);
+
+    qemu_mutex_lock(&shard->lock);
+    if (cache_is_cached(shard->cache, addr, generation)) {
+        memset(get_cached_data(shard->cache, addr), 0,
+               multifd_ram_page_size());
+    }
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/* Multifd xbzrle compression */
+
+static int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z;
+
+    if (multifd_xbzrle_cache_get(errp)) {
+        return -1;
+    }
+
+    z = g_new0(struct xbzrle_data, 1);
+    z->page_buf = g_malloc(multifd_ram_page_size());
+    z->zbuff_len = multifd_xbzrle_zbuff_len();
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z->page_buf);
+        g_free(z);
+        multifd_xbzrle_cache_put();
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+
+    /* Needs 2 IOVs, one for packet header and one for encoded data */
+    p->iov = g_new0(struct iovec, 2);
+    return 0;
+}
+
+static void multifd_xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->compress_data;
+
+    if (!z) {
+        return;
+    }
+
+    g_free(z->page_buf);
+    g_free(z->zbuff);
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+    multifd_xbzrle_cache_put();
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct xbzrle_data *z = p->compress_data;
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    ram_addr_t base = pages->block->offset;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    multifd_send_prepare_common(p);
+
+    for (i = pages->normal_num; i < pages->num; i++) {
+        multifd_xbzrle_cache_zero_page(base + pages->offset[i], generation);
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        out_size += multifd_xbzrle_encode_page(z, base + pages->offset[i],
+                                               pages->block->host +
+                                               pages->offset[i],
+                                               z->zbuff + out_size,
+                                               generation);
+    }
+
+    if (out_size) {
+        p->iov[p->iovs_num].iov_base = z->zbuff;
+        p->iov[p->iovs_num].iov_len = out_size;
+        p->iovs_num++;
+        p->next_packet_size = out_size;
+    }
+
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *z = g_new0(struct xbzrle_data, 1);
+
+    z->zbuff_len = multifd_xbzrle_zbuff_len();
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+    return 0;
+}
+
+static void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *z = p->compress_data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int multifd_xbzrle_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t in_pos = 0;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct xbzrle_data *z = p->compress_data;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u too big",
+                   p->id, in_size);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *dst = p->host + p->normal[i];
+        uint8_t *src = z->zbuff + in_pos;
+        uint32_t avail = in_size - in_pos;
+        uint32_t len;
+
+        if (!avail) {
+            error_setg(errp, "multifd %u: truncated packet at page %d",
+                       p->id, i);
+            return -1;
+        }
+        if (avail >= 1 + page_size && src[0] == MULTIFD_XBZRLE_RAW) {
+            memcpy(dst, src + 1, page_size);
+            len = 1 + page_size;
+        } else if (avail >= MULTIFD_XBZRLE_HDR_SIZE &&
+                   src[0] == MULTIFD_XBZRLE_DELTA) {
+            len = lduw_be_p(src + 1);
+            if (len > avail - MULTIFD_XBZRLE_HDR_SIZE ||
+                (len && xbzrle_decode_buffer(src + MULTIFD_XBZRLE_HDR_SIZE,
+                                             len, dst, page_size) < 0)) {
+                error_setg(errp, "multifd %u: invalid delta at page %d",
+                           p->id, i);
+                return -1;
+            }
+            len += MULTIFD_XBZRLE_HDR_SIZE;
+        } else {
+            error_setg(errp, "multifd %u: invalid encoding at page %d",
+                       p->id, i);
+            return -1;
+        }
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        in_pos += len;
+    }
+    if (in_pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, in_pos);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = multifd_xbzrle_send_setup,
+    .send_cleanup = multifd_xbzrle_send_cleanup,
+    .send_prepare = multifd_xbzrle_send_prepare,
+    .recv_setup = multifd_xbzrle_recv_setup,
+    .recv_cleanup = multifd_xbzrle_recv_cleanup,
+    .recv = multifd_xbzrle_recv
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
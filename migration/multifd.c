@@ -91,6 +91,11 @@ struct {
      * uses it to wait for recv threads to finish assigned tasks.
      */
     QemuSemaphore sem_sync;
+    /*
+     * Without packets, posted by the recv threads when they finish a
+     * task; multifd_recv() waits on it when all channels are busy.
+     */
+    QemuSemaphore channels_ready;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     int exiting;
@@ -1024,6 +1029,11 @@ bool multifd_recv(void)
             next_recv_channel = (i + 1) % migrate_multifd_channels();
             break;
         }
+
+        /* All channels are busy, sleep until one of them is done */
+        if ((i + 1) % migrate_multifd_channels() == next_recv_channel) {
+            qemu_sem_wait(&multifd_recv_state->channels_ready);
+        }
     }
 
     /*
@@ -1107,6 +1117,9 @@ static void multifd_recv_terminate_threads(Error *err)
             qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
     }
+
+    /* Wake up multifd_recv() if it is waiting for a channel */
+    qemu_sem_post(&multifd_recv_state->channels_ready);
 }
 
 void multifd_recv_shutdown(void)
@@ -1142,6 +1155,7 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
 static void multifd_recv_cleanup_state(void)
 {
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_sem_destroy(&multifd_recv_state->channels_ready);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state->data);
@@ -1211,8 +1225,13 @@ void multifd_recv_sync_main(void)
     if (file_based) {
         /*
          * For file-based loading is done in one iteration. We're
-         * done.
+         * done.  The mapped-ram bitmaps the channels loaded from are
+         * freed once this returns, so drop the references to them.
          */
+        for (i = 0; i < thread_count; i++) {
+            multifd_recv_state->params[i].data->bmap = NULL;
+        }
+        multifd_recv_state->data->bmap = NULL;
         return;
     }
 
@@ -1425,6 +1444,7 @@ static void *multifd_recv_thread(void *opaque)
              * multifd_recv().
              */
             qatomic_store_release(&p->pending_job, false);
+            qemu_sem_post(&multifd_recv_state->channels_ready);
         }
     }
 
@@ -1464,6 +1484,7 @@ int multifd_recv_setup(Error **errp)
     qatomic_set(&multifd_recv_state->count, 0);
     qatomic_set(&multifd_recv_state->exiting, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_sem_init(&multifd_recv_state->channels_ready, 0);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -63,6 +63,8 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+#define MULTIFD_FLAG_XBZRLE (5 << 1)
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
@@ -134,6 +136,14 @@ struct MultiFDRecvData {
     size_t size;
     /* for preadv */
     off_t file_offset;
+    /*
+     * mapped-ram: when set, only load the pages in [first_page,
+     * last_page) that are present in this bitmap, each from
+     * file_offset + its offset to opaque + its offset.
+     */
+    unsigned long *bmap;
+    unsigned long first_page;
+    unsigned long last_page;
 };
 
 typedef struct {
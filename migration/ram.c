@@ -32,6 +32,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "block/thread-pool.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -85,7 +86,8 @@
 
 /*
  * When doing mapped-ram migration, this is the amount we read from
- * the pages region in the migration file at a time.
+ * the pages region in the migration file at a time.  With multifd it
+ * is the granularity at which a RAMBlock is split between channels.
  */
 #define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
 
@@ -432,6 +434,16 @@ struct RAMState {
      * Protected by @bitmap_mutex.
      */
     PageLocationHint page_hint;
+    /* Worker threads for syncing the dirty bitmap, NULL on small hosts */
+    ThreadPool *sync_threads;
+    /*
+     * Pages in words of the dirty bitmap at least this hot are only sent in
+     * the final stage, RAM_HEAT_NONE if none are.  Protected by the
+     * bitmap_mutex.
+     */
+    unsigned int defer_heat;
+    /* The page search found only deferred pages since the last sync */
+    bool defer_stalled;
 };
 typedef struct RAMState RAMState;
 
@@ -709,6 +721,22 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+#define RAM_HEAT_NONE           (UINT8_MAX + 1)
+
+/* Pages must have been written in at least two recent syncs to be deferred */
+#define RAM_HEAT_DEFER_MIN      2
+
+static bool ram_defer_active(RAMState *rs)
+{
+    return rs->defer_heat != RAM_HEAT_NONE && !rs->last_stage &&
+           !migration_in_postcopy();
+}
+
+static bool ram_page_deferred(RAMState *rs, RAMBlock *rb, unsigned long page)
+{
+    return rb->heat && rb->heat[BIT_WORD(page)] >= rs->defer_heat;
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -716,7 +744,8 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
  * within the ramblock to migrate, or the end of ramblock when nothing
  * found.  Note that when pss->host_page_sending==true it means we're
  * during sending a host page, so we won't look for dirty page that is
- * outside the host page boundary.
+ * outside the host page boundary.  Otherwise, pages that are deferred to
+ * the final stage are skipped.
  *
  * @pss: the current page search status
  */
@@ -742,6 +771,15 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     }
 
     pss->page = find_next_bit(bitmap, size, pss->page);
+
+    if (!pss->host_page_sending && ram_defer_active(ram_state)) {
+        while (pss->page < size &&
+               ram_page_deferred(ram_state, rb, pss->page)) {
+            pss->page = find_next_bit(bitmap, size,
+                                      QEMU_ALIGN_UP(pss->page + 1,
+                                                    BITS_PER_LONG));
+        }
+    }
 }
 
 static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
@@ -933,6 +971,108 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * The dirty bitmaps of RAMBlocks larger than this many target pages are
+ * synced in chunks of that size by the sync_threads
+ */
+#define RAM_SYNC_CHUNK_PAGES    (1UL << 18)
+#define RAM_SYNC_MAX_THREADS    8
+
+typedef struct RAMSyncChunk {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+    uint64_t num_dirty;
+} RAMSyncChunk;
+
+static bool ramblock_sync_in_chunks(RAMState *rs, RAMBlock *rb)
+{
+    return rs->sync_threads &&
+           rb->used_length >
+               ((ram_addr_t)RAM_SYNC_CHUNK_PAGES << TARGET_PAGE_BITS) &&
+           cpu_physical_memory_sync_dirty_aligned(rb, 0, rb->used_length);
+}
+
+/*
+ * Runs in a worker thread.  The ram_list.dirty_memory blocks it reads stay
+ * alive because the migration thread holds the RCU read lock until all
+ * chunks are done.
+ */
+static int ramblock_sync_dirty_chunk(void *opaque)
+{
+    RAMSyncChunk *c = opaque;
+
+    c->num_dirty = cpu_physical_memory_sync_dirty_words(c->block, c->start,
+                                                        c->length);
+    return 0;
+}
+
+/*
+ * Sync the dirty bitmaps of all RAMBlocks.  Large blocks are split into
+ * chunks that are synced in parallel while the migration thread takes care
+ * of the small ones.
+ *
+ * Called with RCU critical section
+ */
+static void ramblock_sync_dirty_bitmaps(RAMState *rs)
+{
+    ram_addr_t chunk_len = (ram_addr_t)RAM_SYNC_CHUNK_PAGES << TARGET_PAGE_BITS;
+    g_autoptr(GArray) chunks = g_array_new(false, false,
+                                           sizeof(RAMSyncChunk));
+    RAMBlock *block;
+    uint64_t num_dirty = 0;
+    guint i;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        if (!ramblock_sync_in_chunks(rs, block)) {
+            continue;
+        }
+        for (start = 0; start < block->used_length; start += chunk_len) {
+            RAMSyncChunk c = {
+                .block = block,
+                .start = start,
+                .length = MIN(chunk_len, block->used_length - start),
+            };
+            g_array_append_val(chunks, c);
+        }
+    }
+
+    /* The array is not resized any more, so the elements stay in place */
+    for (i = 0; i < chunks->len; i++) {
+        thread_pool_submit(rs->sync_threads, ramblock_sync_dirty_chunk,
+                           &g_array_index(chunks, RAMSyncChunk, i), NULL);
+    }
+    trace_migration_bitmap_sync_chunks(chunks->len);
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!ramblock_sync_in_chunks(rs, block)) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+    }
+
+    if (!chunks->len) {
+        return;
+    }
+    thread_pool_wait(rs->sync_threads);
+
+    /* The chunks of each block are adjacent */
+    for (i = 0; i < chunks->len; i++) {
+        RAMSyncChunk *c = &g_array_index(chunks, RAMSyncChunk, i);
+
+        num_dirty += c->num_dirty;
+        if (c->start + c->length == c->block->used_length) {
+            cpu_physical_memory_sync_dirty_done(c->block, 0,
+                                                c->block->used_length,
+                                                num_dirty);
+            rs->migration_dirty_pages += num_dirty;
+            rs->num_dirty_pages_period += num_dirty;
+            num_dirty = 0;
+        }
+    }
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1052,9 +1192,60 @@ static void migration_trigger_throttle(RAMState *rs)
     }
 }
 
-static void migration_bitmap_sync(RAMState *rs, bool last_stage)
+/*
+ * Choose which of the dirty pages are deferred to the final stage: those in
+ * the hottest words of the dirty bitmaps, as long as sending them leaves at
+ * least half of the expected downtime for everything else.
+ *
+ * Called with RCU critical section
+ */
+static void ram_update_defer_heat(RAMState *rs, bool last_stage)
 {
+    uint64_t pages[UINT8_MAX + 1] = { 0 };
+    uint64_t budget, deferred = 0;
     RAMBlock *block;
+    unsigned int heat;
+
+    rs->defer_heat = RAM_HEAT_NONE;
+    rs->defer_stalled = false;
+
+    if (!migrate_defer_hot_pages() || last_stage || migration_in_postcopy()) {
+        return;
+    }
+
+    budget = (migrate_get_current()->threshold_size / 2) >> TARGET_PAGE_BITS;
+    if (!budget) {
+        return;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long k, words;
+
+        if (!block->heat) {
+            continue;
+        }
+        words = BITS_TO_LONGS(block->used_length >> TARGET_PAGE_BITS);
+        for (k = 0; k < words; k++) {
+            if (block->heat[k] >= RAM_HEAT_DEFER_MIN) {
+                pages[block->heat[k]] += ctpopl(block->bmap[k]);
+            }
+        }
+    }
+
+    for (heat = UINT8_MAX; heat >= RAM_HEAT_DEFER_MIN; heat--) {
+        if (deferred + pages[heat] > budget) {
+            break;
+        }
+        deferred += pages[heat];
+        rs->defer_heat = heat;
+    }
+    stat64_add(&mig_stats.deferred_pages, deferred);
+
+    trace_ram_update_defer_heat(rs->defer_heat, deferred, budget);
+}
+
+static void migration_bitmap_sync(RAMState *rs, bool last_stage)
+{
     int64_t end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
@@ -1068,9 +1259,8 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
-            }
+            ramblock_sync_dirty_bitmaps(rs);
+            ram_update_defer_heat(rs, last_stage);
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
     }
@@ -2297,6 +2487,22 @@ static int ram_find_and_save_block(RAMState *rs)
     rs->last_seen_block = pss->block;
     rs->last_page = pss->page;
 
+    if (!pages && rs->migration_dirty_pages && ram_defer_active(rs)) {
+        /*
+         * Only deferred pages are left.  Normally the pending estimate now
+         * drops below the threshold, so the dirty bitmap is synced and the
+         * deferred pages are chosen anew.  If we get here again without a
+         * sync, the downtime budget must have shrunk: stop deferring rather
+         * than stalling migration.
+         */
+        if (rs->defer_stalled) {
+            trace_ram_defer_stalled(rs->migration_dirty_pages);
+            rs->defer_heat = RAM_HEAT_NONE;
+            return ram_find_and_save_block(rs);
+        }
+        rs->defer_stalled = true;
+    }
+
     return pages;
 }
 
@@ -2341,6 +2547,9 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        if ((*rsp)->sync_threads) {
+            thread_pool_free((*rsp)->sync_threads);
+        }
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -2375,6 +2584,8 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        g_free(block->heat);
+        block->heat = NULL;
     }
 }
 
@@ -2712,6 +2923,8 @@ err_out:
 
 static bool ram_state_init(RAMState **rsp, Error **errp)
 {
+    int sync_threads = MIN(g_get_num_processors(), RAM_SYNC_MAX_THREADS);
+
     *rsp = g_try_new0(RAMState, 1);
 
     if (!*rsp) {
@@ -2730,8 +2943,15 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
      * This must match with the initial values of dirty bitmap.
      */
     (*rsp)->migration_dirty_pages = (*rsp)->ram_bytes_total >> TARGET_PAGE_BITS;
+    (*rsp)->defer_heat = RAM_HEAT_NONE;
     ram_state_reset(*rsp);
 
+    if (sync_threads > 1 &&
+        (*rsp)->migration_dirty_pages > 2 * RAM_SYNC_CHUNK_PAGES) {
+        (*rsp)->sync_threads = thread_pool_new();
+        thread_pool_set_max_threads((*rsp)->sync_threads, sync_threads);
+    }
+
     return true;
 }
 
@@ -2771,6 +2991,9 @@ static void ram_list_init_bitmaps(void)
             if (migrate_mapped_ram()) {
                 block->file_bmap = bitmap_new(pages);
             }
+            if (migrate_defer_hot_pages()) {
+                block->heat = g_new0(uint8_t, BITS_TO_LONGS(pages));
+            }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -3923,20 +4146,66 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
-static size_t ram_load_multifd_pages(void *host_addr, size_t size,
-                                     uint64_t offset)
+static bool ram_load_multifd_slice(RAMBlock *block, unsigned long *bitmap,
+                                   unsigned long first_page,
+                                   unsigned long last_page)
 {
     MultiFDRecvData *data = multifd_get_recv_data();
 
-    data->opaque = host_addr;
-    data->file_offset = offset;
-    data->size = size;
+    data->opaque = block->host;
+    data->file_offset = block->pages_offset;
+    data->size = (size_t)(last_page - first_page) << TARGET_PAGE_BITS;
+    data->bmap = bitmap;
+    data->first_page = first_page;
+    data->last_page = last_page;
 
-    if (!multifd_recv()) {
-        return 0;
+    return multifd_recv();
+}
+
+/*
+ * Split the pages of @block that are present in the file into one
+ * slice per multifd channel, each holding about the same number of
+ * pages, so that every channel loads its slice on its own instead of
+ * being handed one chunk at a time.  @bitmap must stay around until
+ * the channels are synced.
+ */
+static bool read_ramblock_mapped_ram_multifd(RAMBlock *block, long num_pages,
+                                             unsigned long *bitmap,
+                                             Error **errp)
+{
+    unsigned long chunk = MAPPED_RAM_LOAD_BUF_SIZE >> TARGET_PAGE_BITS;
+    unsigned long total, target, count = 0;
+    unsigned long start = 0, page;
+
+    if (num_pages > (block->used_length >> TARGET_PAGE_BITS)) {
+        error_setg(errp, "page outside of ramblock %s range", block->idstr);
+        return false;
     }
 
-    return size;
+    total = bitmap_count_one(bitmap, num_pages);
+    target = DIV_ROUND_UP(total, migrate_multifd_channels());
+
+    for (page = 0; page < num_pages; page += chunk) {
+        unsigned long len = MIN(chunk, num_pages - page);
+
+        count += bitmap_count_one_with_offset(bitmap, page, len);
+        if (count < target && page + len < num_pages) {
+            continue;
+        }
+
+        if (count && !ram_load_multifd_slice(block, bitmap, start,
+                                             page + len)) {
+            error_setg(errp, "(%s) failed to queue pages for loading",
+                       block->idstr);
+            return false;
+        }
+        trace_ram_load_mapped_ram_slice(block->idstr, start, page + len,
+                                        count);
+        start = page + len;
+        count = 0;
+    }
+
+    return true;
 }
 
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
@@ -3949,6 +4218,11 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
     void *host;
     size_t read, unread, size;
 
+    if (migrate_multifd()) {
+        return read_ramblock_mapped_ram_multifd(block, num_pages, bitmap,
+                                                errp);
+    }
+
     for (set_bit_idx = find_first_bit(bitmap, num_pages);
          set_bit_idx < num_pages;
          set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1)) {
@@ -3968,13 +4242,8 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
 
             size = MIN(unread, MAPPED_RAM_LOAD_BUF_SIZE);
 
-            if (migrate_multifd()) {
-                read = ram_load_multifd_pages(host, size,
-                                              block->pages_offset + offset);
-            } else {
-                read = qemu_get_buffer_at(f, host, size,
-                                          block->pages_offset + offset);
-            }
+            read = qemu_get_buffer_at(f, host, size,
+                                      block->pages_offset + offset);
 
             if (!read) {
                 goto err;
@@ -4031,7 +4300,14 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    if (migrate_multifd()) {
+        /* The multifd channels read it until they are synced */
+        block->file_bmap = g_steal_pointer(&bitmap);
+        if (!read_ramblock_mapped_ram(f, block, num_pages, block->file_bmap,
+                                      errp)) {
+            return;
+        }
+    } else if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
         return;
     }
 
@@ -4241,7 +4517,12 @@ static int ram_load_precopy(QEMUFile *f)
              * loaded after this sync returns.
              */
             if (migrate_mapped_ram()) {
+                RAMBlock *block;
+
                 multifd_recv_sync_main();
+                RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                    g_clear_pointer(&block->file_bmap, g_free);
+                }
             }
             break;
 
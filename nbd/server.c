@@ -28,6 +28,7 @@
 #include "nbd-internal.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/host-utils.h"
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
@@ -42,6 +43,16 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * With zero-copy sends, read payloads of at least NBD_ZERO_COPY_MIN_SIZE
+ * bytes are handed to the kernel without copying.  Their buffers are
+ * mappings of their own, see nbd_zero_copy_get().  The completions are
+ * reaped whenever NBD_ZERO_COPY_MAX_PENDING bytes have accumulated; the
+ * buffers sent until then are kept for reuse, up to the same amount.
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (16 * KiB)
+#define NBD_ZERO_COPY_MAX_PENDING (64 * MiB)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -78,13 +89,23 @@ static int system_errno_to_nbd_errno(int err)
 /* Definitions for opaque data types */
 
 typedef struct NBDRequestData NBDRequestData;
+typedef struct NBDZeroCopyBuffer NBDZeroCopyBuffer;
 
 struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
+    NBDZeroCopyBuffer *zero_copy_buf; /* non-NULL if data is from there */
     bool complete;
 };
 
+struct NBDZeroCopyBuffer {
+    void *data;
+    size_t size;
+    QSLIST_ENTRY(NBDZeroCopyBuffer) next;
+};
+
+typedef QSLIST_HEAD(, NBDZeroCopyBuffer) NBDZeroCopyBufferList;
+
 struct NBDExport {
     BlockExport common;
 
@@ -101,6 +122,8 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -140,6 +163,14 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    bool zero_copy; /* Send large read payloads with MSG_ZEROCOPY */
+    uint64_t zero_copy_pending; /* protected by send_lock */
+    /* Buffers that may still be in use by the kernel, protected by lock */
+    NBDZeroCopyBufferList zero_copy_sent;
+    /* Buffers whose sends have completed, protected by lock */
+    NBDZeroCopyBufferList zero_copy_free;
+    uint64_t zero_copy_free_bytes; /* protected by lock */
+
     bool read_yielding; /* protected by lock */
     bool quiescing; /* protected by lock */
 
@@ -1560,6 +1591,94 @@ void nbd_client_get(NBDClient *client)
     qatomic_inc(&client->refcount);
 }
 
+/*
+ * Buffers for zero-copy sends are anonymous mappings of their own.  The
+ * kernel holds references to the pages it has yet to send, so unmapping a
+ * buffer never lets its memory be reused before the send has completed, even
+ * if the send failed half-way or the client went away.
+ *
+ * Mapping and unmapping a buffer for every request costs more than the copy
+ * it saves for all but the largest reads, so buffers are recycled: once
+ * sent, they wait on client->zero_copy_sent until nbd_zero_copy_reap() has
+ * seen their completion, and are then reused for requests of the same
+ * rounded-up size.
+ */
+static void nbd_zero_copy_free(NBDZeroCopyBuffer *buf)
+{
+#ifdef CONFIG_POSIX
+    munmap(buf->data, buf->size);
+#else
+    g_assert_not_reached();
+#endif
+    g_free(buf);
+}
+
+static void nbd_zero_copy_drop(NBDZeroCopyBufferList *head)
+{
+    NBDZeroCopyBuffer *buf;
+
+    while ((buf = QSLIST_FIRST(head))) {
+        QSLIST_REMOVE_HEAD(head, next);
+        nbd_zero_copy_free(buf);
+    }
+}
+
+static NBDZeroCopyBuffer *nbd_zero_copy_get(NBDClient *client, size_t len)
+{
+    size_t size = pow2ceil(len);
+    NBDZeroCopyBuffer *buf;
+    void *data;
+
+    WITH_QEMU_LOCK_GUARD(&client->lock) {
+        QSLIST_FOREACH(buf, &client->zero_copy_free, next) {
+            if (buf->size == size) {
+                QSLIST_REMOVE(&client->zero_copy_free, buf, NBDZeroCopyBuffer,
+                              next);
+                client->zero_copy_free_bytes -= size;
+                return buf;
+            }
+        }
+    }
+
+#ifdef CONFIG_POSIX
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+#else
+    g_assert_not_reached();
+#endif
+
+    buf = g_new(NBDZeroCopyBuffer, 1);
+    *buf = (NBDZeroCopyBuffer) {
+        .data = data,
+        .size = size,
+    };
+    return buf;
+}
+
+/*
+ * Called after a flush of the channel: all buffers put so far were sent
+ * before it, so the kernel is done with them.  Must be called with
+ * client->lock held.
+ */
+static void nbd_zero_copy_recycle(NBDClient *client)
+{
+    NBDZeroCopyBuffer *buf;
+
+    while ((buf = QSLIST_FIRST(&client->zero_copy_sent))) {
+        QSLIST_REMOVE_HEAD(&client->zero_copy_sent, next);
+        if (client->zero_copy_free_bytes + buf->size >
+            NBD_ZERO_COPY_MAX_PENDING) {
+            nbd_zero_copy_free(buf);
+            continue;
+        }
+        QSLIST_INSERT_HEAD(&client->zero_copy_free, buf, next);
+        client->zero_copy_free_bytes += buf->size;
+    }
+}
+
 void nbd_client_put(NBDClient *client)
 {
     assert(qemu_in_main_thread());
@@ -1581,6 +1700,8 @@ void nbd_client_put(NBDClient *client)
             blk_exp_unref(&client->exp->common);
         }
         g_free(client->contexts.bitmaps);
+        nbd_zero_copy_drop(&client->zero_copy_sent);
+        nbd_zero_copy_drop(&client->zero_copy_free);
         qemu_mutex_destroy(&client->lock);
         g_free(client);
     }
@@ -1653,7 +1774,10 @@ static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->zero_copy_buf) {
+        /* The kernel may not be done with it yet, even if the send failed */
+        QSLIST_INSERT_HEAD(&client->zero_copy_sent, req->zero_copy_buf, next);
+    } else if (req->data) {
         qemu_vfree(req->data);
     }
     g_free(req);
@@ -1931,6 +2055,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -2032,8 +2157,18 @@ const BlockExportDriver blk_exp_nbd = {
     .request_shutdown   = nbd_export_request_shutdown,
 };
 
-static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
-                                        unsigned niov, Error **errp)
+static bool nbd_use_zero_copy(NBDClient *client, uint64_t len)
+{
+    return client->zero_copy && len >= NBD_ZERO_COPY_MIN_SIZE;
+}
+
+/*
+ * Send @iov to the client.  With @zero_copy, the last element is a read
+ * payload from nbd_zero_copy_get() that is sent without copying.
+ */
+static int coroutine_fn nbd_co_send_iov_full(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             bool zero_copy, Error **errp)
 {
     int ret;
 
@@ -2041,7 +2176,19 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
-    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (zero_copy) {
+        /* The reply headers live on the stack, they must be copied */
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+        if (ret == 0) {
+            ret = qio_channel_writev_full_all(client->ioc, &iov[niov - 1], 1,
+                                              NULL, 0,
+                                              QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                              errp);
+        }
+    } else {
+        ret = qio_channel_writev_all(client->ioc, iov, niov, errp);
+    }
+    ret = ret < 0 ? -EIO : 0;
 
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
@@ -2049,6 +2196,46 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    return nbd_co_send_iov_full(client, iov, niov, false, errp);
+}
+
+/*
+ * Account for @len bytes sent with zero copy.  Once enough data is pending,
+ * reap the completions of all zero-copy sends so far, so that the socket's
+ * error queue does not grow without bounds.  This only yields; replies of
+ * other requests wait for it, so the client cannot outrun the kernel.
+ */
+static int coroutine_fn nbd_zero_copy_reap(NBDClient *client, uint64_t len,
+                                           Error **errp)
+{
+    int ret = 0;
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->zero_copy_pending += len;
+
+    if (client->zero_copy_pending >= NBD_ZERO_COPY_MAX_PENDING) {
+        trace_nbd_zero_copy_flush(client->zero_copy_pending);
+        ret = qio_channel_flush(client->ioc, errp) < 0 ? -EIO : 0;
+        client->zero_copy_pending = 0;
+
+        /*
+         * Sends only happen under send_lock, so buffers put while flushing
+         * were sent before the flush, too
+         */
+        if (ret == 0) {
+            WITH_QEMU_LOCK_GUARD(&client->lock) {
+                nbd_zero_copy_recycle(client);
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2080,7 +2267,8 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_full(client, iov, 2, nbd_use_zero_copy(client, len),
+                                errp);
 }
 
 /*
@@ -2161,7 +2349,8 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_iov_full(client, iov, 3,
+                                nbd_use_zero_copy(client, size), errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -2761,8 +2950,14 @@ static int coroutine_fn nbd_co_receive_request(NBDRequestData *req,
     }
     if (allocate_buffer) {
         /* READ, WRITE */
-        req->data = blk_try_blockalign(client->exp->common.blk,
-                                       request->len);
+        if (request->type == NBD_CMD_READ &&
+            nbd_use_zero_copy(client, request->len)) {
+            req->zero_copy_buf = nbd_zero_copy_get(client, request->len);
+            req->data = req->zero_copy_buf ? req->zero_copy_buf->data : NULL;
+        } else {
+            req->data = blk_try_blockalign(client->exp->common.blk,
+                                           request->len);
+        }
         if (req->data == NULL) {
             error_setg(errp, "No memory");
             return -ENOMEM;
@@ -3154,6 +3349,12 @@ static coroutine_fn void nbd_trip(void *opaque)
     }
 
     qio_channel_set_cork(client->ioc, false);
+
+    /* Only wait for zero-copy completion once the reply is uncorked */
+    if (ret >= 0 && req->zero_copy_buf) {
+        ret = nbd_zero_copy_reap(client, request.len, &local_err);
+    }
+
     qemu_mutex_lock(&client->lock);
 
     if (ret < 0) {
@@ -3253,6 +3454,16 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
     }
 
     timer_free(handshake_timer);
+
+    /* TLS channels do not support zero copy, so this checks client->ioc */
+    if (client->exp->zero_copy) {
+        client->zero_copy =
+            qio_channel_has_feature(client->ioc,
+                                    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        trace_nbd_co_client_start_zero_copy(client->exp->name,
+                                            client->zero_copy);
+    }
+
     WITH_QEMU_LOCK_GUARD(&client->lock) {
         nbd_client_receive_next_request(client);
     }
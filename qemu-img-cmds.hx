@@ -18,9 +18,9 @@ SRST
 ERST
 
 DEF("bench", img_bench,
-    "bench [-c count] [-d depth] [-f fmt] [--flush-interval=flush_interval] [-i aio] [-n] [--no-drain] [-o offset] [--pattern=pattern] [-q] [-s buffer_size] [-S step_size] [-t cache] [-w] [-U] filename")
+    "bench [-c count] [-d depth] [-f fmt] [--distribution=distribution] [--zipf-theta=theta] [--flush-interval=flush_interval] [-i aio] [--iothreads=num_iothreads] [--latency-histogram=boundaries] [-n] [--no-drain] [-o offset] [--output=ofmt] [--pattern=pattern] [-q] [-s buffer_size] [-S step_size] [-t cache] [-w] [--write-ratio=percentage] [-U] filename")
 SRST
-.. option:: bench [-c COUNT] [-d DEPTH] [-f FMT] [--flush-interval=FLUSH_INTERVAL] [-i AIO] [-n] [--no-drain] [-o OFFSET] [--pattern=PATTERN] [-q] [-s BUFFER_SIZE] [-S STEP_SIZE] [-t CACHE] [-w] [-U] FILENAME
+.. option:: bench [-c COUNT] [-d DEPTH] [-f FMT] [--distribution=DISTRIBUTION] [--zipf-theta=THETA] [--flush-interval=FLUSH_INTERVAL] [-i AIO] [--iothreads=NUM_IOTHREADS] [--latency-histogram=BOUNDARIES] [-n] [--no-drain] [-o OFFSET] [--output=OFMT] [--pattern=PATTERN] [-q] [-s BUFFER_SIZE] [-S STEP_SIZE] [-t CACHE] [-w] [--write-ratio=PERCENTAGE] [-U] FILENAME
 ERST
 
 DEF("bitmap", img_bitmap,
@@ -35,6 +35,12 @@ SRST
 .. option:: check [--object OBJECTDEF] [--image-opts] [-q] [-f FMT] [--output=OFMT] [-r [leaks | all]] [-T SRC_CACHE] [-U] FILENAME
 ERST
 
+DEF("checksum", img_checksum,
+    "checksum [--object objectdef] [--image-opts] [-a algorithm] [-f fmt] [-m num_coroutines] [-T src_cache] [-p] [-U] filename")
+SRST
+.. option:: checksum [--object OBJECTDEF] [--image-opts] [-a ALGORITHM] [-f FMT] [-m NUM_COROUTINES] [-T SRC_CACHE] [-p] [-U] FILENAME
+ERST
+
 DEF("commit", img_commit,
     "commit [--object objectdef] [--image-opts] [-q] [-f fmt] [-t cache] [-b base] [-r rate_limit] [-d] [-p] filename")
 SRST
@@ -42,9 +48,9 @@ SRST
 ERST
 
 DEF("compare", img_compare,
-    "compare [--object objectdef] [--image-opts] [-f fmt] [-F fmt] [-T src_cache] [-p] [-q] [-s] [-U] filename1 filename2")
+    "compare [--object objectdef] [--image-opts] [-f fmt] [-F fmt] [-m num_coroutines] [-T src_cache] [-p] [-q] [-s] [-U] filename1 filename2")
 SRST
-.. option:: compare [--object OBJECTDEF] [--image-opts] [-f FMT] [-F FMT] [-T SRC_CACHE] [-p] [-q] [-s] [-U] FILENAME1 FILENAME2
+.. option:: compare [--object OBJECTDEF] [--image-opts] [-f FMT] [-F FMT] [-m NUM_COROUTINES] [-T SRC_CACHE] [-p] [-q] [-s] [-U] FILENAME1 FILENAME2
 ERST
 
 DEF("convert", img_convert,
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include <getopt.h>
+#include <math.h>
 
 #include "qemu/help-texts.h"
 #include "qemu/qemu-progress.h"
@@ -34,6 +35,8 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qobject/qjson.h"
 #include "qobject/qdict.h"
+#include "qobject/qlist.h"
+#include "qobject/qnum.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -44,12 +47,14 @@
 #include "qemu/sockets.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
 #include "qom/object_interfaces.h"
 #include "system/block-backend.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/dirty-bitmap.h"
 #include "block/qapi.h"
+#include "crypto/hash.h"
 #include "crypto/init.h"
 #include "trace/control.h"
 #include "qemu/throttle.h"
@@ -86,6 +91,11 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_DISTRIBUTION = 278,
+    OPTION_ZIPF_THETA = 279,
+    OPTION_WRITE_RATIO = 280,
+    OPTION_IOTHREADS = 281,
+    OPTION_LATENCY_HISTOGRAM = 282,
 };
 
 typedef enum OutputFormat {
@@ -1155,6 +1165,10 @@ static int64_t find_nonzero(const uint8_t *buf, int64_t n)
     int64_t i;
     int64_t end = QEMU_ALIGN_DOWN(n, BDRV_SECTOR_SIZE);
 
+    if (buffer_is_zero(buf, n)) {
+        return -1;
+    }
+
     for (i = 0; i < end; i += BDRV_SECTOR_SIZE) {
         if (!buffer_is_zero(buf + i, BDRV_SECTOR_SIZE)) {
             return i;
@@ -1273,6 +1287,37 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Compressed clusters need to be written as a whole.  Returns whether the
+ * first cluster of the buffer contains non-zero data and sets *pnum to the
+ * number of sectors in the run of clusters with the same state.  The last
+ * cluster may be short at the end of the image.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    bool is_zero;
+    int i;
+
+    if (n <= 0) {
+        *pnum = 0;
+        return 0;
+    }
+
+    is_zero = buffer_is_zero(buf, MIN(n, cluster_sectors) * BDRV_SECTOR_SIZE);
+    for (i = cluster_sectors; i < n; i += cluster_sectors) {
+        int len = MIN(n - i, cluster_sectors);
+
+        if (is_zero != buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                      len * BDRV_SECTOR_SIZE)) {
+            break;
+        }
+    }
+
+    *pnum = MIN(i, n);
+    return !is_zero;
+}
+
 /*
  * Compares two buffers chunk by chunk, where @chsize is the chunk size.
  * If @chsize is 0, default chunk size of BDRV_SECTOR_SIZE is used.
@@ -1309,43 +1354,227 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 }
 
 #define IO_BUF_SIZE (2 * MiB)
+#define MAX_COROUTINES 16
 
 /*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
- *
- * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
- * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
- *
- * @param blk:  BlockBackend for the image
- * @param offset: Starting offset to check
- * @param bytes: Number of bytes to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * Returns the offset of the first sector in which @buf1 and @buf2 differ,
+ * or -1 if they are equal.  Equal buffers are the common case, so check
+ * them with a single memcmp() over the whole buffer, which libc vectorizes,
+ * before falling back to a per-sector comparison.
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int64_t find_mismatch(const uint8_t *buf1, const uint8_t *buf2,
+                             int64_t bytes)
 {
-    int ret = 0;
-    int64_t idx;
+    int64_t pnum;
+
+    if (!memcmp(buf1, buf2, bytes)) {
+        return -1;
+    }
+    return compare_buffers(buf1, buf2, bytes, 0, &pnum) ? 0 : pnum;
+}
+
+enum ImgCompareAction {
+    COMPARE_SKIP,
+    COMPARE_DATA,
+    COMPARE_EMPTY1, /* only allocated in the first image */
+    COMPARE_EMPTY2, /* only allocated in the second image */
+};
+
+typedef struct ImgCompareState {
+    BlockBackend *blk[2];
+    const char *filename[2];
+    int64_t size[2];
+    int64_t offset;
+    int64_t end;
+    int64_t progress_base;
+    bool strict;
+    long num_coroutines;
+    int running_coroutines;
+    CoMutex lock;
+    /* lowest offset at which the images differ, INT64_MAX if none */
+    int64_t mismatch_offset;
+    bool status_mismatch;
+    int ret;
+} ImgCompareState;
+
+/*
+ * Requests are started in order of their offset and no request is started
+ * past a known mismatch, so the lowest mismatch found once all requests
+ * have completed is the first one in the images.
+ */
+static void compare_set_mismatch(ImgCompareState *s, int64_t offset,
+                                 bool status_mismatch)
+{
+    if (offset < s->mismatch_offset) {
+        s->mismatch_offset = offset;
+        s->status_mismatch = status_mismatch;
+    }
+}
 
-    ret = blk_pread(blk, offset, bytes, buffer, 0);
+/*
+ * Decides how the range starting at @offset is compared and returns the
+ * number of bytes for which this holds, or -1 on error.  An image reads as
+ * zeroes past its end.
+ */
+static int64_t coroutine_fn GRAPH_RDLOCK
+compare_co_iteration(ImgCompareState *s, int64_t offset,
+                     enum ImgCompareAction *action)
+{
+    int status[2];
+    bool allocated[2];
+    int64_t chunk = s->end - offset;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        int64_t pnum;
+
+        if (offset >= s->size[i]) {
+            status[i] = BDRV_BLOCK_ZERO;
+            allocated[i] = false;
+            continue;
+        }
+
+        status[i] = bdrv_co_block_status_above(blk_bs(s->blk[i]), NULL,
+                                               offset, s->size[i] - offset,
+                                               &pnum, NULL, NULL);
+        if (status[i] < 0) {
+            error_report("Sector allocation test failed for %s",
+                         s->filename[i]);
+            return -1;
+        }
+        allocated[i] = status[i] & BDRV_BLOCK_ALLOCATED;
+
+        assert(pnum);
+        chunk = MIN(chunk, pnum);
+    }
+
+    if (s->strict && status[0] != status[1]) {
+        compare_set_mismatch(s, offset, true);
+        *action = COMPARE_SKIP;
+    } else if ((status[0] & BDRV_BLOCK_ZERO) &&
+               (status[1] & BDRV_BLOCK_ZERO)) {
+        *action = COMPARE_SKIP;
+    } else if (allocated[0] == allocated[1]) {
+        *action = allocated[0] ? COMPARE_DATA : COMPARE_SKIP;
+    } else {
+        *action = allocated[0] ? COMPARE_EMPTY1 : COMPARE_EMPTY2;
+    }
+
+    if (*action != COMPARE_SKIP) {
+        chunk = MIN(chunk, IO_BUF_SIZE);
+    }
+    return chunk;
+}
+
+static int coroutine_fn compare_co_read(ImgCompareState *s, int i,
+                                        int64_t offset, int64_t bytes,
+                                        uint8_t *buf)
+{
+    int ret;
+
+    ret = blk_co_pread(s->blk[i], offset, bytes, buf, 0);
     if (ret < 0) {
         error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
-        return 4;
+                     offset, s->filename[i], strerror(-ret));
     }
-    idx = find_nonzero(buffer, bytes);
-    if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
-        return 1;
+    return ret;
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk[0], IO_BUF_SIZE);
+    buf2 = blk_blockalign(s->blk[1], IO_BUF_SIZE);
+
+    while (1) {
+        enum ImgCompareAction action;
+        int64_t offset, chunk, idx = -1;
+        int ret = 0;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->offset >= s->end ||
+            s->offset >= s->mismatch_offset) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+        WITH_GRAPH_RDLOCK_GUARD() {
+            chunk = compare_co_iteration(s, offset, &action);
+        }
+        if (chunk < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = 3;
+            break;
+        }
+        /* other coroutines can already continue beyond this request */
+        s->offset += chunk;
+        qemu_co_mutex_unlock(&s->lock);
+
+        switch (action) {
+        case COMPARE_SKIP:
+            break;
+        case COMPARE_DATA:
+            ret = compare_co_read(s, 0, offset, chunk, buf1);
+            if (ret >= 0) {
+                ret = compare_co_read(s, 1, offset, chunk, buf2);
+            }
+            if (ret >= 0) {
+                idx = find_mismatch(buf1, buf2, chunk);
+            }
+            break;
+        case COMPARE_EMPTY1:
+        case COMPARE_EMPTY2:
+            ret = compare_co_read(s, action == COMPARE_EMPTY1 ? 0 : 1,
+                                  offset, chunk, buf1);
+            if (ret >= 0) {
+                idx = find_nonzero(buf1, chunk);
+            }
+            break;
+        }
+
+        if (ret < 0) {
+            s->ret = 4;
+            break;
+        }
+        if (idx >= 0) {
+            compare_set_mismatch(s, offset + idx, false);
+        }
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
     }
 
-    return 0;
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+/*
+ * Compares the range from @offset to @end of both images.  Returns 0 if
+ * the comparison could be completed, in which case s->mismatch_offset
+ * tells whether the images differ, or the exit status for the error.
+ */
+static int compare_run(ImgCompareState *s, int64_t offset, int64_t end)
+{
+    int i;
+
+    s->offset = offset;
+    s->end = end;
+    s->ret = -EINPROGRESS;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare, s));
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+
+    return s->ret;
 }
 
 /*
@@ -1359,22 +1588,18 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
     int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
     int c;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1385,7 +1610,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:m:T:pqsU",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1406,6 +1631,13 @@ static int img_compare(int argc, char **argv)
         case 'F':
             fmt2 = optarg;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_exit("Invalid number of coroutines. Allowed number of"
+                           " coroutines is between 1 and %d", MAX_COROUTINES);
+            }
+            break;
         case 'T':
             cache = optarg;
             break;
@@ -1478,11 +1710,7 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
 
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1508,137 +1736,337 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
+    s = (ImgCompareState) {
+        .blk                = { blk1, blk2 },
+        .filename           = { filename1, filename2 },
+        .size               = { total_size1, total_size2 },
+        .progress_base      = progress_base,
+        .strict             = strict,
+        .num_coroutines     = num_coroutines,
+        .mismatch_offset    = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
+
+    ret = compare_run(&s, 0, total_size);
+    if (ret) {
+        goto out;
+    }
 
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
+    if (s.mismatch_offset == INT64_MAX && total_size1 != total_size2) {
+        /* Past the end of the smaller image, only the larger one is read */
+        qprintf(quiet, "Warning: Image size mismatch!\n");
+        ret = compare_run(&s, total_size, progress_base);
+        if (ret) {
             goto out;
         }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+    }
 
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
+    if (s.mismatch_offset != INT64_MAX) {
+        if (s.status_mismatch) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s.mismatch_offset);
+        } else {
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s.mismatch_offset);
         }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+        ret = 1;
+        goto out;
+    }
+
+    qprintf(quiet, "Images are identical.\n");
+    ret = 0;
 
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
+out:
+    blk_unref(blk2);
+out2:
+    blk_unref(blk1);
+out3:
+    qemu_progress_end();
+    return ret;
+}
 
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
+typedef struct ImgChecksumState {
+    BlockBackend *blk;
+    const char *filename;
+    QCryptoHash *hash;
+    uint8_t *zero_buf;
+    int64_t total_size;
+    int64_t offset;
+    int64_t hash_offset;
+    long num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_offset[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgChecksumState;
+
+static int checksum_update(ImgChecksumState *s, const uint8_t *buf,
+                           int64_t bytes)
+{
+    Error *local_err = NULL;
+
+    while (bytes > 0) {
+        int64_t len = buf ? bytes : MIN(bytes, IO_BUF_SIZE);
+
+        if (qcrypto_hash_update(s->hash, (const char *)(buf ?: s->zero_buf),
+                                len, &local_err) < 0) {
+            error_report_err(local_err);
+            return -EIO;
+        }
+        bytes -= len;
+    }
+    return 0;
+}
+
+static void coroutine_fn checksum_co_do_checksum(void *opaque)
+{
+    ImgChecksumState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->blk, IO_BUF_SIZE);
+
+    while (1) {
+        int64_t offset, bytes;
+        bool zero;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->offset >= s->total_size) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+        WITH_GRAPH_RDLOCK_GUARD() {
+            ret = bdrv_co_block_status_above(blk_bs(s->blk), NULL, offset,
+                                             s->total_size - offset, &bytes,
+                                             NULL, NULL);
+        }
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("Sector allocation test failed for %s",
+                         s->filename);
+            s->ret = ret;
+            break;
+        }
+        /* zeroes are hashed without reading them */
+        zero = ret & BDRV_BLOCK_ZERO;
+        if (!zero) {
+            bytes = MIN(bytes, IO_BUF_SIZE);
+        }
+        /* other coroutines can already continue reading beyond this */
+        s->offset += bytes;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (!zero) {
+            ret = blk_co_pread(s->blk, offset, bytes, buf, 0);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64
+                             " of %s: %s", offset, s->filename,
+                             strerror(-ret));
+                s->ret = ret;
             }
         }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, chunk, buf1, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, chunk, buf2, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, 0, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
+        /* the digest depends on the order of the data */
+        while (s->hash_offset != offset && s->ret == -EINPROGRESS) {
+            s->wait_offset[index] = offset;
+            qemu_coroutine_yield();
+        }
+        s->wait_offset[index] = -1;
+
+        if (s->ret == -EINPROGRESS) {
+            ret = checksum_update(s, zero ? NULL : buf, bytes);
+            if (ret < 0) {
+                s->ret = ret;
             }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
+        }
+
+        /* reenter the coroutine that might wait for this hash update */
+        s->hash_offset = offset + bytes;
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_offset[i] == s->hash_offset) {
+                /* see convert_co_do_copy() for why this cannot recurse */
+                qemu_coroutine_enter(s->co[i]);
+                break;
             }
-            if (ret) {
-                goto out;
+        }
+        qemu_progress_print(100.0 * s->hash_offset / s->total_size, 0);
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+/*
+ * Prints a digest of the guest visible content of an image, which unlike
+ * a digest of the image file does not depend on the image format or on
+ * its allocation.  Reads are issued in parallel, while the data is hashed
+ * in order.
+ */
+static int img_checksum(int argc, char **argv)
+{
+    const char *fmt = NULL, *cache = BDRV_DEFAULT_CACHE, *filename;
+    QCryptoHashAlgo alg = QCRYPTO_HASH_ALGO_SHA256;
+    BlockBackend *blk;
+    bool progress = false, image_opts = false, force_share = false;
+    bool writethrough;
+    int flags = 0;
+    long num_coroutines = 8;
+    int64_t total_size;
+    char *digest = NULL;
+    Error *local_err = NULL;
+    ImgChecksumState s;
+    int c, i, ret;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"force-share", no_argument, 0, 'U'},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, ":a:hf:m:pT:U",
+                        long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case ':':
+            missing_argument(argv[optind - 1]);
+            break;
+        case '?':
+            unrecognized_option(argv[optind - 1]);
+            break;
+        case 'h':
+            help();
+            break;
+        case 'a':
+            ret = qapi_enum_parse(&QCryptoHashAlgo_lookup, optarg, -1, NULL);
+            if (ret < 0 || !qcrypto_hash_supports(ret)) {
+                error_report("Unsupported hash algorithm '%s'", optarg);
+                return 1;
+            }
+            alg = ret;
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 1;
             }
+            break;
+        case 'p':
+            progress = true;
+            break;
+        case 'T':
+            cache = optarg;
+            break;
+        case 'U':
+            force_share = true;
+            break;
+        case OPTION_OBJECT:
+            user_creatable_process_cmdline(optarg);
+            break;
+        case OPTION_IMAGE_OPTS:
+            image_opts = true;
+            break;
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
     }
 
-    if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[optind];
+
+    ret = bdrv_parse_cache_mode(cache, &flags, &writethrough);
+    if (ret < 0) {
+        error_report("Invalid source cache option: %s", cache);
+        return 1;
+    }
+
+    blk = img_open(image_opts, filename, fmt, flags, writethrough, false,
+                   force_share);
+    if (!blk) {
+        return 1;
+    }
+
+    s = (ImgChecksumState) {
+        .blk                = blk,
+        .filename           = filename,
+        .num_coroutines     = num_coroutines,
+        .ret                = -EINPROGRESS,
+    };
+
+    total_size = blk_getlength(blk);
+    if (total_size < 0) {
+        error_report("Can't get size of %s: %s",
+                     filename, strerror(-total_size));
+        ret = -1;
+        goto out;
+    }
+    s.total_size = total_size;
+
+    s.hash = qcrypto_hash_new(alg, &local_err);
+    if (!s.hash) {
+        error_report_err(local_err);
+        ret = -1;
+        goto out;
+    }
+    s.zero_buf = g_malloc0(IO_BUF_SIZE);
+
+    qemu_progress_init(progress, 1.0);
+    qemu_progress_print(0, 100);
 
-        qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
-        } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < s.num_coroutines; i++) {
+        s.co[i] = qemu_coroutine_create(checksum_co_do_checksum, &s);
+        s.wait_offset[i] = -1;
+        qemu_coroutine_enter(s.co[i]);
+    }
 
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
+    qemu_progress_end();
 
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
-        }
+    ret = s.ret;
+    if (ret < 0) {
+        goto out;
     }
 
-    qprintf(quiet, "Images are identical.\n");
-    ret = 0;
+    if (qcrypto_hash_finalize_digest(s.hash, &digest, &local_err) < 0) {
+        error_report_err(local_err);
+        ret = -1;
+        goto out;
+    }
+    printf("%s  %s\n", digest, filename);
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
-    blk_unref(blk2);
-out2:
-    blk_unref(blk1);
-out3:
-    qemu_progress_end();
-    return ret;
+    g_free(digest);
+    g_free(s.zero_buf);
+    qcrypto_hash_free(s.hash);
+    blk_unref(blk);
+    return ret < 0;
 }
 
 /* Convenience wrapper around qmp_block_dirty_bitmap_merge */
@@ -1664,7 +2092,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1682,6 +2109,7 @@ typedef struct ImgConvertState {
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    bool multi_cluster_compressed;
     bool target_is_new;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
@@ -1904,7 +2332,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -2105,14 +2533,20 @@ static int convert_do_copy(ImgConvertState *s)
         bdrv_graph_rdunlock_main_loop();
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only whole
+     * clusters can be copied, and only one at a time unless the target can
+     * compress multiple clusters per request. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->multi_cluster_compressed) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
@@ -2776,6 +3210,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.multi_cluster_compressed = bdi.multi_cluster_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
@@ -4412,10 +4847,121 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+typedef enum BenchDistribution {
+    BENCH_SEQUENTIAL,
+    BENCH_RANDOM,
+    BENCH_ZIPF,
+} BenchDistribution;
+
+/*
+ * Zipf distributed ranks in [1, n], drawn with rejection-inversion
+ * sampling (W. Hörmann, G. Derflinger: "Rejection-inversion to generate
+ * variates from monotone discrete distributions").  Unlike the usual
+ * table based generators, this needs neither O(n) setup nor memory, so it
+ * works for any image size.
+ */
+typedef struct BenchZipf {
+    double theta;
+    uint64_t n;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+} BenchZipf;
+
+/* log1p(x) / x, continued to x == 0 */
+static double bench_zipf_helper1(double x)
+{
+    return x ? log1p(x) / x : 1;
+}
+
+/* expm1(x) / x, continued to x == 0 */
+static double bench_zipf_helper2(double x)
+{
+    return x ? expm1(x) / x : 1;
+}
+
+static double bench_zipf_h(BenchZipf *z, double x)
+{
+    return exp(-z->theta * log(x));
+}
+
+static double bench_zipf_h_integral(BenchZipf *z, double x)
+{
+    double log_x = log(x);
+
+    return bench_zipf_helper2((1 - z->theta) * log_x) * log_x;
+}
+
+static double bench_zipf_h_integral_inverse(BenchZipf *z, double x)
+{
+    double t = x * (1 - z->theta);
+
+    if (t < -1) {
+        t = -1;
+    }
+    return exp(bench_zipf_helper1(t) * x);
+}
+
+static void bench_zipf_init(BenchZipf *z, uint64_t n, double theta)
+{
+    z->theta = theta;
+    z->n = n;
+    z->h_integral_x1 = bench_zipf_h_integral(z, 1.5) - 1;
+    z->h_integral_n = bench_zipf_h_integral(z, n + 0.5);
+    z->s = 2 - bench_zipf_h_integral_inverse(z, bench_zipf_h_integral(z, 2.5) -
+                                                bench_zipf_h(z, 2));
+}
+
+/* Returns a zero-based rank, 0 being the most frequent one */
+static uint64_t bench_zipf_sample(BenchZipf *z, GRand *rand)
+{
+    while (1) {
+        double u, x;
+        uint64_t k;
+
+        u = z->h_integral_n +
+            g_rand_double(rand) * (z->h_integral_x1 - z->h_integral_n);
+        x = bench_zipf_h_integral_inverse(z, u);
+        k = x + 0.5;
+        k = MIN(MAX(k, 1), z->n);
+
+        if (k - x <= z->s ||
+            u >= bench_zipf_h_integral(z, k + 0.5) - bench_zipf_h(z, k)) {
+            return k - 1;
+        }
+    }
+}
+
+typedef struct BenchData BenchData;
+
+/*
+ * An AioContext that is polled by a thread of its own.  This is all that
+ * bench needs of an iothread, without pulling in the IOThread object.
+ */
+typedef struct BenchThread {
+    AioContext *ctx;
+    QemuThread thread;
+    bool stopping;
+} BenchThread;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector read_qiov;
+    QEMUIOVector write_qiov;
+    BlockAcctCookie cookie;
+    QSLIST_ENTRY(BenchRequest) next;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
+    BenchThread *thread;
     uint64_t image_size;
-    bool write;
+    int write_ratio;
+    BenchDistribution distribution;
+    BenchZipf zipf;
+    GRand *rand;
+    uint64_t start_offset;
+    uint64_t nr_slots;
     int bufsize;
     int step;
     int nrreq;
@@ -4423,12 +4969,57 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    size_t buf_size;
+    BenchRequest *reqs;
+    QSLIST_HEAD(, BenchRequest) free_reqs;
+    BlockAcctStats stats;
+    int *running;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+};
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset, slot;
+
+    switch (b->distribution) {
+    case BENCH_SEQUENTIAL:
+        offset = b->offset;
+        b->offset += b->step;
+        if (b->image_size <= b->bufsize) {
+            b->offset = 0;
+        } else {
+            b->offset %= b->image_size - b->bufsize;
+        }
+        return offset;
+    case BENCH_RANDOM:
+        slot = g_rand_double(b->rand) * b->nr_slots;
+        break;
+    case BENCH_ZIPF:
+        slot = bench_zipf_sample(&b->zipf, b->rand);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    return b->start_offset + MIN(slot, b->nr_slots - 1) * b->step;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_request_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret >= 0) {
+        block_acct_done(&b->stats, &req->cookie);
+    }
+    QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+    bench_cb(b, ret);
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4458,6 +5049,12 @@ static void bench_cb(void *opaque, int ret)
         b->n--;
         b->in_flight--;
 
+        if (!b->n) {
+            /* Let the main loop know that this queue is done */
+            qatomic_dec(b->running);
+            qemu_notify_event();
+        }
+
         /* Time for flush? Drain queue if requested, then flush */
         if (b->flush_interval && remaining % b->flush_interval == 0) {
             if (!b->in_flight || !b->drain_on_flush) {
@@ -4483,22 +5080,24 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        BenchRequest *req = QSLIST_FIRST(&b->free_reqs);
+        int64_t offset = bench_next_offset(b);
+        bool is_write = g_rand_int_range(b->rand, 0, 100) < b->write_ratio;
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
          * and b->offset is ready for the next submission.
          */
+        QSLIST_REMOVE_HEAD(&b->free_reqs, next);
         b->in_flight++;
-        b->offset += b->step;
-        if (b->image_size <= b->bufsize) {
-            b->offset = 0;
-        } else {
-            b->offset %= b->image_size - b->bufsize;
-        }
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        block_acct_start(&b->stats, &req->cookie, b->bufsize,
+                         is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+        if (is_write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->write_qiov, 0,
+                                  bench_request_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->read_qiov, 0,
+                                 bench_request_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4507,13 +5106,206 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static void bench_start_bh(void *opaque)
+{
+    bench_cb(opaque, 0);
+}
+
+static void *bench_thread_run(void *opaque)
+{
+    BenchThread *t = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(t->ctx);
+
+    while (!qatomic_read(&t->stopping)) {
+        aio_poll(t->ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static BenchThread *bench_thread_new(void)
+{
+    BenchThread *t = g_new0(BenchThread, 1);
+
+    t->ctx = aio_context_new(&error_fatal);
+    qemu_thread_create(&t->thread, "bench-iothread", bench_thread_run, t,
+                       QEMU_THREAD_JOINABLE);
+    return t;
+}
+
+static void bench_thread_stop_bh(void *opaque)
+{
+    BenchThread *t = opaque;
+
+    qatomic_set(&t->stopping, true);
+}
+
+static void bench_thread_destroy(BenchThread *t)
+{
+    aio_bh_schedule_oneshot(t->ctx, bench_thread_stop_bh, t);
+    qemu_thread_join(&t->thread);
+    aio_context_unref(t->ctx);
+    g_free(t);
+}
+
+static void bench_data_init(BenchData *b, int pattern, uint64List *histogram)
+{
+    size_t region = (size_t)b->nrreq * b->bufsize;
+    bool mixed = b->write_ratio > 0 && b->write_ratio < 100;
+    int i;
+
+    /* In mixed workloads, reads use their own buffers to keep the pattern */
+    b->buf_size = mixed ? 2 * region : region;
+    b->buf = blk_blockalign(b->blk, b->buf_size);
+    memset(b->buf, pattern, b->buf_size);
+
+    blk_register_buf(b->blk, b->buf, b->buf_size, &error_fatal);
+
+    b->reqs = g_new0(BenchRequest, b->nrreq);
+    for (i = 0; i < b->nrreq; i++) {
+        BenchRequest *req = &b->reqs[i];
+        uint8_t *buf = b->buf + i * b->bufsize;
+
+        req->b = b;
+        qemu_iovec_init_buf(&req->write_qiov, buf, b->bufsize);
+        qemu_iovec_init_buf(&req->read_qiov, mixed ? buf + region : buf,
+                            b->bufsize);
+        QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+    }
+
+    block_acct_init(&b->stats);
+    if (histogram) {
+        block_latency_histogram_set(&b->stats, BLOCK_ACCT_READ, histogram);
+        block_latency_histogram_set(&b->stats, BLOCK_ACCT_WRITE, histogram);
+    }
+}
+
+static void bench_data_cleanup(BenchData *b)
+{
+    if (!b->buf) {
+        return;
+    }
+
+    blk_unregister_buf(b->blk, b->buf, b->buf_size);
+    qemu_vfree(b->buf);
+    g_free(b->reqs);
+    g_rand_free(b->rand);
+    block_latency_histograms_clear(&b->stats);
+    block_acct_cleanup(&b->stats);
+}
+
+/* Adds the read and write statistics of @src to @dst */
+static void bench_merge_stats(BlockAcctStats *dst, BlockAcctStats *src)
+{
+    enum BlockAcctType types[] = { BLOCK_ACCT_READ, BLOCK_ACCT_WRITE };
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        BlockLatencyHistogram *hist = &dst->latency_histogram[types[i]];
+
+        dst->nr_ops[types[i]] += src->nr_ops[types[i]];
+        dst->nr_bytes[types[i]] += src->nr_bytes[types[i]];
+        dst->total_time_ns[types[i]] += src->total_time_ns[types[i]];
+        for (j = 0; hist->bins && j < hist->nbins; j++) {
+            hist->bins[j] += src->latency_histogram[types[i]].bins[j];
+        }
+    }
+}
+
+static QDict *bench_type_to_qdict(BlockAcctStats *stats,
+                                  enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    QDict *dict = qdict_new();
+    uint64_t ops = stats->nr_ops[type];
+    int i;
+
+    qdict_put_int(dict, "requests", ops);
+    qdict_put_int(dict, "bytes", stats->nr_bytes[type]);
+    qdict_put_int(dict, "average-latency-ns",
+                  ops ? stats->total_time_ns[type] / ops : 0);
+
+    if (hist->bins) {
+        QDict *hdict = qdict_new();
+        QList *boundaries = qlist_new();
+        QList *bins = qlist_new();
+
+        for (i = 0; i < hist->nbins - 1; i++) {
+            qlist_append_int(boundaries, hist->boundaries[i]);
+        }
+        for (i = 0; i < hist->nbins; i++) {
+            qlist_append_int(bins, hist->bins[i]);
+        }
+        qdict_put(hdict, "boundaries", boundaries);
+        qdict_put(hdict, "bins", bins);
+        qdict_put(dict, "latency-histogram", hdict);
+    }
+
+    return dict;
+}
+
+static void bench_dump_json(BlockAcctStats *stats, double seconds)
+{
+    uint64_t ops = stats->nr_ops[BLOCK_ACCT_READ] +
+                   stats->nr_ops[BLOCK_ACCT_WRITE];
+    uint64_t bytes = stats->nr_bytes[BLOCK_ACCT_READ] +
+                     stats->nr_bytes[BLOCK_ACCT_WRITE];
+    QDict *dict = qdict_new();
+    GString *str;
+
+    qdict_put(dict, "seconds", qnum_from_double(seconds));
+    qdict_put_int(dict, "requests", ops);
+    qdict_put(dict, "iops", qnum_from_double(ops / seconds));
+    qdict_put(dict, "bytes-per-second", qnum_from_double(bytes / seconds));
+    qdict_put(dict, "read", bench_type_to_qdict(stats, BLOCK_ACCT_READ));
+    qdict_put(dict, "write", bench_type_to_qdict(stats, BLOCK_ACCT_WRITE));
+
+    str = qobject_to_json_pretty(QOBJECT(dict), true);
+    printf("%s\n", str->str);
+    g_string_free(str, true);
+    qobject_unref(dict);
+}
+
+static void bench_dump_human(BlockAcctStats *stats)
+{
+    enum BlockAcctType types[] = { BLOCK_ACCT_READ, BLOCK_ACCT_WRITE };
+    const char *names[] = { "Read", "Write" };
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[types[i]];
+        uint64_t ops = stats->nr_ops[types[i]];
+
+        if (!ops) {
+            continue;
+        }
+        printf("%s: %" PRIu64 " requests, average latency %.3f us\n",
+               names[i], ops, stats->total_time_ns[types[i]] / ops / 1000.0);
+
+        for (j = 0; hist->bins && j < hist->nbins; j++) {
+            printf("  [%" PRIu64 ", ", j ? hist->boundaries[j - 1] : 0);
+            if (j < hist->nbins - 1) {
+                printf("%" PRIu64 ")", hist->boundaries[j]);
+            } else {
+                printf("+inf)");
+            }
+            printf(" ns: %" PRIu64 "\n", hist->bins[j]);
+        }
+    }
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
     const char *fmt = NULL, *filename;
+    const char *output = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
     bool quiet = false;
     bool image_opts = false;
-    bool is_write = false;
+    int write_ratio = 0;
     int count = 75000;
     int depth = 64;
     int64_t offset = 0;
@@ -4522,23 +5314,36 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    BenchDistribution distribution = BENCH_SEQUENTIAL;
+    double zipf_theta = 0.99;
+    int nr_iothreads = 0;
+    int nr_queues;
+    uint64List *histogram = NULL;
     int64_t image_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData *data = NULL;
+    int running = 0;
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    double seconds;
     int i;
     bool force_share = false;
-    size_t buf_size = 0;
 
     for (;;) {
         static const struct option long_options[] = {
             {"help", no_argument, 0, 'h'},
+            {"distribution", required_argument, 0, OPTION_DISTRIBUTION},
             {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"iothreads", required_argument, 0, OPTION_IOTHREADS},
+            {"latency-histogram", required_argument, 0,
+             OPTION_LATENCY_HISTOGRAM},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"write-ratio", required_argument, 0, OPTION_WRITE_RATIO},
+            {"zipf-theta", required_argument, 0, OPTION_ZIPF_THETA},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4639,8 +5444,7 @@ static int img_bench(int argc, char **argv)
             }
             break;
         case 'w':
-            flags |= BDRV_O_RDWR;
-            is_write = true;
+            write_ratio = 100;
             break;
         case 'U':
             force_share = true;
@@ -4673,6 +5477,73 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        case OPTION_DISTRIBUTION:
+            if (!strcmp(optarg, "sequential")) {
+                distribution = BENCH_SEQUENTIAL;
+            } else if (!strcmp(optarg, "random")) {
+                distribution = BENCH_RANDOM;
+            } else if (!strcmp(optarg, "zipf")) {
+                distribution = BENCH_ZIPF;
+            } else {
+                error_report("Invalid distribution specified");
+                return 1;
+            }
+            break;
+        case OPTION_ZIPF_THETA:
+            if (qemu_strtod(optarg, NULL, &zipf_theta) < 0 ||
+                !(zipf_theta > 0)) {
+                error_report("Invalid zipf theta specified");
+                return 1;
+            }
+            break;
+        case OPTION_WRITE_RATIO:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid write ratio specified");
+                return 1;
+            }
+            write_ratio = res;
+            break;
+        }
+        case OPTION_IOTHREADS:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 64) {
+                error_report("Invalid number of iothreads specified");
+                return 1;
+            }
+            nr_iothreads = res;
+            break;
+        }
+        case OPTION_LATENCY_HISTOGRAM:
+        {
+            g_auto(GStrv) boundaries = g_strsplit(optarg, ",", -1);
+            uint64List **tail = &histogram;
+            uint64_t prev = 0;
+
+            qapi_free_uint64List(histogram);
+            histogram = NULL;
+            for (i = 0; boundaries[i]; i++) {
+                uint64_t val;
+
+                if (qemu_strtou64(boundaries[i], NULL, 0, &val) < 0 ||
+                    val <= prev) {
+                    error_report("Invalid latency histogram boundaries "
+                                 "specified");
+                    ret = -1;
+                    goto out;
+                }
+                QAPI_LIST_APPEND(tail, val);
+                prev = val;
+            }
+            break;
+        }
         }
     }
 
@@ -4681,7 +5552,20 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        ret = -1;
+        goto out;
+    }
+
+    if (write_ratio) {
+        flags |= BDRV_O_RDWR;
+    }
+    if (!write_ratio && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -4705,56 +5589,128 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
-    }
-
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    /*
+     * Without iothreads, a single queue is processed in the main loop.
+     * Otherwise each iothread gets a queue of its own, with its own share
+     * of the requests.  All queues submit to the same BlockBackend, each
+     * from its own AioContext, like a device with an iothread-vq-mapping.
+     */
+    step = step ?: bufsize;
+    nr_queues = MAX(nr_iothreads, 1);
+    data = g_new0(BenchData, nr_queues);
+    for (i = 0; i < nr_queues; i++) {
+        BenchData *b = &data[i];
+        uint64_t range = 0;
+
+        if (image_size > offset + bufsize) {
+            range = image_size - offset - bufsize;
+        }
+
+        /* Sequential queues take turns, each one doing every nth request */
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .bufsize        = bufsize,
+            .step           = step * nr_queues,
+            .nrreq          = depth,
+            .n              = count / nr_queues + (i < count % nr_queues),
+            .offset         = offset + i * step,
+            .write_ratio    = write_ratio,
+            .distribution   = distribution,
+            .start_offset   = offset,
+            .nr_slots       = range / step + 1,
+            .rand           = g_rand_new_with_seed(i),
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .running        = &running,
+        };
+        if (distribution != BENCH_SEQUENTIAL) {
+            b->step = step;
+        }
+        if (distribution == BENCH_ZIPF) {
+            bench_zipf_init(&b->zipf, b->nr_slots, zipf_theta);
+        }
+        bench_data_init(b, pattern, histogram);
 
-    blk_register_buf(blk, data.buf, buf_size, &error_fatal);
+        if (nr_iothreads) {
+            b->thread = bench_thread_new();
+        }
+    }
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+    if (output_format == OFORMAT_HUMAN) {
+        const char *type = write_ratio == 100 ? "write" :
+                           write_ratio ? "mixed" : "read";
+
+        printf("Sending %d %s requests, %d bytes each, %d in parallel ",
+               count, type, (int)bufsize, depth);
+        if (distribution == BENCH_SEQUENTIAL) {
+            printf("(starting at offset %" PRId64 ", step size %d)\n",
+                   offset, (int)step);
+        } else {
+            printf("(%s offsets from %" PRId64 ", alignment %d)\n",
+                   distribution == BENCH_RANDOM ? "random" : "zipf",
+                   offset, (int)step);
+        }
+        if (write_ratio && write_ratio < 100) {
+            printf("%d%% of requests are writes\n", write_ratio);
+        }
+        if (nr_iothreads) {
+            printf("Using %d queues, each in its own iothread\n",
+                   nr_iothreads);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
     }
 
     gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    for (i = 0; i < nr_queues; i++) {
+        if (data[i].n) {
+            running++;
+        }
+    }
+    for (i = 0; i < nr_queues; i++) {
+        if (data[i].thread) {
+            aio_bh_schedule_oneshot(data[i].thread->ctx, bench_start_bh,
+                                    &data[i]);
+        } else {
+            bench_cb(&data[i], 0);
+        }
+    }
 
-    while (data.n > 0) {
+    while (qatomic_read(&running) > 0) {
         main_loop_wait(false);
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    seconds = (t2.tv_sec - t1.tv_sec)
+              + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+
+    for (i = 1; i < nr_queues; i++) {
+        bench_merge_stats(&data[0].stats, &data[i].stats);
+    }
+    if (output_format == OFORMAT_JSON) {
+        bench_dump_json(&data[0].stats, seconds);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", seconds);
+        if ((write_ratio && write_ratio < 100) || histogram) {
+            bench_dump_human(&data[0].stats);
+        }
+    }
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf, buf_size);
+    if (data && nr_iothreads) {
+        /* Flushes may still be in flight and complete in the iothreads */
+        blk_drain(blk);
+    }
+    for (i = 0; data && i < nr_queues; i++) {
+        if (data[i].thread) {
+            bench_thread_destroy(data[i].thread);
+        }
+        bench_data_cleanup(&data[i]);
     }
-    qemu_vfree(data.buf);
+    g_free(data);
+    qapi_free_uint64List(histogram);
     blk_unref(blk);
 
     if (ret) {
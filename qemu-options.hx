@@ -1328,6 +1328,7 @@ DEF("blockdev", HAS_ARG, QEMU_OPTION_blockdev,
     "          [,cache.direct=on|off][,cache.no-flush=on|off]\n"
     "          [,read-only=on|off][,auto-read-only=on|off]\n"
     "          [,force-share=on|off][,detect-zeroes=on|off|unmap]\n"
+    "          [,discard-coalesce-ns=ns]\n"
     "          [,driver specific parameters...]\n"
     "                configure a block backend\n", QEMU_ARCH_ALL)
 SRST
@@ -1415,6 +1416,14 @@ SRST
             choose "unmap" if discard is set to "unmap" to allow a zero
             write to be converted to an ``unmap`` operation.
 
+        ``discard-coalesce-ns=ns``
+            Hold back discard and write zeroes requests for up to ``ns``
+            nanoseconds so that adjacent or overlapping requests can be
+            merged into a single request, up to the maximum request size
+            of the node. This reduces the number of requests that reach
+            the storage when a guest trims its filesystems. The default
+            is 0, which disables merging.
+
     ``Driver-specific options for file``
         This is the protocol-level block driver for accessing regular
         files.
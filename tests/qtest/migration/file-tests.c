@@ -169,6 +169,38 @@ static void test_multifd_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_hook_start_multifd_mapped_ram_sparse(QTestState *from,
+                                                          QTestState *to)
+{
+    /* Pages don't split evenly between an odd number of channels */
+    migrate_set_parameter_int(from, "multifd-channels", 7);
+    migrate_set_parameter_int(to, "multifd-channels", 7);
+
+    return NULL;
+}
+
+static void test_multifd_file_mapped_ram_sparse(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_hook_start_multifd_mapped_ram_sparse,
+        .start = {
+            /*
+             * The guest only writes to its first 100 MiB, so most of
+             * the RAM is zero pages that are missing from the file.
+             */
+            .memory_size = "1G",
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+            .caps[MIGRATION_CAPABILITY_MAPPED_RAM] = true,
+        },
+    };
+
+    test_file_common(&args, true);
+}
+
 static void *migrate_hook_start_multifd_mapped_ram_dio(QTestState *from,
                                                        QTestState *to)
 {
@@ -331,6 +363,8 @@ void migration_test_add_file(MigrationTestEnv *env)
                        test_multifd_file_mapped_ram);
     migration_test_add("/migration/multifd/file/mapped-ram/live",
                        test_multifd_file_mapped_ram_live);
+    migration_test_add("/migration/multifd/file/mapped-ram/sparse",
+                       test_multifd_file_mapped_ram_sparse);
 
 #ifndef _WIN32
     migration_test_add("/migration/multifd/file/mapped-ram/fdset",
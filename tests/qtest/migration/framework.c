@@ -324,6 +324,10 @@ int migrate_start(QTestState **from, QTestState **to, const char *uri,
         g_assert_not_reached();
     }
 
+    if (args->memory_size) {
+        memory_size = args->memory_size;
+    }
+
     if (!getenv("QTEST_LOG") && args->hide_stderr) {
 #ifndef _WIN32
         ignore_stderr = "2>/dev/null";
@@ -118,6 +118,8 @@ typedef struct {
      * size is plugged in.  If omitted, "-m %s" is used.
      */
     const char *memory_backend;
+    /* Guest RAM size; if omitted, a default for the architecture is used */
+    const char *memory_size;
 
     /* Do not connect to target monitor and qtest sockets in qtest_init */
     bool defer_target_connect;
@@ -233,6 +233,45 @@ static void test_precopy_tcp_switchover_ack(void)
     test_precopy_common(&args);
 }
 
+static void *migrate_hook_start_defer_hot_pages(QTestState *from,
+                                                QTestState *to)
+{
+    /*
+     * Don't size the downtime budget from the measured bandwidth: once
+     * migration may converge, all of the pages the guest keeps writing
+     * must fit into it, so that they are deferred.
+     */
+    migrate_set_parameter_int(from, "avail-switchover-bandwidth",
+                              10 * 1000 * 1000 * 1000LL);
+    return NULL;
+}
+
+static void migrate_hook_end_defer_hot_pages(QTestState *from,
+                                             QTestState *to,
+                                             void *opaque)
+{
+    g_assert_cmpint(read_ram_property_int(from, "x-deferred-pages"), >, 0);
+}
+
+static void test_precopy_tcp_defer_hot_pages(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "tcp:127.0.0.1:0",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_X_DEFER_HOT_PAGES] = true,
+        },
+        .start_hook = migrate_hook_start_defer_hot_pages,
+        .end_hook = migrate_hook_end_defer_hot_pages,
+        /*
+         * The guest keeps rewriting its memory, so some pages become hot
+         * and must still arrive intact after the final stage.
+         */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 #ifndef _WIN32
 static void *migrate_hook_start_fd(QTestState *from,
                                    QTestState *to)
@@ -1278,6 +1317,8 @@ void migration_test_add_precopy(MigrationTestEnv *env)
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
+    migration_test_add("/migration/precopy/tcp/plain/defer-hot-pages",
+                       test_precopy_tcp_defer_hot_pages);
 
 #ifndef _WIN32
     migration_test_add("/migration/precopy/fd/tcp",
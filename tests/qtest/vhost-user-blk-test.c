@@ -25,6 +25,12 @@
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
 #define PCI_SLOT_HP             0x06
 
+/* For the multiqueue-iothreads test */
+#define MQ_IOTHREADS            2
+#define MQ_NUM_QUEUES           4
+#define MQ_REQS_PER_QUEUE       8
+#define MQ_REQ_SIZE             (64 * 1024)
+
 typedef struct {
     pid_t pid;
 } QemuStorageDaemonState;
@@ -764,6 +770,126 @@ static void multiqueue(void *obj, void *data, QGuestAllocator *t_alloc)
     qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
 }
 
+/* Add a write request to @vq and return its head, without kicking */
+static uint32_t mq_add_write(QVirtioDevice *dev, QGuestAllocator *t_alloc,
+                             QVirtQueue *vq, uint64_t sector,
+                             uint64_t *req_addr)
+{
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    uint32_t free_head;
+
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc(MQ_REQ_SIZE);
+    memset(req.data, 0x40 + vq->index, MQ_REQ_SIZE);
+
+    *req_addr = virtio_blk_request(t_alloc, dev, &req, MQ_REQ_SIZE);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, *req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, *req_addr + 16, MQ_REQ_SIZE, false, true);
+    qvirtqueue_add(qts, vq, *req_addr + 16 + MQ_REQ_SIZE, 1, true, false);
+
+    return free_head;
+}
+
+/*
+ * The export spreads the virtqueues over iothreads.  Check that requests
+ * are completed on all of them, then reset and unplug the device while
+ * requests are in flight on every virtqueue.  Stopping the device makes the
+ * front-end fetch the vring bases, which the export only answers once all
+ * virtqueues are quiesced.
+ */
+static void multiqueue_iothreads(void *obj, void *data,
+                                 QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev1 = obj;
+    QVirtioPCIDevice *pdev;
+    QVirtioDevice *dev;
+    QTestState *qts = pdev1->pdev->bus->qts;
+    QVirtQueue *vqs[MQ_NUM_QUEUES];
+    uint64_t req_addrs[MQ_NUM_QUEUES][MQ_REQS_PER_QUEUE];
+    uint64_t features;
+    uint32_t free_head;
+    uint8_t status;
+    int i, j;
+
+    if (pdev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("bus pci.0 does not support hotplug");
+        return;
+    }
+
+    qtest_qmp_device_add(qts, "vhost-user-blk-pci", "drv1",
+                         "{'addr': %s, 'chardev': 'char2', 'num-queues': %d}",
+                         stringify(PCI_SLOT_HP) ".0", MQ_NUM_QUEUES);
+
+    pdev = virtio_pci_new(pdev1->pdev->bus,
+                          &(QPCIAddress) {
+                              .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0)
+                          });
+    g_assert_nonnull(pdev);
+    g_assert_cmpint(pdev->vdev.device_type, ==, VIRTIO_ID_BLOCK);
+
+    qos_object_start_hw(&pdev->obj);
+
+    dev = &pdev->vdev;
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vqs[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev);
+
+    /*
+     * One request per virtqueue, each waited for before the next one: the
+     * ISR is shared between the virtqueues.
+     */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        free_head = mq_add_write(dev, t_alloc, vqs[i],
+                                 i * (MQ_REQ_SIZE / 512), &req_addrs[i][0]);
+        qvirtqueue_kick(qts, dev, vqs[i], free_head);
+        qvirtio_wait_used_elem(qts, dev, vqs[i], free_head, NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addrs[i][0] + 16 + MQ_REQ_SIZE);
+        g_assert_cmpint(status, ==, 0);
+        guest_free(t_alloc, req_addrs[i][0]);
+    }
+
+    /* Fill all virtqueues and stop the device without waiting */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        for (j = 0; j < MQ_REQS_PER_QUEUE; j++) {
+            uint64_t sector = (i * MQ_REQS_PER_QUEUE + j) *
+                              (MQ_REQ_SIZE / 512);
+
+            free_head = mq_add_write(dev, t_alloc, vqs[i], sector,
+                                     &req_addrs[i][j]);
+            qvirtqueue_kick(qts, dev, vqs[i], free_head);
+        }
+    }
+    qvirtio_reset(dev);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        for (j = 0; j < MQ_REQS_PER_QUEUE; j++) {
+            guest_free(t_alloc, req_addrs[i][j]);
+        }
+        qvirtqueue_cleanup(dev->bus, vqs[i], t_alloc);
+    }
+    qvirtio_pci_device_disable(pdev);
+    qos_object_destroy(&pdev->obj);
+
+    /* The export must still be able to shut down cleanly afterwards */
+    qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -893,10 +1019,10 @@ static void quit_storage_daemon(void *data)
 }
 
 static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
-                                 int num_queues)
+                                 int num_queues, int num_iothreads)
 {
     const char *vhost_user_blk_bin = qtest_qemu_storage_daemon_binary();
-    int i;
+    int i, j;
     gchar *img_path;
     GString *storage_daemon_command = g_string_new(NULL);
     QemuStorageDaemonState *qsd;
@@ -909,6 +1035,11 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
             " -object memory-backend-shm,id=mem,size=256M "
             " -M memory-backend=mem -m 256M ");
 
+    for (i = 0; i < num_iothreads; i++) {
+        g_string_append_printf(storage_daemon_command,
+                               "--object iothread,id=iothread%d ", i);
+    }
+
     for (i = 0; i < vus_instances; i++) {
         int fd;
         char *sock_path = create_listen_socket(&fd);
@@ -918,8 +1049,13 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
         g_string_append_printf(storage_daemon_command,
             "--blockdev driver=file,node-name=disk%d,filename=%s "
             "--export type=vhost-user-blk,id=disk%d,addr.type=fd,addr.str=%d,"
-            "node-name=disk%i,writable=on,num-queues=%d ",
+            "node-name=disk%i,writable=on,num-queues=%d",
             i, img_path, i, fd, i, num_queues);
+        for (j = 0; j < num_iothreads; j++) {
+            g_string_append_printf(storage_daemon_command,
+                                   ",iothreads.%d=iothread%d", j, j);
+        }
+        g_string_append_c(storage_daemon_command, ' ');
 
         g_string_append_printf(cmd_line, "-chardev socket,id=char%d,path=%s ",
                                i + 1, sock_path);
@@ -953,7 +1089,7 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
 
 static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 1, 1);
+    start_vhost_user_blk(cmd_line, 1, 1, 0);
     return arg;
 }
 
@@ -967,13 +1103,19 @@ static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 static void *vhost_user_blk_hotplug_test_setup(GString *cmd_line, void *arg)
 {
     /* "-chardev socket,id=char2" is used for pci_hotplug*/
-    start_vhost_user_blk(cmd_line, 2, 1);
+    start_vhost_user_blk(cmd_line, 2, 1, 0);
     return arg;
 }
 
 static void *vhost_user_blk_multiqueue_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 2, 8);
+    start_vhost_user_blk(cmd_line, 2, 8, 0);
+    return arg;
+}
+
+static void *vhost_user_blk_iothreads_test_setup(GString *cmd_line, void *arg)
+{
+    start_vhost_user_blk(cmd_line, 2, MQ_NUM_QUEUES, MQ_IOTHREADS);
     return arg;
 }
 
@@ -1009,6 +1151,10 @@ static void register_vhost_user_blk_test(void)
 
     opts.before = vhost_user_blk_multiqueue_test_setup;
     qos_add_test("multiqueue", "vhost-user-blk-pci", multiqueue, &opts);
+
+    opts.before = vhost_user_blk_iothreads_test_setup;
+    qos_add_test("multiqueue-iothreads", "vhost-user-blk-pci",
+                 multiqueue_iothreads, &opts);
 }
 
 libqos_init(register_vhost_user_blk_test);
@@ -0,0 +1,80 @@
+/*
+ * QEMU crc32c test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "qemu/iov.h"
+
+#define BUF_SIZE (16 * 1024)
+
+static uint8_t buffer[BUF_SIZE + 64];
+
+/* Bytewise reference implementation of the reflected CRC32C */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t len)
+{
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void test_1(void)
+{
+    size_t a, s;
+    struct iovec iov[3];
+
+    /* Check value from RFC 3720, appendix B.4 */
+    g_assert_cmphex(crc32c(0xffffffff, (const uint8_t *)"123456789", 9),
+                    ==, 0xe3069283);
+
+    memset(buffer, 0, 32);
+    g_assert_cmphex(crc32c(0xffffffff, buffer, 32), ==, 0x8a9136aa);
+    memset(buffer, 0xff, 32);
+    g_assert_cmphex(crc32c(0xffffffff, buffer, 32), ==, 0x62a8ab43);
+
+    for (s = 0; s < sizeof(buffer); s++) {
+        buffer[s] = s * 31 + (s >> 8);
+    }
+
+    /* Sizes and alignments around the word and block boundaries */
+    for (a = 0; a < 64; a++) {
+        for (s = 0; s < 1024; s++) {
+            g_assert_cmphex(crc32c(0xffffffff, buffer + a, s), ==,
+                            crc32c_ref(0xffffffff, buffer + a, s));
+        }
+        for (s = 1024; s <= BUF_SIZE; s += 509) {
+            g_assert_cmphex(crc32c(0xffffffff, buffer + a, s), ==,
+                            crc32c_ref(0xffffffff, buffer + a, s));
+        }
+    }
+
+    /* Chained computation across an I/O vector */
+    iov[0] = (struct iovec) { buffer + 1, 3 };
+    iov[1] = (struct iovec) { buffer + 4, 5000 };
+    iov[2] = (struct iovec) { buffer + 5004, 7 };
+    g_assert_cmphex(iov_crc32c(0xffffffff, iov, 3), ==,
+                    crc32c_ref(0xffffffff, buffer + 1, 5010));
+}
+
+static void test_2(void)
+{
+    do {
+        test_1();
+    } while (test_crc32c_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/accel", test_2);
+
+    return g_test_run();
+}
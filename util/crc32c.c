@@ -27,6 +27,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/crc32c.h"
+#include "qemu/bswap.h"
+#include "host/cpuinfo.h"
+
+typedef uint32_t (*crc32c_accel_fn)(uint32_t, const uint8_t *, size_t);
 
 /*
  * This is the CRC-32C table
@@ -104,13 +108,22 @@ static const uint32_t crc32c_table[256] = {
     0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_int(uint32_t crc, const uint8_t *data, size_t length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#include "host/crc32c.c.inc"
+
+static crc32c_accel_fn crc32c_accel;
+static unsigned accel_index;
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_accel(crc, data, length) ^ 0xffffffff;
 }
 
 uint32_t iov_crc32c(uint32_t crc, const struct iovec *iov, size_t iov_cnt)
@@ -121,3 +134,18 @@ uint32_t iov_crc32c(uint32_t crc, const struct iovec *iov, size_t iov_cnt)
     }
     return crc ^ 0xffffffff;
 }
+
+bool test_crc32c_next_accel(void)
+{
+    if (accel_index != 0) {
+        crc32c_accel = accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    crc32c_accel = accel_table[accel_index];
+}
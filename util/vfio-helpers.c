@@ -190,17 +190,25 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
     }
 }
 
-/**
- * Initialize device IRQ with @irq_type and register an event notifier.
+/*
+ * Connect the first @count vectors of @irq_type to the event notifiers in @e.
+ * Devices may support fewer vectors than requested, the number of vectors
+ * actually set up is returned.  Vectors past that are not triggered; it is
+ * up to the caller to route their sources to one of the set up vectors.
+ *
+ * Returns a negative errno on failure.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier **e,
+                            unsigned count, int irq_type, Error **errp)
 {
     int r;
     struct vfio_irq_set *irq_set;
     size_t irq_set_size;
     struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+    int32_t *fds;
+    unsigned i;
 
+    assert(count > 0);
     irq_info.index = irq_type;
     if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
         error_setg_errno(errp, errno, "Failed to get device interrupt info");
@@ -210,8 +218,13 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         error_setg(errp, "Device interrupt doesn't support eventfd");
         return -EINVAL;
     }
+    if (!irq_info.count) {
+        error_setg(errp, "Device has no interrupt of this type");
+        return -EINVAL;
+    }
+    count = MIN(count, irq_info.count);
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int32_t);
     irq_set = g_malloc0(irq_set_size);
 
     /* Get to a known IRQ state */
@@ -220,17 +233,21 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
         .index = irq_info.index,
         .start = 0,
-        .count = 1,
+        .count = count,
     };
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
+    fds = (int32_t *)&irq_set->data;
+    for (i = 0; i < count; i++) {
+        fds[i] = event_notifier_get_fd(e[i]);
+    }
+    trace_qemu_vfio_pci_init_irqs(s, irq_type, count, irq_info.count);
     r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
     g_free(irq_set);
     if (r) {
         error_setg_errno(errp, errno, "Failed to setup device interrupt");
         return -errno;
     }
-    return 0;
+    return count;
 }
 
 static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
@@ -797,6 +814,29 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
     return 0;
 }
 
+/*
+ * Look up the IOVA of [host, host + size) if the whole area is covered by a
+ * fixed mapping, e.g. one set up for guest RAM through bdrv_register_buf().
+ * Unlike qemu_vfio_dma_map(), this never creates a mapping and so never
+ * fails with resource exhaustion; callers fall back to a temporary mapping
+ * when false is returned.
+ */
+bool qemu_vfio_dma_find_fixed(QEMUVFIOState *s, void *host, size_t size,
+                              uint64_t *iova)
+{
+    int index;
+    IOVAMapping *mapping;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    mapping = qemu_vfio_find_mapping(s, host, &index);
+    if (!mapping ||
+        (uint8_t *)host + size > (uint8_t *)mapping->host + mapping->size) {
+        return false;
+    }
+    *iova = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
+    return true;
+}
+
 /* Reset the high watermark and free all "temporary" mappings. */
 int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
 {
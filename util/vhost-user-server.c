@@ -8,6 +8,7 @@
  * later.  See the COPYING file in the top-level directory.
  */
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/vhost-user-server.h"
@@ -52,8 +53,19 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * With vhost_user_server_set_queue_ctxs(), the kick fds of the virtqueues are
+ * instead spread over several AioContexts, so that virtqueues are processed in
+ * parallel. vu_client_trip() still runs in VuServer->ctx. Since libvhost-user
+ * is not thread-safe, each vhost-user message is processed only after all
+ * virtqueues have been quiesced: their kick fd handlers are removed and any
+ * in-flight requests are waited for. The virtqueues are resumed after the
+ * message has been handled.
  */
 
+/* How often vu_quiesce_queues() checks for in-flight requests */
+#define VU_QUIESCE_POLL_NS (100 * SCALE_US)
+
 static void vmsg_close_fds(VhostUserMsg *vmsg)
 {
     int i;
@@ -107,6 +119,72 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+static void kick_handler(void *opaque);
+
+/* Returns the AioContext in which the kick fd of @vu_fd_watch is monitored */
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    if (server->queue_ctxs) {
+        /* libvhost-user passes the virtqueue index as pvt */
+        long idx = (long)vu_fd_watch->pvt;
+
+        return server->queue_ctxs[idx % server->num_queue_ctxs];
+    }
+    return server->ctx;
+}
+
+/*
+ * Stop processing virtqueues in the queue AioContexts and wait for in-flight
+ * requests, which may access the memory table and the vrings.
+ */
+static void coroutine_fn vu_quiesce_queues(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (qatomic_read(&server->queues_quiesced)) {
+        return;
+    }
+
+    qatomic_set(&server->queues_quiesced, true);
+    smp_mb(); /* pairs with qatomic_inc() in kick_handler() */
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                           vu_fd_watch->fd, NULL, NULL, NULL, NULL, NULL);
+    }
+
+    /*
+     * Requests complete in other threads, so wait_idle cannot be used here.
+     * This only happens while processing vhost-user messages, which are rare
+     * once the device is running.
+     */
+    while (vhost_user_server_has_in_flight(server)) {
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, VU_QUIESCE_POLL_NS);
+    }
+}
+
+static void vu_resume_queues(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (!qatomic_read(&server->queues_quiesced)) {
+        return;
+    }
+
+    qatomic_set(&server->queues_quiesced, false);
+
+    if (!server->ctx) {
+        /* vhost_user_server_attach_aio_context() will restart the queues */
+        return;
+    }
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                           vu_fd_watch->fd, kick_handler, NULL, NULL, NULL,
+                           vu_fd_watch);
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -199,6 +277,11 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    if (server->queue_ctxs) {
+        /* libvhost-user is going to process the message now */
+        vu_quiesce_queues(server);
+    }
+
     return true;
 
 fail:
@@ -222,6 +305,12 @@ static coroutine_fn void vu_client_trip(void *opaque)
         if (!vu_dispatch(vu_dev) && server->ctx) {
             break;
         }
+        vu_resume_queues(server);
+    }
+
+    if (server->queue_ctxs) {
+        /* Kick handlers in other threads must not run after vu_deinit() */
+        vu_quiesce_queues(server);
     }
 
     if (vhost_user_server_has_in_flight(server)) {
@@ -236,6 +325,7 @@ static coroutine_fn void vu_client_trip(void *opaque)
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
+    qatomic_set(&server->queues_quiesced, false);
 
     object_unref(OBJECT(server->sioc));
     server->sioc = NULL;
@@ -261,15 +351,30 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+
+    if (server->queue_ctxs) {
+        /*
+         * Make vu_quiesce_queues() wait for us, and back off if it has
+         * already started
+         */
+        qatomic_inc(&server->in_flight);
+        if (qatomic_read(&server->queues_quiesced)) {
+            vhost_user_server_dec_in_flight(server);
+            return;
+        }
+    }
 
     vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+
+    if (server->queue_ctxs) {
+        vhost_user_server_dec_in_flight(server);
+    }
 }
 
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
@@ -303,11 +408,15 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        qemu_socket_set_nonblock(fd);
+
+        /* Otherwise vu_resume_queues() installs the handler */
+        if (!qatomic_read(&server->queues_quiesced)) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                               kick_handler, NULL, NULL, NULL, vu_fd_watch);
+        }
     }
 }
 
@@ -325,7 +434,8 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                       NULL, NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
     g_free(vu_fd_watch);
@@ -385,8 +495,9 @@ void vhost_user_server_stop(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                               vu_fd_watch);
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -400,6 +511,20 @@ void vhost_user_server_stop(VuServer *server)
     }
 }
 
+/*
+ * Spread virtqueue processing over @ctxs, see "Theory of operation" above.
+ * Must be called before a client connects, and @ctxs must remain valid until
+ * the server is stopped.
+ */
+void vhost_user_server_set_queue_ctxs(VuServer *server, AioContext **ctxs,
+                                      unsigned int num_ctxs)
+{
+    assert(!server->sioc);
+
+    server->queue_ctxs = num_ctxs ? ctxs : NULL;
+    server->num_queue_ctxs = num_ctxs;
+}
+
 /*
  * Allow the next client to connect to the server. Called from a BH in the main
  * loop.
@@ -423,9 +548,13 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    /* If a message is being processed, vu_resume_queues() does this */
+    if (!qatomic_read(&server->queues_quiesced)) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, kick_handler, NULL, NULL,
+                               NULL, vu_fd_watch);
+        }
     }
 
     if (server->co_trip) {
@@ -456,8 +585,9 @@ void vhost_user_server_detach_aio_context(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                               vu_fd_watch);
         }
     }
 